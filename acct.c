@@ -17,6 +17,7 @@
  */
 
 #include "acct.h"
+#include "cdefs.h"
 #include "decode.h"
 #include "conv.h"
 #include "daylog.h"
@@ -25,6 +26,7 @@
 #include "localip.h"
 #include "now.h"
 #include "opt.h"
+#include "queue.h"
 
 #define __FAVOR_BSD
 #include <netinet/tcp.h>
@@ -32,11 +34,31 @@
 #include <assert.h>
 #include <ctype.h> /* for isdigit */
 #include <netdb.h> /* for gai_strerror */
+#include <pthread.h>
 #include <stdlib.h> /* for free */
 #include <string.h> /* for memcpy */
 
 uint64_t acct_total_packets = 0, acct_total_bytes = 0;
 
+/* A shard holds everything one capture worker thread has accounted for
+ * since the main thread last collected it.  The totals and graph counters
+ * are cheap to fold in, so cap_poll() does that every time it runs.  The
+ * hosts table is only merged when someone wants to look at it.
+ */
+struct acct_shard {
+   LIST_ENTRY(acct_shard) entries;
+   pthread_mutex_t lock;
+   struct hashtable *hosts;
+   uint64_t total_packets, total_bytes;
+   uint64_t graph_bytes[MAX_GRAPH_DIR + 1], graph_pkts[MAX_GRAPH_DIR + 1];
+};
+
+static LIST_HEAD(shards_head, acct_shard) shards =
+   LIST_HEAD_INITIALIZER(shards);
+
+/* The shard the calling thread accounts into, or NULL for the globals. */
+static _thread_local_ struct acct_shard *this_shard = NULL;
+
 static int using_localnet4 = 0, using_localnet6 = 0;
 static struct addr localnet4, localmask4, localnet6, localmask6;
 
@@ -147,72 +169,155 @@ static int addr_is_local(const struct addr * const a,
    return 0;
 }
 
-/* Account for the given packet summary. */
-void acct_for(const struct pktsummary * const sm,
-              const struct local_ips * const local_ips) {
-   struct bucket *hs = NULL, *hd = NULL;
-   struct bucket *ps, *pd;
-   int dir_in, dir_out;
+struct acct_shard *acct_shard_make(void) {
+   struct acct_shard *sh = xcalloc(1, sizeof(*sh));
 
-#if 0 /* WANT_CHATTY? */
-   printf("%15s > ", addr_to_str(&sm->src));
-   printf("%15s ", addr_to_str(&sm->dst));
-   printf("len %4d proto %2d", sm->len, sm->proto);
+   if (pthread_mutex_init(&sh->lock, NULL) != 0)
+      errx(1, "pthread_mutex_init() failed");
+   sh->hosts = hosts_db_shard_make();
+   LIST_INSERT_HEAD(&shards, sh, entries);
+   return sh;
+}
 
-   if (sm->proto == IPPROTO_TCP || sm->proto == IPPROTO_UDP)
-      printf(" port %5d : %5d", sm->src_port, sm->dst_port);
-   if (sm->proto == IPPROTO_TCP)
-      printf(" %s%s%s%s%s%s",
-         (sm->tcp_flags & TH_FIN)?"F":"",
-         (sm->tcp_flags & TH_SYN)?"S":"",
-         (sm->tcp_flags & TH_RST)?"R":"",
-         (sm->tcp_flags & TH_PUSH)?"P":"",
-         (sm->tcp_flags & TH_ACK)?"A":"",
-         (sm->tcp_flags & TH_URG)?"U":""
-      );
-   printf("\n");
-#endif
+/* Make the calling thread account into the given shard from now on, or
+ * NULL to let go of it.
+ */
+void acct_shard_use(struct acct_shard *sh) {
+   assert(this_shard == NULL || sh == NULL);
+   this_shard = sh;
+   hosts_db_shard_use(sh == NULL ? NULL : sh->hosts);
+}
 
-   /* Totals. */
-   acct_total_packets++;
-   acct_total_bytes += sm->len;
+void acct_shard_lock(struct acct_shard *sh) {
+   if (pthread_mutex_lock(&sh->lock) != 0)
+      errx(1, "pthread_mutex_lock() failed");
+}
 
-   /* Graphs. */
-   dir_out = addr_is_local(&sm->src, local_ips);
-   dir_in  = addr_is_local(&sm->dst, local_ips);
+void acct_shard_unlock(struct acct_shard *sh) {
+   if (pthread_mutex_unlock(&sh->lock) != 0)
+      errx(1, "pthread_mutex_unlock() failed");
+}
 
-   /* Traffic staying within the network isn't counted. */
-   if (dir_out && !dir_in) {
-      daylog_acct((uint64_t)sm->len, GRAPH_OUT);
-      graph_acct((uint64_t)sm->len, GRAPH_OUT);
+/* Move the shard's totals and graph counters into the globals. */
+static void shard_fold(struct acct_shard *sh) {
+   enum graph_dir dir;
+
+   acct_total_packets += sh->total_packets;
+   acct_total_bytes += sh->total_bytes;
+   sh->total_packets = sh->total_bytes = 0;
+   for (dir = MIN_GRAPH_DIR; dir <= MAX_GRAPH_DIR; dir++) {
+      if (sh->graph_pkts[dir] == 0)
+         continue;
+      daylog_acct(sh->graph_bytes[dir], sh->graph_pkts[dir], dir);
+      graph_acct(sh->graph_bytes[dir], dir);
+      sh->graph_bytes[dir] = sh->graph_pkts[dir] = 0;
    }
-   if (dir_in && !dir_out) {
-      daylog_acct((uint64_t)sm->len, GRAPH_IN);
-      graph_acct((uint64_t)sm->len, GRAPH_IN);
+}
+
+/* Called from the main thread. */
+void acct_fold_shards(void) {
+   struct acct_shard *sh;
+
+   LIST_FOREACH(sh, &shards, entries) {
+      acct_shard_lock(sh);
+      shard_fold(sh);
+      acct_shard_unlock(sh);
    }
+}
 
-   if (opt_hosts_max == 0) return; /* skip per-host accounting */
+/* Bring the global hosts_db up to date.  Called from the main thread. */
+void acct_merge_shards(void) {
+   struct acct_shard *sh;
 
-   /* Hosts. */
-   hosts_db_reduce();
-   if (!opt_want_local_only || dir_out) {
-      hs = host_get(&(sm->src));
-      hs->out   += sm->len;
-      hs->total += sm->len;
-      memcpy(hs->u.host.mac_addr, sm->src_mac, sizeof(sm->src_mac));
-      hs->u.host.last_seen_mono = now_mono();
+   LIST_FOREACH(sh, &shards, entries) {
+      acct_shard_lock(sh);
+      shard_fold(sh);
+      hosts_db_merge(sh->hosts);
+      acct_shard_unlock(sh);
    }
+}
 
-   if (!opt_want_local_only || dir_in) {
-      hd = host_get(&(sm->dst));
-      hd->in    += sm->len;
-      hd->total += sm->len;
-      memcpy(hd->u.host.mac_addr, sm->dst_mac, sizeof(sm->dst_mac));
-      /*
-       * Don't update recipient's last seen time, we don't know that
-       * they received successfully.
-       */
+/* Merge just the hosts, leaving the totals and graph counters in the shard
+ * until it's freed.  The owning thread must be gone.
+ */
+void acct_shard_merge_hosts(struct acct_shard *sh) {
+   hosts_db_merge(sh->hosts);
+}
+
+/* Free without merging whatever is left.  The owning thread must be gone. */
+void acct_shard_discard(struct acct_shard *sh) {
+   LIST_REMOVE(sh, entries);
+   hosts_db_shard_free(sh->hosts);
+   pthread_mutex_destroy(&sh->lock);
+   free(sh);
+}
+
+/* Merge and free.  The owning thread must be gone. */
+void acct_shard_free(struct acct_shard *sh) {
+   acct_shard_lock(sh);
+   shard_fold(sh);
+   hosts_db_merge(sh->hosts);
+   acct_shard_unlock(sh);
+   acct_shard_discard(sh);
+}
+
+static void acct_graph(const uint64_t len, const enum graph_dir dir) {
+   if (this_shard != NULL) {
+      this_shard->graph_bytes[dir] += len;
+      this_shard->graph_pkts[dir]++;
+   } else {
+      daylog_acct(len, 1, dir);
+      graph_acct(len, dir);
    }
+}
+
+/* Totals and graphs.  Works out which way the packet went. */
+static void acct_totals(const struct pktsummary * const sm,
+                        const struct local_ips * const local_ips,
+                        int *dir_in, int *dir_out) {
+   /* Totals. */
+   if (this_shard != NULL) {
+      this_shard->total_packets++;
+      this_shard->total_bytes += sm->len;
+   } else {
+      acct_total_packets++;
+      acct_total_bytes += sm->len;
+   }
+
+   /* Graphs. */
+   *dir_out = addr_is_local(&sm->src, local_ips);
+   *dir_in  = addr_is_local(&sm->dst, local_ips);
+
+   /* Traffic staying within the network isn't counted. */
+   if (*dir_out && !*dir_in)
+      acct_graph((uint64_t)sm->len, GRAPH_OUT);
+   if (*dir_in && !*dir_out)
+      acct_graph((uint64_t)sm->len, GRAPH_IN);
+}
+
+static void acct_src(struct bucket *hs, const struct pktsummary * const sm) {
+   hs->out   += sm->len;
+   hs->total += sm->len;
+   memcpy(hs->u.host.mac_addr, sm->src_mac, sizeof(sm->src_mac));
+   hs->u.host.last_seen_mono = now_mono();
+   host_counted(hs);
+}
+
+static void acct_dst(struct bucket *hd, const struct pktsummary * const sm) {
+   hd->in    += sm->len;
+   hd->total += sm->len;
+   memcpy(hd->u.host.mac_addr, sm->dst_mac, sizeof(sm->dst_mac));
+   /*
+    * Don't update recipient's last seen time, we don't know that
+    * they received successfully.
+    */
+   host_counted(hd);
+}
+
+/* Protocols and ports, for whichever of the hosts are being counted. */
+static void acct_ports(const struct pktsummary * const sm,
+                       struct bucket *hs, struct bucket *hd) {
+   struct bucket *ps, *pd;
 
    /* Protocols. */
    if (sm->proto != IPPROTO_INVALID) {
@@ -269,4 +374,108 @@ void acct_for(const struct pktsummary * const sm,
    }
 }
 
+/* Account for the given packet summary. */
+void acct_for(const struct pktsummary * const sm,
+              const struct local_ips * const local_ips) {
+   struct bucket *hs = NULL, *hd = NULL;
+   int dir_in, dir_out;
+
+#if 0 /* WANT_CHATTY? */
+   printf("%15s > ", addr_to_str(&sm->src));
+   printf("%15s ", addr_to_str(&sm->dst));
+   printf("len %4d proto %2d", sm->len, sm->proto);
+
+   if (sm->proto == IPPROTO_TCP || sm->proto == IPPROTO_UDP)
+      printf(" port %5d : %5d", sm->src_port, sm->dst_port);
+   if (sm->proto == IPPROTO_TCP)
+      printf(" %s%s%s%s%s%s",
+         (sm->tcp_flags & TH_FIN)?"F":"",
+         (sm->tcp_flags & TH_SYN)?"S":"",
+         (sm->tcp_flags & TH_RST)?"R":"",
+         (sm->tcp_flags & TH_PUSH)?"P":"",
+         (sm->tcp_flags & TH_ACK)?"A":"",
+         (sm->tcp_flags & TH_URG)?"U":""
+      );
+   printf("\n");
+#endif
+
+   acct_totals(sm, local_ips, &dir_in, &dir_out);
+
+   if (opt_hosts_max == 0) return; /* skip per-host accounting */
+
+   /* Hosts. */
+   hosts_db_evict();
+   hosts_db_reduce();
+   if (!opt_want_local_only || dir_out) {
+      hs = host_get(&(sm->src));
+      acct_src(hs, sm);
+   }
+   if (!opt_want_local_only || dir_in) {
+      hd = host_get(&(sm->dst));
+      acct_dst(hd, sm);
+   }
+   acct_ports(sm, hs, hd);
+}
+
+/* Account for a batch of summaries.  Same result as calling acct_for() on
+ * each, but the host lookups are split into passes so that the cache misses
+ * on the hosts table overlap instead of happening one after another:
+ *  1. hash every address and prefetch its slot in the table,
+ *  2. prefetch the bucket each slot leads to,
+ *  3. do the lookups and apply the updates, in packet order.
+ *
+ * A host's hash doesn't depend on the table, so it's still good if pass 3
+ * reduces or grows the table; only the prefetches are wasted.
+ */
+void acct_for_batch(const struct pktsummary * const sm,
+                    const struct local_ips * const * const local_ips,
+                    const unsigned int n) {
+   uint32_t hash_src[ACCT_BATCH_MAX], hash_dst[ACCT_BATCH_MAX];
+   uint8_t want_src[ACCT_BATCH_MAX], want_dst[ACCT_BATCH_MAX];
+   unsigned int i;
+
+   assert(n <= ACCT_BATCH_MAX);
+   for (i=0; i<n; i++) {
+      int dir_in, dir_out;
+
+      acct_totals(&sm[i], local_ips[i], &dir_in, &dir_out);
+      want_src[i] = !opt_want_local_only || dir_out;
+      want_dst[i] = !opt_want_local_only || dir_in;
+   }
+
+   if (opt_hosts_max == 0) return; /* skip per-host accounting */
+
+   hosts_db_evict();
+   for (i=0; i<n; i++) {
+      if (want_src[i]) {
+         hash_src[i] = host_hash(&sm[i].src);
+         host_prefetch_slot(hash_src[i]);
+      }
+      if (want_dst[i]) {
+         hash_dst[i] = host_hash(&sm[i].dst);
+         host_prefetch_slot(hash_dst[i]);
+      }
+   }
+   for (i=0; i<n; i++) {
+      if (want_src[i])
+         host_prefetch_bucket(hash_src[i]);
+      if (want_dst[i])
+         host_prefetch_bucket(hash_dst[i]);
+   }
+   for (i=0; i<n; i++) {
+      struct bucket *hs = NULL, *hd = NULL;
+
+      hosts_db_reduce();
+      if (want_src[i]) {
+         hs = host_get_hashed(&sm[i].src, hash_src[i]);
+         acct_src(hs, &sm[i]);
+      }
+      if (want_dst[i]) {
+         hd = host_get_hashed(&sm[i].dst, hash_dst[i]);
+         acct_dst(hd, &sm[i]);
+      }
+      acct_ports(&sm[i], hs, hd);
+   }
+}
+
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
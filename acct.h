@@ -8,6 +8,7 @@
 
 struct pktsummary;
 struct local_ips;
+struct acct_shard;
 
 extern uint64_t acct_total_packets, acct_total_bytes;
 
@@ -15,4 +16,21 @@ void acct_init_localnet(const char *spec);
 void acct_for(const struct pktsummary * const sm,
               const struct local_ips * const local_ips);
 
+/* Largest batch acct_for_batch() takes, and the most --batch allows. */
+#define ACCT_BATCH_MAX 256
+void acct_for_batch(const struct pktsummary * const sm,
+                    const struct local_ips * const * const local_ips,
+                    const unsigned int n);
+
+/* Per-thread accounting, for capture worker threads. */
+struct acct_shard *acct_shard_make(void);
+void acct_shard_use(struct acct_shard *sh);
+void acct_shard_lock(struct acct_shard *sh);
+void acct_shard_unlock(struct acct_shard *sh);
+void acct_shard_merge_hosts(struct acct_shard *sh);
+void acct_shard_discard(struct acct_shard *sh);
+void acct_shard_free(struct acct_shard *sh);
+void acct_fold_shards(void);
+void acct_merge_shards(void);
+
 /* vim:set ts=3 sw=3 tw=80 expandtab: */
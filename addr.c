@@ -8,6 +8,7 @@
  */
 
 #include "addr.h"
+#include "cdefs.h"
 
 #include <arpa/inet.h> /* for inet_ntop */
 #include <assert.h>
@@ -26,13 +27,44 @@ int addr_equal(const struct addr * const a, const struct addr * const b)
    }
 }
 
-static char _addrstrbuf[INET6_ADDRSTRLEN];
+/* IPv4 before IPv6, then in numeric order. */
+int addr_cmp(const struct addr * const a, const struct addr * const b)
+{
+   if (a->family != b->family)
+      return ((a->family == IPv4) ? -1 : 1);
+   if (a->family == IPv4) {
+      const uint32_t x = ntohl(a->ip.v4), y = ntohl(b->ip.v4);
+
+      return ((x < y) ? -1 : (x > y));
+   } else {
+      assert(a->family == IPv6);
+      return (memcmp(&(a->ip.v6), &(b->ip.v6), sizeof(a->ip.v6)));
+   }
+}
+
+static _thread_local_ char _addrstrbuf[INET6_ADDRSTRLEN];
+/* Web pages and JSON can list millions of addresses, so IPv4 ones are
+ * written out by hand instead of going through inet_ntoa() and printf().
+ */
 const char *addr_to_str(const struct addr * const a)
 {
    if (a->family == IPv4) {
-      struct in_addr in;
-      in.s_addr = a->ip.v4;
-      return (inet_ntoa(in));
+      const unsigned char *octet = (const unsigned char *)&(a->ip.v4);
+      char *p = _addrstrbuf;
+      int i;
+
+      for (i=0; i<4; i++) {
+         unsigned int o = octet[i];
+
+         if (o >= 100)
+            *p++ = (char)('0' + o / 100);
+         if (o >= 10)
+            *p++ = (char)('0' + o / 10 % 10);
+         *p++ = (char)('0' + o % 10);
+         *p++ = '.';
+      }
+      p[-1] = '\0';
+      return (_addrstrbuf);
    } else {
       assert(a->family == IPv6);
       inet_ntop(AF_INET6, &(a->ip.v6), _addrstrbuf, sizeof(_addrstrbuf));
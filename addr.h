@@ -23,6 +23,7 @@ struct addr {
 };
 
 int addr_equal(const struct addr * const a, const struct addr * const b);
+int addr_cmp(const struct addr * const a, const struct addr * const b);
 const char *addr_to_str(const struct addr * const a);
 void addr_mask(struct addr *a, const struct addr * const mask);
 int addr_inside(const struct addr * const a,
@@ -0,0 +1,119 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * bench_hosts.c: how fast the hosts table is, and how big.
+ *
+ * Inserts n random-looking IPv4 hosts, finds them all again in a shuffled
+ * order, then looks for n others that were never inserted.  Memory is what the table and its
+ * host pool hold, per host.  Build it from a configured tree, against the
+ * whole of darkstat:
+ *
+ *   cc -O2 -o bench_hosts bench_hosts.c -lpcap -lz -lpthread
+ *   ./bench_hosts 100000 1000000 10000000
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#define main darkstat_main
+#include "dev_all.c"
+#undef main
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Multiplying by an odd number is a bijection on 32 bits, so distinct i give
+ * distinct addresses, spread over the whole address space.  Hosts are
+ * 0..n-1 and misses are n..2n-1, so no miss can be a host.
+ */
+static struct addr
+bench_addr(const uint32_t i)
+{
+   struct addr a;
+
+   memset(&a, 0, sizeof(a));
+   a.family = IPv4;
+   a.ip.v4 = i * 2654435761U;
+   return (a);
+}
+
+static double
+nsec_per(const struct timespec *t, const uint32_t n)
+{
+   return ((double)timer_nsec(t) / n);
+}
+
+static void
+bench(const uint32_t n)
+{
+   struct timespec t;
+   struct pool_stats st;
+   uint32_t i, *order;
+   volatile uintptr_t sink = 0; /* so the lookups aren't optimized out */
+   double insert, hit, miss, bytes;
+
+   opt_hosts_max = n + 1; /* never reduce */
+   opt_hosts_keep = n / 2;
+   hosts_db_init();
+
+   timer_start(&t);
+   for (i=0; i<n; i++) {
+      struct addr a = bench_addr(i);
+      sink += (uintptr_t)host_get(&a);
+   }
+   insert = nsec_per(&t, n);
+
+   pool_stats(hosts_db->pools->host, &st);
+   bytes = (double)st.bytes + (double)hosts_db->size *
+      (sizeof(*hosts_db->hashes) + sizeof(*hosts_db->table));
+
+   order = xmalloc(n * sizeof(*order));
+   for (i=0; i<n; i++)
+      order[i] = i;
+   srandom(1);
+   for (i=n-1; i>0; i--) {
+      uint32_t j = (uint32_t)random() % (i + 1), tmp = order[i];
+
+      order[i] = order[j];
+      order[j] = tmp;
+   }
+
+   timer_start(&t);
+   for (i=0; i<n; i++) {
+      struct addr a = bench_addr(order[i]);
+      sink += (uintptr_t)host_find(&a);
+   }
+   hit = nsec_per(&t, n);
+
+   timer_start(&t);
+   for (i=0; i<n; i++) {
+      struct addr a = bench_addr(n + order[i]);
+      sink += (uintptr_t)host_find(&a);
+   }
+   miss = nsec_per(&t, n);
+
+   printf("%10u %8.0f ns %6.0f ns %6.0f ns %8.1f %10u\n",
+      n, insert, hit, miss, bytes / n, hosts_db->size);
+   free(order);
+   hosts_db_free();
+}
+
+int
+main(int argc, char **argv)
+{
+   int i;
+
+   now_init();
+   printf("%10s %11s %9s %9s %8s %10s\n",
+      "hosts", "insert", "hit", "miss", "B/host", "slots");
+   if (argc < 2) {
+      bench(100000);
+      bench(1000000);
+      bench(10000000);
+   }
+   for (i=1; i<argc; i++)
+      bench((uint32_t)strtoul(argv[i], NULL, 10));
+   return (0);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -14,22 +14,33 @@
 #include "conv.h"
 #include "decode.h"
 #include "err.h"
+#include "event.h"
 #include "hosts_db.h"
 #include "localip.h"
+#include "metrics.h"
 #include "now.h"
 #include "opt.h"
+#include "pcapfile.h"
+#include "pktring.h"
 #include "queue.h"
 #include "str.h"
+#include "tpacket.h"
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #ifdef HAVE_SYS_FILIO_H
 # include <sys/filio.h> /* Solaris' FIONBIO hides here */
 #endif
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pcap.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,11 +52,17 @@ char *title_interfaces = NULL; /* for html.c */
  *  - cap_add_ifname() one or more times
  *  - cap_add_filter() zero or more times
  *  - cap_start() once to start listening
- * Once per main loop:
- *  - cap_fd_set() to update the select() set
- *  - cap_poll() to read from ready pcap fds
+ *  - cap_start_workers() once the databases are up, to start the capture
+ *    thread (or --fanout threads)
+ * From then on the event loop calls cap_poll() when there are packets for
+ * us, or every CAP_TIMEOUT_MSEC where we can't tell.
  * Shutdown:
  *  - cap_stop()
+ *
+ * Or, to read capture files instead:
+ *  - cap_add_capfile() one or more times
+ *  - cap_add_filter() zero or more times
+ *  - cap_from_files()
  */
 
 struct strnode {
@@ -53,15 +70,34 @@ struct strnode {
    const char *str;
 };
 
+#ifdef HAVE_TPACKET_V3
+/* With --fanout, each interface gets several rings in a PACKET_FANOUT group
+ * and a thread per ring.  Each thread decodes and accounts into its own
+ * shard, see acct.c.
+ */
+struct cap_worker {
+   struct cap_iface *iface;
+   struct tpacket_ring *ring;
+   struct local_ips local_ips;
+   struct acct_shard *shard;
+   pthread_t thread;
+};
+#endif
+
 struct cap_iface {
    STAILQ_ENTRY(cap_iface) entries;
 
    const char *name;
    const char *filter;
    pcap_t *pcap;
+#ifdef HAVE_TPACKET_V3
+   struct tpacket_ring *ring; /* instead of pcap, with --tpacket */
+   struct cap_worker *workers; /* instead of ring, with --fanout */
+#endif
    int fd;
    const struct linkhdr *linkhdr;
    struct local_ips local_ips;
+   unsigned int pkts_recv, pkts_drop; /* atomic, see cap_stats_collect() */
 };
 
 static STAILQ_HEAD(cli_ifnames_head, strnode) cli_ifnames =
@@ -70,12 +106,30 @@ static STAILQ_HEAD(cli_ifnames_head, strnode) cli_ifnames =
 static STAILQ_HEAD(cli_filters_head, strnode) cli_filters =
    STAILQ_HEAD_INITIALIZER(cli_filters);
 
+static STAILQ_HEAD(cli_capfiles_head, strnode) cli_capfiles =
+   STAILQ_HEAD_INITIALIZER(cli_capfiles);
+
 static STAILQ_HEAD(cap_ifs_head, cap_iface) cap_ifs =
    STAILQ_HEAD_INITIALIZER(cap_ifs);
 
 /* The read timeout passed to pcap_open_live() */
 #define CAP_TIMEOUT_MSEC 500
 
+/* The capture thread decodes packets and hands the summaries to the main
+ * thread through pktring, then writes a byte to the doorbell pipe to wake
+ * it up.  That way a slow page render or export only backs up our ring
+ * instead of the kernel's buffer.
+ */
+static struct pktring *pktring = NULL;
+static int doorbell[2] = { -1, -1 };
+static pthread_t cap_thread;
+static int cap_thread_running = 0; /* use __atomic builtins */
+static unsigned int cap_thread_pushed = 0; /* only used by cap_thread */
+static unsigned int cap_thread_recv, cap_thread_drop; /* __atomic too */
+
+static struct event_timer *cap_timer = NULL;
+static int cap_watching_ifaces = 0;
+
 void cap_add_ifname(const char *ifname) {
    struct strnode *n = xmalloc(sizeof(*n));
    n->str = ifname;
@@ -88,6 +142,12 @@ void cap_add_filter(const char *filter) {
    STAILQ_INSERT_TAIL(&cli_filters, n, entries);
 }
 
+void cap_add_capfile(const char *capfile) {
+   struct strnode *n = xmalloc(sizeof(*n));
+   n->str = capfile;
+   STAILQ_INSERT_TAIL(&cli_capfiles, n, entries);
+}
+
 static void cap_set_filter(pcap_t *pcap, const char *filter) {
    struct bpf_program prog;
    char *tmp_filter;
@@ -112,9 +172,94 @@ static void cap_set_filter(pcap_t *pcap, const char *filter) {
    free(tmp_filter);
 }
 
+/* Work out the linkhdr and what snaplen we need. */
+static int cap_snaplen(struct cap_iface *iface, const int linktype) {
+   int snaplen;
+
+   verbosef("linktype is %d", linktype);
+   if ((linktype == DLT_EN10MB) && opt_want_macs)
+      hosts_db_show_macs = 1;
+   iface->linkhdr = getlinkhdr(linktype);
+   if (iface->linkhdr == NULL)
+      errx(1, "unknown linktype %d", linktype);
+   if (iface->linkhdr->decoder == NULL)
+      errx(1, "no decoder for linktype %d", linktype);
+   snaplen = getsnaplen(iface->linkhdr);
+   if (opt_want_pppoe) {
+      snaplen += PPPOE_HDR_LEN;
+      if (linktype != DLT_EN10MB)
+         errx(1, "can't do PPPoE decoding on a non-Ethernet linktype");
+   }
+   verbosef("calculated snaplen minimum %d", snaplen);
+#ifdef linux
+   /* FIXME: actually due to libpcap moving to mmap (!!!)
+    * work out which version and fix the way we do capture
+    * on linux:
+    */
+
+   /* Ubuntu 9.04 has a problem where requesting snaplen <= 60 will
+    * give us 42 bytes, and we need at least 54 for TCP headers.
+    *
+    * Hack to set minimum snaplen to tcpdump's default:
+    */
+   snaplen = MAX(snaplen, 96);
+#endif
+   if (opt_want_snaplen > -1)
+      snaplen = opt_want_snaplen;
+   verbosef("using snaplen %d", snaplen);
+   return snaplen;
+}
+
+#ifdef HAVE_TPACKET_V3
+static void cap_start_tpacket(struct cap_iface *iface, const int promisc) {
+   static uint16_t fanout_group = 0;
+   int linktype, snaplen = 0;
+   unsigned int i;
+
+   if (iface->filter)
+      verbosef("capturing on interface '%s' with filter '%s'",
+         iface->name, iface->filter);
+   else
+      verbosef("capturing on interface '%s' with no filter", iface->name);
+   if (promisc)
+      verbosef("capturing in promiscuous mode");
+   else
+      verbosef("capturing in non-promiscuous mode");
+
+   if (opt_fanout == 0) {
+      iface->ring = tpacket_open(iface->name, promisc, &linktype);
+      snaplen = cap_snaplen(iface, linktype);
+      tpacket_set_filter(iface->ring, iface->filter, snaplen);
+      iface->fd = tpacket_fd(iface->ring);
+      return;
+   }
+
+   /* Fanout group ids are global, so pick one unlikely to clash. */
+   if (fanout_group == 0)
+      fanout_group = (uint16_t)getpid();
+   else
+      fanout_group++;
+
+   iface->workers = xcalloc(opt_fanout, sizeof(*iface->workers));
+   for (i=0; i<opt_fanout; i++) {
+      struct cap_worker *w = &iface->workers[i];
+
+      w->iface = iface;
+      w->ring = tpacket_open(iface->name, promisc, &linktype);
+      if (i == 0)
+         snaplen = cap_snaplen(iface, linktype);
+      tpacket_set_filter(w->ring, iface->filter, snaplen);
+      tpacket_join_fanout(w->ring, fanout_group);
+      localip_init(&w->local_ips);
+   }
+   verbosef("fanout group %u on '%s' has %u rings",
+      fanout_group, iface->name, opt_fanout);
+}
+#endif
+
 static void cap_start_one(struct cap_iface *iface, const int promisc) {
    char errbuf[PCAP_ERRBUF_SIZE], *tmp_device;
-   int linktype, snaplen, waited;
+   int snaplen, waited;
 
    /* pcap wants a non-const interface name string */
    tmp_device = xstrdup(iface->name);
@@ -150,38 +295,7 @@ static void cap_start_one(struct cap_iface *iface, const int promisc) {
    }
 
    /* Work out the linktype and what snaplen we need. */
-   linktype = pcap_datalink(iface->pcap);
-   verbosef("linktype is %d", linktype);
-   if ((linktype == DLT_EN10MB) && opt_want_macs)
-      hosts_db_show_macs = 1;
-   iface->linkhdr = getlinkhdr(linktype);
-   if (iface->linkhdr == NULL)
-      errx(1, "unknown linktype %d", linktype);
-   if (iface->linkhdr->decoder == NULL)
-      errx(1, "no decoder for linktype %d", linktype);
-   snaplen = getsnaplen(iface->linkhdr);
-   if (opt_want_pppoe) {
-      snaplen += PPPOE_HDR_LEN;
-      if (linktype != DLT_EN10MB)
-         errx(1, "can't do PPPoE decoding on a non-Ethernet linktype");
-   }
-   verbosef("calculated snaplen minimum %d", snaplen);
-#ifdef linux
-   /* FIXME: actually due to libpcap moving to mmap (!!!)
-    * work out which version and fix the way we do capture
-    * on linux:
-    */
-
-   /* Ubuntu 9.04 has a problem where requesting snaplen <= 60 will
-    * give us 42 bytes, and we need at least 54 for TCP headers.
-    *
-    * Hack to set minimum snaplen to tcpdump's default:
-    */
-   snaplen = MAX(snaplen, 96);
-#endif
-   if (opt_want_snaplen > -1)
-      snaplen = opt_want_snaplen;
-   verbosef("using snaplen %d", snaplen);
+   snaplen = cap_snaplen(iface, pcap_datalink(iface->pcap));
 
    /* Close and re-open pcap to use the new snaplen. */
    pcap_close(iface->pcap);
@@ -268,10 +382,21 @@ void cap_start(const int promisc) {
       iface->name = ifname->str;
       iface->filter = (filter == NULL) ? NULL : filter->str;
       iface->pcap = NULL;
+#ifdef HAVE_TPACKET_V3
+      iface->ring = NULL;
+      iface->workers = NULL;
+#endif
       iface->fd = -1;
       iface->linkhdr = NULL;
+      iface->pkts_recv = 0;
+      iface->pkts_drop = 0;
       localip_init(&iface->local_ips);
       STAILQ_INSERT_TAIL(&cap_ifs, iface, entries);
+#ifdef HAVE_TPACKET_V3
+      if (opt_want_tpacket)
+         cap_start_tpacket(iface, promisc);
+      else
+#endif
       cap_start_one(iface, promisc);
 
       free(ifname);
@@ -300,58 +425,61 @@ void cap_start(const int promisc) {
    }
 }
 
-#ifdef linux
-# define _unused_on_linux_ _unused_
-# define _unused_otherwise_
-#else
-# define _unused_on_linux_
-# define _unused_otherwise_ _unused_
-#endif
+unsigned int cap_pkts_recv = 0, cap_pkts_drop = 0;
+unsigned int cap_ring_size = 0, cap_ring_used = 0, cap_ring_peak = 0;
+uint64_t cap_ring_overflows = 0;
 
-/*
- * Set pcap_fd in the given fd_set.
+/* Each interface's share, for /metrics.  The capture thread writes them
+ * while the main loop reads them.
  */
-void cap_fd_set(fd_set *read_set _unused_on_linux_,
-                int *max_fd _unused_on_linux_,
-                struct timeval *timeout _unused_otherwise_,
-                int *need_timeout) {
-   assert(*need_timeout == 0); /* we're first to get a shot at the fd_set */
-
-#ifdef linux
-   /*
-    * Linux's BPF is immediate, so don't select() as it will lead to horrible
-    * performance.  Instead, use a timeout for buffering.
-    */
-   *need_timeout = 1;
-   timeout->tv_sec = 0;
-   timeout->tv_usec = CAP_TIMEOUT_MSEC * 1000;
-#else
-   {
-      struct cap_iface *iface;
-      STAILQ_FOREACH(iface, &cap_ifs, entries) {
-         /* We have a BSD-like BPF, we can select() on it. */
-         FD_SET(iface->fd, read_set);
-         *max_fd = MAX(*max_fd, iface->fd);
-      }
-   }
-#endif
+static void iface_stats_store(struct cap_iface *iface,
+                              const unsigned int recv,
+                              const unsigned int drop) {
+   __atomic_store_n(&iface->pkts_recv, recv, __ATOMIC_RELAXED);
+   __atomic_store_n(&iface->pkts_drop, drop, __ATOMIC_RELAXED);
 }
 
-unsigned int cap_pkts_recv = 0, cap_pkts_drop = 0;
-
-static void cap_stats_update(void) {
+/* Sum up the kernel's counters.  Only call this from the thread doing the
+ * capturing, since it touches the pcap handles.
+ */
+static void cap_stats_collect(unsigned int *recv, unsigned int *drop) {
    struct cap_iface *iface;
 
-   cap_pkts_recv = 0;
-   cap_pkts_drop = 0;
+   *recv = 0;
+   *drop = 0;
    STAILQ_FOREACH(iface, &cap_ifs, entries) {
       struct pcap_stat ps;
+#ifdef HAVE_TPACKET_V3
+      if (iface->ring != NULL) {
+         unsigned int r, d;
+
+         tpacket_stats(iface->ring, &r, &d);
+         iface_stats_store(iface, r, d);
+         *recv += r;
+         *drop += d;
+         continue;
+      }
+      if (iface->workers != NULL) {
+         unsigned int i, r, d, ir = 0, id = 0;
+
+         for (i=0; i<opt_fanout; i++) {
+            tpacket_stats(iface->workers[i].ring, &r, &d);
+            ir += r;
+            id += d;
+         }
+         iface_stats_store(iface, ir, id);
+         *recv += ir;
+         *drop += id;
+         continue;
+      }
+#endif
       if (pcap_stats(iface->pcap, &ps) != 0) {
          warnx("pcap_stats('%s'): %s", iface->name, pcap_geterr(iface->pcap));
          return;
       }
-      cap_pkts_recv += ps.ps_recv;
-      cap_pkts_drop += ps.ps_drop;
+      iface_stats_store(iface, ps.ps_recv, ps.ps_drop);
+      *recv += ps.ps_recv;
+      *drop += ps.ps_drop;
    }
 }
 
@@ -395,11 +523,262 @@ static void callback(u_char *user,
       acct_for(&sm, &iface->local_ips);
 }
 
+/* Read everything that's waiting on one interface. */
+static void cap_dispatch(struct cap_iface *iface, pcap_handler handler) {
+#ifdef HAVE_TPACKET_V3
+   if (iface->ring != NULL) {
+      /* Walks every block the kernel has handed over. */
+      tpacket_dispatch(iface->ring, handler, (u_char*)iface);
+      return;
+   }
+#endif
+   for (;;) {
+      struct timespec t;
+      int ret;
+
+      timer_start(&t);
+      ret = pcap_dispatch(
+            iface->pcap,
+            -1, /* count = entire buffer */
+            handler,
+            (u_char*)iface); /* user = struct to pass to callback */
+      timer_stop(&t,
+                 2 * CAP_TIMEOUT_MSEC * 1000000,
+                 "pcap_dispatch took too long");
+
+      if (ret < 0) {
+         warnx("pcap_dispatch('%s'): %s",
+            iface->name, pcap_geterr(iface->pcap));
+         continue;
+      }
+
+#if 0 /* debugging */
+      verbosef("iface '%s' got %d pkts", iface->name, ret);
+#endif
+
+#ifdef linux
+      /* keep looping until we've dispatched all the outstanding packets */
+      if (ret == 0)
+         break;
+#else
+      /* we get them all on the first shot */
+      break;
+#endif
+   }
+}
+
+/* Like callback(), but hands the summary to the main thread. */
+static void ring_callback(u_char *user,
+                          const struct pcap_pkthdr *pheader,
+                          const u_char *pdata) {
+   const struct cap_iface * const iface = (struct cap_iface *)user;
+   struct pktsummary sm;
+
+   if (opt_want_hexdump)
+      hexdump(pdata, pheader->caplen, iface->linkhdr);
+   memset(&sm, 0, sizeof(sm));
+   if (iface->linkhdr->decoder(pheader, pdata, &sm) &&
+       pktring_push(pktring, &sm, &iface->local_ips))
+      cap_thread_pushed++;
+}
+
+static void *cap_thread_main(void *arg _unused_) {
+   struct cap_iface *iface;
+   struct pollfd *pfds;
+   unsigned int i, num_fds = 0;
+
+   STAILQ_FOREACH(iface, &cap_ifs, entries)
+      num_fds++;
+   pfds = xcalloc(num_fds, sizeof(*pfds));
+   i = 0;
+   STAILQ_FOREACH(iface, &cap_ifs, entries) {
+      pfds[i].fd = iface->fd;
+      pfds[i].events = POLLIN;
+      i++;
+   }
+
+   while (__atomic_load_n(&cap_thread_running, __ATOMIC_RELAXED)) {
+      unsigned int recv, drop;
+
+      /* Linux's libpcap might not wake us up, so we also use the timeout
+       * for buffering, as the main loop used to.
+       */
+      if (poll(pfds, num_fds, CAP_TIMEOUT_MSEC) == -1) {
+         if (errno == EINTR)
+            continue;
+         err(1, "poll() in capture thread");
+      }
+      cap_thread_pushed = 0;
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         cap_dispatch(iface, ring_callback);
+      if (cap_thread_pushed > 0 &&
+          write(doorbell[1], "", 1) == -1 && errno != EAGAIN)
+         warn("write() to doorbell");
+
+      cap_stats_collect(&recv, &drop);
+      __atomic_store_n(&cap_thread_recv, recv, __ATOMIC_RELAXED);
+      __atomic_store_n(&cap_thread_drop, drop, __ATOMIC_RELAXED);
+   }
+   free(pfds);
+   return NULL;
+}
+
+/* Account for decoded summaries, --batch at a time. */
+static void acct_summaries(const struct pktsummary *sm,
+                           const struct local_ips * const *local_ips,
+                           const unsigned int n) {
+   unsigned int i;
+
+   if (opt_batch == 1) {
+      for (i=0; i<n; i++)
+         acct_for(&sm[i], local_ips[i]);
+      return;
+   }
+   for (i=0; i<n; i+=opt_batch)
+      acct_for_batch(sm+i, local_ips+i, MIN(opt_batch, n-i));
+}
+
+/* Account for what the capture thread has sent us, up to a ring's worth so
+ * we don't starve the rest of the main loop.
+ */
+static void cap_drain_ring(void) {
+   struct pktsummary sm[ACCT_BATCH_MAX];
+   const struct local_ips *local_ips[ACCT_BATCH_MAX];
+   unsigned int n, got, max = pktring_size(pktring);
+   char buf[256];
+
+   /* Empty the pipe before the ring, so we can't miss a wakeup. */
+   while (read(doorbell[0], buf, sizeof(buf)) > 0)
+      ;
+   for (n=0; n<max; n+=got) {
+      for (got=0; got<opt_batch; got++)
+         if (!pktring_pop(pktring, &sm[got], &local_ips[got]))
+            break;
+      acct_summaries(sm, local_ips, got);
+      if (got < opt_batch)
+         break; /* ring is empty */
+   }
+   if (n >= max) {
+      /* We left some behind, ring again to come straight back. */
+      if (write(doorbell[1], "", 1) == -1 && errno != EAGAIN)
+         warn("write() to doorbell");
+   }
+}
+
+#ifdef HAVE_TPACKET_V3
+static int workers_running = 0; /* use __atomic builtins */
+
+/* Like callback(), but for a worker's ring. */
+static void worker_callback(u_char *user,
+                            const struct pcap_pkthdr *pheader,
+                            const u_char *pdata) {
+   const struct cap_worker * const w = (struct cap_worker *)user;
+   struct pktsummary sm;
+
+   if (opt_want_hexdump)
+      hexdump(pdata, pheader->caplen, w->iface->linkhdr);
+   memset(&sm, 0, sizeof(sm));
+   if (w->iface->linkhdr->decoder(pheader, pdata, &sm))
+      acct_for(&sm, &w->local_ips);
+}
+
+static void *worker_main(void *arg) {
+   struct cap_worker *w = arg;
+   struct pollfd pfd;
+
+   now_init();
+   acct_shard_use(w->shard);
+   pfd.fd = tpacket_fd(w->ring);
+   pfd.events = POLLIN;
+   while (__atomic_load_n(&workers_running, __ATOMIC_RELAXED)) {
+      if (poll(&pfd, 1, CAP_TIMEOUT_MSEC) == -1) {
+         if (errno == EINTR)
+            continue;
+         err(1, "poll() on '%s'", w->iface->name);
+      }
+      now_update();
+      localip_update(w->iface->name, &w->local_ips);
+      acct_shard_lock(w->shard);
+      tpacket_dispatch(w->ring, worker_callback, (u_char*)w);
+      acct_shard_unlock(w->shard);
+   }
+   return NULL;
+}
+#endif
+
+/* Signals are for the main thread. */
+static void block_signals(sigset_t *old) {
+   sigset_t all;
+
+   sigfillset(&all);
+   if (pthread_sigmask(SIG_BLOCK, &all, old) != 0)
+      errx(1, "pthread_sigmask() failed");
+}
+
+static void restore_signals(const sigset_t *old) {
+   if (pthread_sigmask(SIG_SETMASK, old, NULL) != 0)
+      errx(1, "pthread_sigmask() failed");
+}
+
+/* Start the capture thread, or the --fanout threads. */
+static void cap_start_threads(void) {
+   sigset_t old;
+#ifdef HAVE_TPACKET_V3
+   struct cap_iface *iface;
+   unsigned int i;
+
+   if (opt_fanout > 0) {
+      block_signals(&old);
+      __atomic_store_n(&workers_running, 1, __ATOMIC_RELAXED);
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         for (i=0; i<opt_fanout; i++) {
+            struct cap_worker *w = &iface->workers[i];
+
+            w->shard = acct_shard_make();
+            if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+               errx(1, "pthread_create() failed");
+         }
+      restore_signals(&old);
+      verbosef("started %u capture threads per interface", opt_fanout);
+      return;
+   }
+#endif
+   if (opt_ring_size == 0)
+      return; /* capture from the main loop */
+
+   pktring = pktring_make(opt_ring_size);
+   cap_ring_size = pktring_size(pktring);
+   if (pipe(doorbell) == -1)
+      err(1, "pipe() for doorbell");
+   fd_set_nonblock(doorbell[0]);
+   fd_set_nonblock(doorbell[1]);
+
+   block_signals(&old);
+   __atomic_store_n(&cap_thread_running, 1, __ATOMIC_RELAXED);
+   if (pthread_create(&cap_thread, NULL, cap_thread_main, NULL) != 0)
+      errx(1, "pthread_create() failed");
+   restore_signals(&old);
+   verbosef("started capture thread, ring of %u packets", cap_ring_size);
+}
+
+static void cap_stats_update(void) {
+   if (pktring != NULL) {
+      cap_pkts_recv = __atomic_load_n(&cap_thread_recv, __ATOMIC_RELAXED);
+      cap_pkts_drop = __atomic_load_n(&cap_thread_drop, __ATOMIC_RELAXED);
+      cap_ring_used = pktring_used(pktring);
+      cap_ring_peak = pktring_high_water(pktring);
+      cap_ring_overflows = pktring_overflows(pktring);
+   } else
+      cap_stats_collect(&cap_pkts_recv, &cap_pkts_drop);
+}
+
 /* Process any packets currently in the capture buffer. */
-void cap_poll(fd_set *read_set _unused_on_linux_) {
+static void cap_poll(void) {
    struct cap_iface *iface;
    static int told = 0;
+   struct timespec t;
 
+   timer_start(&t);
    STAILQ_FOREACH(iface, &cap_ifs, entries) {
       /* Once per capture poll, check our IP address.  It's used in accounting
        * for traffic graphs.
@@ -414,48 +793,177 @@ void cap_poll(fd_set *read_set _unused_on_linux_) {
          told = 1;
       }
 
-      for (;;) {
-         struct timespec t;
-         int ret;
-
-         timer_start(&t);
-         ret = pcap_dispatch(
-               iface->pcap,
-               -1, /* count = entire buffer */
-               callback,
-               (u_char*)iface); /* user = struct to pass to callback */
-         timer_stop(&t,
-                    2 * CAP_TIMEOUT_MSEC * 1000000,
-                    "pcap_dispatch took too long");
-
-         if (ret < 0) {
-            warnx("pcap_dispatch('%s'): %s",
-               iface->name, pcap_geterr(iface->pcap));
-            continue;
-         }
-
-#if 0 /* debugging */
-         verbosef("iface '%s' got %d pkts", iface->name, ret);
+#ifdef HAVE_TPACKET_V3
+      if (iface->workers != NULL)
+         continue; /* their shards are folded in below */
 #endif
+      if (pktring == NULL)
+         cap_dispatch(iface, callback);
+   }
+   if (pktring != NULL)
+      cap_drain_ring();
+   if (opt_fanout > 0)
+      acct_fold_shards();
+   cap_stats_update();
+   loop_stage_done(LOOP_CAPTURE, &t);
+}
+
+void cap_metrics(struct str *buf) {
+   struct cap_iface *iface;
+
+   metric_head(buf, "darkstat_pcap_received_total", "counter",
+      "Packets the kernel captured, per interface.");
+   STAILQ_FOREACH(iface, &cap_ifs, entries)
+      metric_sample(buf, "darkstat_pcap_received_total", "interface",
+         iface->name, __atomic_load_n(&iface->pkts_recv, __ATOMIC_RELAXED));
+   metric_head(buf, "darkstat_pcap_dropped_total", "counter",
+      "Packets the kernel dropped for lack of room, per interface.");
+   STAILQ_FOREACH(iface, &cap_ifs, entries)
+      metric_sample(buf, "darkstat_pcap_dropped_total", "interface",
+         iface->name, __atomic_load_n(&iface->pkts_drop, __ATOMIC_RELAXED));
+   if (cap_ring_size == 0)
+      return;
+   metric(buf, "darkstat_ring_size", "gauge",
+      "Packet summaries the capture thread's ring holds.", cap_ring_size);
+   metric(buf, "darkstat_ring_used", "gauge",
+      "Packet summaries waiting in the ring.", cap_ring_used);
+   metric(buf, "darkstat_ring_peak", "gauge",
+      "Most packet summaries ever waiting in the ring.", cap_ring_peak);
+   metric(buf, "darkstat_ring_overflows_total", "counter",
+      "Packet summaries lost to a full ring.", cap_ring_overflows);
+}
+
+static void cap_event(void *arg _unused_, const int events _unused_) {
+   cap_poll();
+}
+
+/* Tell the event loop what means there are packets for cap_poll(). */
+static void cap_watch(void) {
+   struct cap_iface *iface;
 
+   if (pktring != NULL) {
+      /* The capture thread rings the doorbell when it has packets for us. */
+      event_add(doorbell[0], EVENT_READ, 0, cap_event, NULL);
+      return;
+   }
+#ifdef HAVE_TPACKET_V3
+   if (opt_fanout > 0) {
+      /* The workers do the capturing.  Wake up regularly to fold their
+       * counters into the graphs.
+       */
+      cap_timer = event_timer_add(CAP_TIMEOUT_MSEC, cap_event, NULL);
+      return;
+   }
+   if (opt_want_tpacket) {
+      /* The ring becomes readable when the kernel retires a block, which
+       * already batches packets for us.
+       */
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         event_add(iface->fd, EVENT_READ, 0, cap_event, NULL);
+      cap_watching_ifaces = 1;
+      return;
+   }
+#endif
 #ifdef linux
-         /* keep looping until we've dispatched all the outstanding packets */
-         if (ret == 0)
-            break;
+   /*
+    * Linux's BPF is immediate, so don't wait on the fd as it will lead to
+    * horrible performance.  Instead, use a timer for buffering.
+    */
+   (void)iface;
+   cap_timer = event_timer_add(CAP_TIMEOUT_MSEC, cap_event, NULL);
 #else
-         /* we get them all on the first shot */
-         break;
+   /* We have a BSD-like BPF, we can wait on it. */
+   STAILQ_FOREACH(iface, &cap_ifs, entries)
+      event_add(iface->fd, EVENT_READ, 0, cap_event, NULL);
+   cap_watching_ifaces = 1;
 #endif
-      }
+}
+
+static void cap_unwatch(void) {
+   struct cap_iface *iface;
+
+   if (cap_timer != NULL) {
+      event_timer_del(cap_timer);
+      cap_timer = NULL;
    }
-   cap_stats_update();
+   if (pktring != NULL)
+      event_del(doorbell[0]);
+   if (cap_watching_ifaces) {
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         event_del(iface->fd);
+      cap_watching_ifaces = 0;
+   }
+}
+
+void cap_start_workers(void) {
+   cap_start_threads();
+   cap_watch();
+}
+
+#ifdef HAVE_TPACKET_V3
+/* Stop and join every worker before merging what they have left. */
+static void cap_stop_workers(void) {
+   struct cap_iface *iface;
+   unsigned int i;
+
+   if (!__atomic_load_n(&workers_running, __ATOMIC_RELAXED))
+      return;
+   __atomic_store_n(&workers_running, 0, __ATOMIC_RELAXED);
+   STAILQ_FOREACH(iface, &cap_ifs, entries)
+      for (i=0; i<opt_fanout; i++)
+         if (pthread_join(iface->workers[i].thread, NULL) != 0)
+            errx(1, "pthread_join() failed");
+   STAILQ_FOREACH(iface, &cap_ifs, entries)
+      for (i=0; i<opt_fanout; i++)
+         acct_shard_free(iface->workers[i].shard);
+}
+#endif
+
+/* Stop the capture thread and account for whatever it left in the ring. */
+static void cap_stop_thread(void) {
+   struct pktsummary sm;
+   const struct local_ips *local_ips;
+
+   if (pktring == NULL)
+      return;
+   __atomic_store_n(&cap_thread_running, 0, __ATOMIC_RELAXED);
+   if (pthread_join(cap_thread, NULL) != 0)
+      errx(1, "pthread_join() failed");
+   while (pktring_pop(pktring, &sm, &local_ips))
+      acct_for(&sm, local_ips);
+   verbosef("capture ring: peak %u of %u packets, %llu overflowed",
+      pktring_high_water(pktring), pktring_size(pktring),
+      (llu)pktring_overflows(pktring));
+   pktring_free(pktring);
+   pktring = NULL;
+   close(doorbell[0]);
+   close(doorbell[1]);
+   doorbell[0] = doorbell[1] = -1;
 }
 
 void cap_stop(void) {
+   cap_unwatch();
+   cap_stop_thread();
+#ifdef HAVE_TPACKET_V3
+   cap_stop_workers();
+#endif
    while (!STAILQ_EMPTY(&cap_ifs)) {
       struct cap_iface *iface = STAILQ_FIRST(&cap_ifs);
 
       STAILQ_REMOVE_HEAD(&cap_ifs, entries);
+#ifdef HAVE_TPACKET_V3
+      if (iface->workers != NULL) {
+         unsigned int i;
+
+         for (i=0; i<opt_fanout; i++) {
+            tpacket_close(iface->workers[i].ring);
+            localip_free(&iface->workers[i].local_ips);
+         }
+         free(iface->workers);
+      } else if (iface->ring != NULL)
+         tpacket_close(iface->ring);
+      else
+#endif
       pcap_close(iface->pcap);
       localip_free(&iface->local_ips);
       free(iface);
@@ -464,31 +972,173 @@ void cap_stop(void) {
    title_interfaces = NULL;
 }
 
+/* Summaries from a capture file, waiting to be accounted for.  We also
+ * time the accounting, so --verbose shows what --batch buys us.
+ */
+struct file_batch {
+   const struct cap_iface *iface;
+   unsigned int n;
+   struct pktsummary sm[ACCT_BATCH_MAX];
+   const struct local_ips *local_ips[ACCT_BATCH_MAX];
+   uint64_t pkts, nsec;
+};
+
+static void file_batch_flush(struct file_batch *fb) {
+   struct timespec t;
+
+   timer_start(&t);
+   acct_summaries(fb->sm, fb->local_ips, fb->n);
+   fb->nsec += (uint64_t)timer_nsec(&t);
+   fb->pkts += fb->n;
+   fb->n = 0;
+}
+
+/* Like callback(), but queues the summary in a file_batch. */
+static void file_callback(u_char *user,
+                          const struct pcap_pkthdr *pheader,
+                          const u_char *pdata) {
+   struct file_batch *fb = (struct file_batch *)user;
+   struct pktsummary *sm = &fb->sm[fb->n];
+
+   if (opt_want_hexdump)
+      hexdump(pdata, pheader->caplen, fb->iface->linkhdr);
+   memset(sm, 0, sizeof(*sm));
+   if (fb->iface->linkhdr->decoder(pheader, pdata, sm)) {
+      fb->local_ips[fb->n] = &fb->iface->local_ips;
+      if (++fb->n == ACCT_BATCH_MAX)
+         file_batch_flush(fb);
+   }
+}
+
+/* A capture file, and its filter compiled for each linktype in it. */
+struct capfile {
+   const char *name;
+   const char *filter;
+   struct capfile_prog *progs; /* protected by progs_lock */
+};
+
+struct capfile_prog {
+   struct capfile_prog *next;
+   int linktype;
+   struct bpf_program prog;
+};
+
+/* pcap_compile() isn't thread-safe in older libpcaps. */
+static pthread_mutex_t progs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct bpf_program *capfile_prog(struct capfile *f,
+                                              const int linktype) {
+   struct capfile_prog *p;
+
+   pthread_mutex_lock(&progs_lock);
+   for (p = f->progs; p != NULL; p = p->next)
+      if (p->linktype == linktype)
+         break;
+   if (p == NULL) {
+      char *tmp_filter = xstrdup(f->filter);
+      pcap_t *dead = pcap_open_dead(linktype, 65535);
+
+      if (dead == NULL)
+         errx(1, "pcap_open_dead() failed");
+      p = xmalloc(sizeof(*p));
+      p->linktype = linktype;
+      if (pcap_compile(dead, &p->prog, tmp_filter, 1, 0) == -1)
+         errx(1, "pcap_compile(): %s", pcap_geterr(dead));
+      pcap_close(dead);
+      free(tmp_filter);
+      p->next = f->progs;
+      f->progs = p;
+   }
+   pthread_mutex_unlock(&progs_lock);
+   return &p->prog;
+}
+
+static void capfile_free_progs(struct capfile *f) {
+   while (f->progs != NULL) {
+      struct capfile_prog *p = f->progs;
+
+      f->progs = p->next;
+      pcap_freecode(&p->prog);
+      free(p);
+   }
+}
+
+static const struct linkhdr *capfile_linkhdr(const int linktype) {
+   const struct linkhdr *linkhdr;
+
+   linkhdr = getlinkhdr(linktype);
+   if (linkhdr == NULL)
+      errx(1, "unknown linktype %d", linktype);
+   if (linkhdr->decoder == NULL)
+      errx(1, "no decoder for linktype %d", linktype);
+   return linkhdr;
+}
+
+/* Account for up to max packets (or all of them, if zero) from a mapped
+ * capture file, starting where it is now.
+ */
+static void capfile_run(struct capfile *f,
+                        struct pcapfile *pf,
+                        const uint64_t max,
+                        struct file_batch *fb) {
+   struct cap_iface iface;
+   struct pcap_pkthdr pheader;
+   const struct bpf_program *prog = NULL;
+   const u_char *pdata;
+   uint64_t n;
+   int linktype, last_linktype = -1;
+
+   memset(&iface, 0, sizeof(iface));
+   iface.fd = -1;
+   localip_init(&iface.local_ips);
+   fb->iface = &iface;
+
+   for (n=0; (max == 0) || (n < max); n++) {
+      if (!pcapfile_next(pf, &pheader, &pdata, &linktype))
+         break;
+      if (linktype != last_linktype) {
+         /* Only pcapng with several interfaces changes it midway. */
+         iface.linkhdr = capfile_linkhdr(linktype);
+         if (f->filter != NULL)
+            prog = capfile_prog(f, linktype);
+         last_linktype = linktype;
+      }
+      if ((prog != NULL) && (pcap_offline_filter(prog, &pheader, pdata) == 0))
+         continue;
+      file_callback((u_char*)fb, &pheader, pdata);
+   }
+   file_batch_flush(fb);
+   localip_free(&iface.local_ips);
+}
+
 /* Run through entire capfile. */
-void cap_from_file(const char *capfile) {
+static void cap_from_file(struct capfile *f, struct file_batch *fb) {
    char errbuf[PCAP_ERRBUF_SIZE];
-   int linktype, ret;
+   struct pcapfile *pf = NULL;
    struct cap_iface iface;
+   int ret;
+
+   if (opt_want_mmap)
+      pf = pcapfile_open(f->name);
+   if (pf != NULL) {
+      capfile_run(f, pf, 0, fb);
+      pcapfile_close(pf);
+      return;
+   }
 
+   /* Otherwise, let libpcap read it. */
    iface.name = NULL;
-   iface.filter = NULL;
-   iface.pcap = NULL;
+   iface.filter = f->filter;
+#ifdef HAVE_TPACKET_V3
+   iface.ring = NULL;
+   iface.workers = NULL;
+#endif
    iface.fd = -1;
-   iface.linkhdr = NULL;
    localip_init(&iface.local_ips);
 
-   /* Process cmdline filters. */
-   if (!STAILQ_EMPTY(&cli_filters))
-      iface.filter = STAILQ_FIRST(&cli_filters)->str;
-   while (!STAILQ_EMPTY(&cli_filters)) {
-      struct strnode *n = STAILQ_FIRST(&cli_filters);
-      STAILQ_REMOVE_HEAD(&cli_filters, entries);
-      free(n);
-   }
-
    /* Open packet capture descriptor. */
    errbuf[0] = '\0'; /* zero length string */
-   iface.pcap = pcap_open_offline(capfile, errbuf);
+   iface.pcap = pcap_open_offline(f->name, errbuf);
 
    if (iface.pcap == NULL)
       errx(1, "pcap_open_offline(): %s", errbuf);
@@ -497,27 +1147,279 @@ void cap_from_file(const char *capfile) {
       warnx("pcap_open_offline() warning: %s", errbuf);
 
    /* Work out the linktype. */
-   linktype = pcap_datalink(iface.pcap);
-   iface.linkhdr = getlinkhdr(linktype);
-   if (iface.linkhdr == NULL)
-      errx(1, "unknown linktype %d", linktype);
-   if (iface.linkhdr->decoder == NULL)
-      errx(1, "no decoder for linktype %d", linktype);
+   iface.linkhdr = capfile_linkhdr(pcap_datalink(iface.pcap));
 
+   pthread_mutex_lock(&progs_lock);
    cap_set_filter(iface.pcap, iface.filter);
+   pthread_mutex_unlock(&progs_lock);
 
    /* Process file. */
+   fb->iface = &iface;
    ret = pcap_dispatch(
          iface.pcap,
          -1,               /* count, -1 = entire buffer */
-         callback,
-         (u_char*)&iface); /* user */
+         file_callback,
+         (u_char*)fb);     /* user */
 
    if (ret < 0)
       errx(1, "pcap_dispatch(): %s", pcap_geterr(iface.pcap));
+   file_batch_flush(fb);
 
    localip_free(&iface.local_ips);
    pcap_close(iface.pcap);
 }
 
+/* ---------------------------------------------------------------------------
+ * Parallel offline processing, with --jobs.
+ *
+ * We walk the records of each classic pcap file and cut it into
+ * record-aligned chunks, about one per job.  Other files (pcapng, or
+ * anything with --no-mmap) are one chunk each.  A pool of threads decodes
+ * and accounts every chunk into its own shard, and the main thread merges
+ * the hosts in order as they finish.  The counters add up the same in any
+ * order, and merging in order means the last MAC address seen for a host
+ * wins, so the result is the same as a single-threaded run as long as no
+ * table gets reduced.
+ *
+ * Which hosts and ports survive a reduction depends on the order packets
+ * were counted in, which chunks don't keep.  So if any table is cut down,
+ * in a shard or while merging, or hosts_db fills up, we say so, throw the
+ * shards away, and start again on one thread.  Nothing but hosts_db is
+ * touched until the last chunk is merged, so it's the only thing to reset.
+ */
+#define MIN_CHUNK_BYTES (1 << 20)
+
+struct capfile_chunk {
+   struct capfile *file;
+   int whole_file;  /* else just the following records */
+   off_t offset;
+   uint64_t records;
+   struct acct_shard *shard;
+   int done;        /* protected by chunks_lock */
+};
+
+static struct capfile_chunk *chunks = NULL;
+static unsigned int num_chunks = 0, next_chunk = 0; /* next_chunk is atomic */
+static int chunks_abandoned = 0; /* atomic: skip the rest */
+static pthread_mutex_t chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_done = PTHREAD_COND_INITIALIZER;
+static uint64_t chunks_pkts = 0, chunks_nsec = 0; /* protected by chunks_lock */
+
+static void add_chunk(struct capfile *file,
+                      const int whole_file,
+                      const off_t offset,
+                      const uint64_t records) {
+   struct capfile_chunk *c;
+
+   chunks = xrealloc(chunks, (num_chunks + 1) * sizeof(*chunks));
+   c = &chunks[num_chunks++];
+   c->file = file;
+   c->whole_file = whole_file;
+   c->offset = offset;
+   c->records = records;
+   c->shard = acct_shard_make();
+   c->done = 0;
+}
+
+/* Cut the file into chunks of about chunk_bytes, if we can. */
+static void capfile_index(struct capfile *f, const off_t chunk_bytes) {
+   struct pcapfile *pf = NULL;
+   struct pcap_pkthdr pheader;
+   const u_char *pdata;
+   uint64_t records = 0;
+   off_t start, pos;
+   int linktype;
+
+   if (opt_want_mmap)
+      pf = pcapfile_open(f->name);
+   if ((pf == NULL) || !pcapfile_splittable(pf)) {
+      add_chunk(f, 1, 0, 0);
+      if (pf != NULL)
+         pcapfile_close(pf);
+      return;
+   }
+   start = pcapfile_tell(pf);
+   while (pcapfile_next(pf, &pheader, &pdata, &linktype)) {
+      records++;
+      pos = pcapfile_tell(pf);
+      if (pos - start >= chunk_bytes) {
+         add_chunk(f, 0, start, records);
+         start = pos;
+         records = 0;
+      }
+   }
+   if (records > 0)
+      add_chunk(f, 0, start, records);
+   pcapfile_close(pf);
+}
+
+static void capfile_chunk_run(const struct capfile_chunk *c,
+                              struct file_batch *fb) {
+   acct_shard_use(c->shard);
+   if (c->whole_file)
+      cap_from_file(c->file, fb);
+   else {
+      struct pcapfile *pf = pcapfile_open(c->file->name);
+
+      if (pf == NULL)
+         errx(1, "can't map \"%s\" any more", c->file->name);
+      pcapfile_seek(pf, c->offset);
+      capfile_run(c->file, pf, c->records, fb);
+      pcapfile_close(pf);
+   }
+   acct_shard_use(NULL);
+}
+
+static void *capfile_worker(void *arg _unused_) {
+   struct file_batch *fb = xmalloc(sizeof(*fb));
+   unsigned int i;
+
+   now_init();
+   fb->n = 0;
+   fb->pkts = fb->nsec = 0;
+   while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED))
+          < num_chunks) {
+      if (!__atomic_load_n(&chunks_abandoned, __ATOMIC_RELAXED))
+         capfile_chunk_run(&chunks[i], fb);
+      pthread_mutex_lock(&chunks_lock);
+      chunks[i].done = 1;
+      pthread_cond_broadcast(&chunk_done);
+      pthread_mutex_unlock(&chunks_lock);
+   }
+   pthread_mutex_lock(&chunks_lock);
+   chunks_pkts += fb->pkts;
+   chunks_nsec += fb->nsec;
+   pthread_mutex_unlock(&chunks_lock);
+   free(fb);
+   return NULL;
+}
+
+/* Returns 0 if a limit was reached and nothing was counted. */
+static int cap_from_files_parallel(struct capfile *files,
+                                   const unsigned int num_files) {
+   struct timespec t;
+   struct stat st;
+   pthread_t *threads;
+   unsigned int i, num_threads;
+   off_t total = 0, chunk_bytes;
+   const uint64_t reductions = hosts_db_reductions();
+   int limited = 0;
+
+   timer_start(&t);
+   for (i=0; i<num_files; i++) {
+      if (stat(files[i].name, &st) == -1)
+         err(1, "can't stat \"%s\"", files[i].name);
+      total += st.st_size;
+   }
+   chunk_bytes = total / opt_jobs;
+   if (chunk_bytes < MIN_CHUNK_BYTES)
+      chunk_bytes = MIN_CHUNK_BYTES;
+   for (i=0; i<num_files; i++)
+      capfile_index(&files[i], chunk_bytes);
+   verbosef("split %u capture files into %u chunks in %lld msec",
+            num_files, num_chunks, (lld)(timer_nsec(&t) / 1000000));
+
+   num_threads = MIN(opt_jobs, num_chunks);
+   threads = xcalloc(num_threads, sizeof(*threads));
+   for (i=0; i<num_threads; i++)
+      if (pthread_create(&threads[i], NULL, capfile_worker, NULL) != 0)
+         errx(1, "pthread_create() failed");
+
+   /* Merge hosts in order, while later chunks are still going. */
+   for (i=0; i<num_chunks; i++) {
+      pthread_mutex_lock(&chunks_lock);
+      while (!chunks[i].done)
+         pthread_cond_wait(&chunk_done, &chunks_lock);
+      pthread_mutex_unlock(&chunks_lock);
+      if (limited)
+         continue;
+      acct_shard_merge_hosts(chunks[i].shard);
+      if ((hosts_db_reductions() != reductions) ||
+          ((opt_hosts_max != 0) && hosts_db_full())) {
+         warnx("--hosts-max or --ports-max reached with --jobs %u: "
+               "starting over on one thread, so that the same hosts and "
+               "ports are kept", opt_jobs);
+         limited = 1;
+         __atomic_store_n(&chunks_abandoned, 1, __ATOMIC_RELAXED);
+      }
+   }
+   for (i=0; i<num_threads; i++)
+      pthread_join(threads[i], NULL);
+   free(threads);
+
+   /* Now the totals and graphs, in order too. */
+   for (i=0; i<num_chunks; i++)
+      if (limited)
+         acct_shard_discard(chunks[i].shard);
+      else
+         acct_shard_free(chunks[i].shard);
+   if (limited)
+      hosts_db_reset();
+   free(chunks);
+   chunks = NULL;
+   num_chunks = next_chunk = 0;
+   chunks_abandoned = 0;
+   return (!limited);
+}
+
+/* Run through every capfile, in order. */
+void cap_from_files(void) {
+   struct capfile *files;
+   struct file_batch *fb = NULL;
+   struct strnode *n;
+   struct timespec t;
+   const char *filter = NULL;
+   unsigned int i, num_files = 0;
+   uint64_t pkts, nsec;
+
+   /* Process cmdline filters. */
+   if (!STAILQ_EMPTY(&cli_filters))
+      filter = STAILQ_FIRST(&cli_filters)->str;
+   STAILQ_FOREACH(n, &cli_capfiles, entries)
+      num_files++;
+   files = xcalloc(num_files, sizeof(*files));
+   i = 0;
+   STAILQ_FOREACH(n, &cli_capfiles, entries) {
+      files[i].name = n->str;
+      files[i].filter = filter;
+      i++;
+   }
+
+   timer_start(&t);
+   if ((opt_jobs > 1) && cap_from_files_parallel(files, num_files)) {
+      pkts = chunks_pkts;
+      nsec = chunks_nsec;
+   } else {
+      fb = xmalloc(sizeof(*fb));
+      fb->n = 0;
+      fb->pkts = fb->nsec = 0;
+      for (i=0; i<num_files; i++)
+         cap_from_file(&files[i], fb);
+      pkts = fb->pkts;
+      nsec = fb->nsec;
+      free(fb);
+   }
+   if (pkts > 0)
+      verbosef("accounting took %llu nsec/packet over %llu packets, "
+               "with --batch %u",
+               (llu)(nsec / pkts), (llu)pkts, opt_batch);
+   verbosef("processed %u capture files in %lld msec with --jobs %u%s",
+            num_files, (lld)(timer_nsec(&t) / 1000000), opt_jobs,
+            opt_want_mmap ? "" : " --no-mmap");
+
+   for (i=0; i<num_files; i++)
+      capfile_free_progs(&files[i]);
+   free(files);
+   while (!STAILQ_EMPTY(&cli_filters)) {
+      n = STAILQ_FIRST(&cli_filters);
+      STAILQ_REMOVE_HEAD(&cli_filters, entries);
+      free(n);
+   }
+   while (!STAILQ_EMPTY(&cli_capfiles)) {
+      n = STAILQ_FIRST(&cli_capfiles);
+      STAILQ_REMOVE_HEAD(&cli_capfiles, entries);
+      free(n);
+   }
+}
+
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -4,20 +4,25 @@
  * cap.h: interface to libpcap.
  */
 
-#include <sys/types.h> /* OpenBSD needs this before select */
-#include <sys/time.h> /* FreeBSD 4 needs this for struct timeval */
-#include <sys/select.h>
+#include <stdint.h>
+
+struct str;
 
 extern unsigned int cap_pkts_recv, cap_pkts_drop;
 
+/* Packet summaries queued from the capture thread (zero size if none). */
+extern unsigned int cap_ring_size, cap_ring_used, cap_ring_peak;
+extern uint64_t cap_ring_overflows;
+
 void cap_add_ifname(const char *ifname); /* call one or more times */
 void cap_add_filter(const char *filter); /* call zero or more times */
+void cap_add_capfile(const char *capfile); /* or this, one or more times */
 void cap_start(const int promisc);
-void cap_fd_set(fd_set *read_set, int *max_fd,
-   struct timeval *timeout, int *need_timeout);
-void cap_poll(fd_set *read_set);
+void cap_start_workers(void);
 void cap_stop(void);
 
-void cap_from_file(const char *capfile);
+void cap_from_files(void);
+
+void cap_metrics(struct str *buf); /* for /metrics */
 
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -17,6 +17,21 @@
 # define _printflike_(fmtarg, firstvararg)
 #endif
 
+#ifdef __GNUC__
+# define _prefetch_(addr) __builtin_prefetch(addr)
+#else
+# define _prefetch_(addr)
+#endif
+
+/* Thread-local storage, for per-thread accounting state. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+# define _thread_local_ _Thread_local
+#elif defined(__GNUC__)
+# define _thread_local_ __thread
+#else
+# error "need thread-local storage"
+#endif
+
 #if __GNUC__ == 2
 # define inline __inline__
 #else
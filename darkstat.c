@@ -16,9 +16,11 @@
 #include "db.h"
 #include "dns.h"
 #include "err.h"
+#include "event.h"
 #include "hosts_db.h"
 #include "http.h"
 #include "localip.h"
+#include "metrics.h"
 #include "ncache.h"
 #include "now.h"
 #include "pidfile.h"
@@ -51,6 +53,12 @@ static void sig_reset(int signum _unused_) {
 
 static void sig_export(int signum _unused_) { export_pending = 1; }
 
+/* The graphs rotate at the top of the main loop, this just makes sure we go
+ * around it at least once a second, even when nothing else is happening.
+ */
+static struct event_timer *graph_timer = NULL;
+static void graph_tick(void *arg _unused_, const int events _unused_) { }
+
 /* --- Commandline parsing --- */
 static unsigned long parsenum(const char *str,
                               unsigned long max /* 0 for no max */) {
@@ -77,7 +85,10 @@ static void cb_interface(const char *arg) {
 static void cb_filter(const char *arg) { cap_add_filter(arg); }
 
 const char *opt_capfile = NULL;
-static void cb_capfile(const char *arg) { opt_capfile = arg; }
+static void cb_capfile(const char *arg) {
+   cap_add_capfile(arg);
+   opt_capfile = arg;
+}
 
 int opt_want_snaplen = -1;
 static void cb_snaplen(const char *arg)
@@ -107,6 +118,10 @@ static void cb_no_macs(const char *arg _unused_) { opt_want_macs = 0; }
 int opt_want_lastseen = 1;
 static void cb_no_lastseen(const char *arg _unused_) { opt_want_lastseen = 0; }
 
+unsigned int opt_sort_cache = 1000;
+static void cb_sort_cache(const char *arg)
+{ opt_sort_cache = parsenum(arg, 0); }
+
 unsigned short opt_bindport = 667;
 static void cb_port(const char *arg)
 { opt_bindport = (unsigned short)parsenum(arg, 65536); }
@@ -153,6 +168,10 @@ unsigned int opt_hosts_keep = 500;
 static void cb_hosts_keep(const char *arg)
 { opt_hosts_keep = parsenum(arg, 0); }
 
+unsigned int opt_evict_halflife = 0;
+static void cb_evict_halflife(const char *arg)
+{ opt_evict_halflife = parsenum(arg, 0); }
+
 unsigned int opt_ports_max = 200;
 static void cb_ports_max(const char *arg)
 { opt_ports_max = parsenum(arg, 65536); }
@@ -169,6 +188,40 @@ int opt_wait_secs = -1;
 static void cb_wait_secs(const char *arg)
 { opt_wait_secs = (int)parsenum(arg, 0); }
 
+unsigned int opt_ring_size = 65536;
+static void cb_ring_size(const char *arg)
+{ opt_ring_size = parsenum(arg, 0); }
+
+int opt_want_tpacket = 0;
+static void cb_tpacket(const char *arg _unused_) { opt_want_tpacket = 1; }
+
+unsigned int opt_tpacket_block_size = 1 << 20;
+static void cb_tpacket_block_size(const char *arg)
+{ opt_tpacket_block_size = parsenum(arg, 0); }
+
+unsigned int opt_tpacket_blocks = 64;
+static void cb_tpacket_blocks(const char *arg)
+{ opt_tpacket_blocks = parsenum(arg, 0); }
+
+unsigned int opt_tpacket_timeout = 100;
+static void cb_tpacket_timeout(const char *arg)
+{ opt_tpacket_timeout = parsenum(arg, 0); }
+
+unsigned int opt_fanout = 0;
+static void cb_fanout(const char *arg)
+{ opt_fanout = parsenum(arg, 64); }
+
+unsigned int opt_jobs = 1;
+static void cb_jobs(const char *arg)
+{ opt_jobs = parsenum(arg, 64); }
+
+int opt_want_mmap = 1;
+static void cb_no_mmap(const char *arg _unused_) { opt_want_mmap = 0; }
+
+unsigned int opt_batch = 32;
+static void cb_batch(const char *arg)
+{ opt_batch = parsenum(arg, ACCT_BATCH_MAX); }
+
 int opt_want_hexdump = 0;
 static void cb_hexdump(const char *arg _unused_)
 { opt_want_hexdump = 1; }
@@ -190,7 +243,7 @@ struct cmdline_arg {
 static struct cmdline_arg cmdline_args[] = {
    {"-i",             "interface",       cb_interface,   -1},
    {"-f",             "filter",          cb_filter,      -1},
-   {"-r",             "capfile",         cb_capfile,      0},
+   {"-r",             "capfile",         cb_capfile,     -1},
    {"-p",             "port",            cb_port,         0},
    {"-b",             "bindaddr",        cb_bindaddr,    -1},
    {"-l",             "network/netmask", cb_local,        0},
@@ -205,6 +258,7 @@ static struct cmdline_arg cmdline_args[] = {
    {"--no-dns",       NULL,              cb_no_dns,       0},
    {"--no-macs",      NULL,              cb_no_macs,      0},
    {"--no-lastseen",  NULL,              cb_no_lastseen,  0},
+   {"--sort-cache",   "msecs",           cb_sort_cache,   0},
    {"--chroot",       "dir",             cb_chroot,       0},
    {"--user",         "username",        cb_user,         0},
    {"--daylog",       "filename",        cb_daylog,       0},
@@ -213,10 +267,20 @@ static struct cmdline_arg cmdline_args[] = {
    {"--pidfile",      "filename",        cb_pidfile,      0},
    {"--hosts-max",    "count",           cb_hosts_max,    0},
    {"--hosts-keep",   "count",           cb_hosts_keep,   0},
+   {"--evict-halflife", "secs",          cb_evict_halflife, 0},
    {"--ports-max",    "count",           cb_ports_max,    0},
    {"--ports-keep",   "count",           cb_ports_keep,   0},
    {"--highest-port", "port",            cb_highest_port, 0},
    {"--wait",         "secs",            cb_wait_secs,    0},
+   {"--ring-size",    "count",           cb_ring_size,    0},
+   {"--tpacket",      NULL,              cb_tpacket,      0},
+   {"--tpacket-block-size", "bytes",     cb_tpacket_block_size, 0},
+   {"--tpacket-blocks", "count",         cb_tpacket_blocks, 0},
+   {"--tpacket-timeout", "msec",         cb_tpacket_timeout, 0},
+   {"--fanout",       "threads",         cb_fanout,       0},
+   {"--jobs",         "threads",         cb_jobs,         0},
+   {"--no-mmap",      NULL,              cb_no_mmap,      0},
+   {"--batch",        "count",           cb_batch,        0},
    {"--hexdump",      NULL,              cb_hexdump,      0},
    {"--version",      NULL,              cb_version,      0},
    {"--help",         NULL,              cb_help,         0},
@@ -333,16 +397,40 @@ static void parse_cmdline(const int argc, char * const *argv) {
    verbosef("max %u ports per host, cutting down to %u when exceeded",
       opt_ports_max, opt_ports_keep);
 
+   if (opt_batch == 0)
+      errx(1, "--batch must be at least one");
+
    if (opt_want_hexdump && !opt_want_verbose) {
       opt_want_verbose = 1;
       verbosef("--hexdump implies --verbose");
    }
 
+   if (opt_jobs == 0)
+      errx(1, "--jobs must be at least one");
+   if (opt_jobs > 1 && opt_capfile == NULL)
+      verbosef("without -r, --jobs only helps sort very big tables");
+   if (opt_jobs > 1 && opt_want_hexdump) {
+      opt_jobs = 1;
+      verbosef("--hexdump implies --jobs 1");
+   }
+
    if (opt_want_hexdump && opt_want_daemonize) {
       opt_want_daemonize = 0;
       verbosef("--hexdump implies --no-daemon");
    }
 
+   if (opt_fanout > 0 && !opt_want_tpacket) {
+      opt_want_tpacket = 1;
+      verbosef("--fanout implies --tpacket");
+   }
+
+#ifndef HAVE_TPACKET_V3
+   if (opt_want_tpacket)
+      errx(1, "--tpacket is only available on Linux with TPACKET_V3 support");
+#endif
+   if (opt_want_tpacket && opt_capfile != NULL)
+      verbosef("--tpacket has no effect when reading from a capture file");
+
    if (opt_want_local_only && !is_localnet_specified)
       verbosef("WARNING: --local-only without -l only matches the local host");
 }
@@ -351,7 +439,7 @@ static void run_from_capfile(void) {
    now_init();
    graph_init();
    hosts_db_init();
-   cap_from_file(opt_capfile);
+   cap_from_files();
    if (export_fn != NULL) db_export(export_fn);
    hosts_db_free();
    graph_free();
@@ -364,6 +452,8 @@ static void run_from_capfile(void) {
 int
 main(int argc, char **argv)
 {
+   struct timespec stage; /* see loop_stage_done() */
+
    test_64order();
    parse_cmdline(argc-1, argv+1);
 
@@ -383,6 +473,9 @@ main(int argc, char **argv)
    }
    if (pid_fn) pidfile_write_close();
 
+   event_init();
+   graph_timer = event_timer_add(1000, graph_tick, NULL);
+
    /* do this first as it forks - minimize memory use */
    if (opt_want_dns) dns_init(opt_privdrop_user);
    cap_start(opt_want_promisc); /* needs root */
@@ -398,6 +491,7 @@ main(int argc, char **argv)
    graph_init();
    hosts_db_init();
    if (import_fn != NULL) db_import(import_fn);
+   cap_start_workers();
 
    if (signal(SIGTERM, sig_shutdown) == SIG_ERR)
       errx(1, "signal(SIGTERM) failed");
@@ -411,29 +505,13 @@ main(int argc, char **argv)
    verbosef("entering main loop");
    daemonize_finish();
 
+   timer_start(&stage);
    while (running) {
-      int select_ret, max_fd = -1, use_timeout = 0;
-      struct timeval timeout;
       struct timespec t;
-      fd_set rs, ws;
-
-      FD_ZERO(&rs);
-      FD_ZERO(&ws);
-      cap_fd_set(&rs, &max_fd, &timeout, &use_timeout);
-      http_fd_set(&rs, &ws, &max_fd, &timeout, &use_timeout);
-
-      select_ret = select(max_fd+1, &rs, &ws, NULL,
-         (use_timeout) ? &timeout : NULL);
-      if (select_ret == 0 && !use_timeout)
-            errx(1, "select() erroneously timed out");
-      if (select_ret == -1) {
-         if (errno == EINTR)
-            continue;
-         else
-            err(1, "select()");
-      }
 
-      timer_start(&t);
+      event_wait();
+      loop_stage_done(LOOP_WAIT, &stage);
+      t = stage; /* when the wait ended */
       now_update();
 
       if (export_pending) {
@@ -442,18 +520,22 @@ main(int argc, char **argv)
          export_pending = 0;
       }
 
-      if (reset_pending) {
-         if (export_pending)
-            continue; /* export before reset */
+      /* export before reset */
+      if (reset_pending && !export_pending) {
+         acct_merge_shards(); /* so nothing from before survives */
          hosts_db_reset();
          graph_reset();
          reset_pending = 0;
       }
-
-      graph_rotate();
-      cap_poll(&rs);
-      dns_poll();
-      http_poll(&rs, &ws);
+      loop_stage_done(LOOP_HOUSEKEEPING, &stage);
+
+      graph_rotate(); /* before new packets, so they land in the right bar */
+      http_push_graphs();
+      loop_stage_done(LOOP_ROTATE, &stage);
+      hosts_db_evict();
+      loop_stage_done(LOOP_EVICT, &stage);
+      event_dispatch();
+      loop_stage_done(LOOP_DISPATCH, &stage);
       timer_stop(&t, 1000000000, "event processing took longer than a second");
    }
 
@@ -463,6 +545,8 @@ main(int argc, char **argv)
    http_stop();
    cap_stop();
    dns_stop();
+   event_timer_del(graph_timer);
+   event_free();
    if (export_fn != NULL) db_export(export_fn);
    hosts_db_free();
    graph_free();
@@ -117,7 +117,7 @@ void daylog_free(void) {
                 fmt_date(today_real), (qu)today_real);
 }
 
-void daylog_acct(uint64_t amount, enum graph_dir dir) {
+void daylog_acct(uint64_t amount, uint64_t pkts, enum graph_dir dir) {
    if (daylog_fn == NULL)
       return; /* daylogging disabled */
 
@@ -134,11 +134,11 @@ void daylog_acct(uint64_t amount, enum graph_dir dir) {
    /* Accounting. */
    if (dir == GRAPH_IN) {
       bytes_in += amount;
-      pkts_in++;
+      pkts_in += pkts;
    } else {
       assert(dir == GRAPH_OUT);
       bytes_out += amount;
-      pkts_out++;
+      pkts_out += pkts;
    }
 }
 
@@ -8,6 +8,6 @@
 
 void daylog_init(const char *filename);
 void daylog_free(void);
-void daylog_acct(uint64_t amount, enum graph_dir dir);
+void daylog_acct(uint64_t amount, uint64_t pkts, enum graph_dir dir);
 
 /* vim:set ts=3 sw=3 tw=78 et: */
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "acct.h"
 #include "cdefs.h"
 #include "err.h"
 #include "hosts_db.h"
@@ -326,6 +327,7 @@ db_import(const char *filename)
 static int
 db_export_to_fd(const int fd)
 {
+   acct_merge_shards();
    if (!writen(fd, export_file_header, sizeof(export_file_header)))
       return 0;
    if (!writen(fd, export_tag_hosts_ver1, sizeof(export_tag_hosts_ver1)))
@@ -17,15 +17,24 @@
 #include "decode.c"
 #include "dns.c"
 #include "err.c"
+#include "event.c"
 #include "graph_db.c"
 #include "hosts_db.c"
 #include "hosts_sort.c"
 #include "html.c"
 #include "http.c"
+#include "json.c"
 #include "localip.c"
+#include "metrics.c"
 #include "ncache.c"
 #include "now.c"
+#include "pcapfile.c"
 #include "pidfile.c"
+#include "pktring.c"
+#include "pool.c"
+#include "siphash.c"
 #include "str.c"
+#include "topk.c"
+#include "tpacket.c"
 
 #include "darkstat.c"
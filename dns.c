@@ -12,7 +12,9 @@
 #include "decode.h"
 #include "dns.h"
 #include "err.h"
+#include "event.h"
 #include "hosts_db.h"
+#include "metrics.h"
 #include "queue.h"
 #include "str.h"
 #include "tree.h"
@@ -35,10 +37,13 @@
 #endif
 
 static void dns_main(void) _noreturn_; /* the child process runs this */
+static void dns_event(void *arg, const int events);
+static void dns_unqueue_all(void);
 
 #define CHILD 0 /* child process uses this socket */
 #define PARENT 1
 static int dns_sock[2];
+static int dns_watching = 0; /* dns_sock[PARENT] is in the event loop */
 static pid_t pid = -1;
 
 struct dns_reply {
@@ -62,6 +67,7 @@ dns_init(const char *privdrop_user)
       privdrop(NULL /* don't chroot */, privdrop_user);
       close(dns_sock[PARENT]);
       dns_sock[PARENT] = -1;
+      event_free(); /* that's the parent's */
       daemonize_finish(); /* drop our copy of the lifeline! */
       if (signal(SIGUSR1, SIG_IGN) == SIG_ERR)
          errx(1, "signal(SIGUSR1, ignore) failed");
@@ -72,6 +78,8 @@ dns_init(const char *privdrop_user)
       close(dns_sock[CHILD]);
       dns_sock[CHILD] = -1;
       fd_set_nonblock(dns_sock[PARENT]);
+      event_add(dns_sock[PARENT], EVENT_READ, 0, dns_event, NULL);
+      dns_watching = 1;
       verbosef("DNS child has PID %d", pid);
    }
 }
@@ -81,6 +89,8 @@ dns_stop(void)
 {
    if (pid == -1)
       return; /* no child was started */
+   if (dns_watching)
+      event_del(dns_sock[PARENT]);
    close(dns_sock[PARENT]);
    if (kill(pid, SIGINT) == -1)
       err(1, "kill");
@@ -88,6 +98,7 @@ dns_stop(void)
    if (waitpid(pid, NULL, 0) == -1)
       err(1, "waitpid");
    verbosef("dns_stop() done waiting for child");
+   dns_unqueue_all();
 }
 
 struct tree_rec {
@@ -113,6 +124,20 @@ tree_cmp(struct tree_rec *a, struct tree_rec *b)
 static RB_HEAD(tree_t, tree_rec) ip_tree = RB_INITIALIZER(&tree_rec);
 RB_GENERATE_STATIC(tree_t, tree_rec, ptree, tree_cmp)
 
+/* For /metrics. */
+static struct {
+   uint32_t depth; /* addresses in ip_tree, waiting on the child */
+   uint64_t queued, resolved, failed, dropped;
+} dns_stats;
+
+static void
+dns_unqueue_rec(struct tree_rec *rec)
+{
+   RB_REMOVE(tree_t, &ip_tree, rec);
+   free(rec);
+   dns_stats.depth--;
+}
+
 void
 dns_queue(const struct addr *const ipaddr)
 {
@@ -138,13 +163,26 @@ dns_queue(const struct addr *const ipaddr)
       return;
    }
 
+   dns_stats.depth++;
+   dns_stats.queued++;
+
    num_w = write(dns_sock[PARENT], ipaddr, sizeof(*ipaddr)); /* won't block */
-   if (num_w == 0)
-      warnx("dns_queue: write: ignoring end of file");
-   else if (num_w == -1)
-      warn("dns_queue: ignoring write error");
-   else if (num_w != sizeof(*ipaddr))
+   if (num_w == sizeof(*ipaddr))
+      return;
+   if (num_w > 0)
       err(1, "dns_queue: wrote %zu instead of %zu", num_w, sizeof(*ipaddr));
+
+   /* The child will never see it, so don't wait for it: the host can be
+    * queued again next time it's shown.  A full socket just means the child
+    * is busy, and isn't worth a warning.
+    */
+   if (num_w == 0)
+      warnx("dns_queue: write: dropping %s at end of file",
+         addr_to_str(ipaddr));
+   else if (errno != EAGAIN)
+      warn("dns_queue: write: dropping %s", addr_to_str(ipaddr));
+   dns_unqueue_rec(rec);
+   dns_stats.dropped++;
 }
 
 static void
@@ -153,14 +191,37 @@ dns_unqueue(const struct addr *const ipaddr)
    struct tree_rec tmp, *rec;
 
    memcpy(&tmp.ip, ipaddr, sizeof(tmp.ip));
-   if ((rec = RB_FIND(tree_t, &ip_tree, &tmp)) != NULL) {
-      RB_REMOVE(tree_t, &ip_tree, rec);
-      free(rec);
-   }
+   if ((rec = RB_FIND(tree_t, &ip_tree, &tmp)) != NULL)
+      dns_unqueue_rec(rec);
    else
       verbosef("couldn't unqueue %s - not in queue!", addr_to_str(ipaddr));
 }
 
+static void
+dns_unqueue_all(void)
+{
+   struct tree_rec *rec;
+
+   while ((rec = RB_ROOT(&ip_tree)) != NULL)
+      dns_unqueue_rec(rec);
+}
+
+void
+dns_metrics(struct str *buf)
+{
+   metric(buf, "darkstat_dns_queue_depth", "gauge",
+      "Addresses waiting on a reverse lookup.", dns_stats.depth);
+   metric(buf, "darkstat_dns_queued_total", "counter",
+      "Addresses sent for a reverse lookup.", dns_stats.queued);
+   metric(buf, "darkstat_dns_resolved_total", "counter",
+      "Reverse lookups that found a name.", dns_stats.resolved);
+   metric(buf, "darkstat_dns_failed_total", "counter",
+      "Reverse lookups that didn't.", dns_stats.failed);
+   metric(buf, "darkstat_dns_dropped_total", "counter",
+      "Addresses that couldn't be sent to the lookup process.",
+      dns_stats.dropped);
+}
+
 /*
  * Returns non-zero if result waiting, stores IP and name into given pointers
  * (name buffer is allocated by dns_poll)
@@ -178,8 +239,14 @@ dns_get_result(struct addr *ipaddr, char **name)
       else
          goto error;
    }
-   if (numread == 0)
-      goto error; /* EOF */
+   if (numread == 0) {
+      /* EOF: don't let the event loop keep waking us up for it. */
+      if (dns_watching) {
+         event_del(dns_sock[PARENT]);
+         dns_watching = 0;
+      }
+      goto error;
+   }
    if (numread != sizeof(reply))
       errx(1, "dns_get_result read got %zu, expected %zu",
          numread, sizeof(reply));
@@ -187,6 +254,7 @@ dns_get_result(struct addr *ipaddr, char **name)
    /* Return successful reply. */
    memcpy(ipaddr, &reply.addr, sizeof(*ipaddr));
    if (reply.error != 0) {
+      dns_stats.failed++;
       /* Identify common special cases.  */
       const char *type = "none";
 
@@ -204,8 +272,10 @@ dns_get_result(struct addr *ipaddr, char **name)
       }
       xasprintf(name, "(%s)", type);
    }
-   else  /* Correctly resolved name.  */
+   else {  /* Correctly resolved name.  */
+      dns_stats.resolved++;
       *name = xstrdup(reply.name);
+   }
 
    dns_unqueue(&reply.addr);
    return (1);
@@ -216,7 +286,7 @@ error:
    return (0);
 }
 
-void
+static void
 dns_poll(void)
 {
    struct addr ip;
@@ -240,9 +310,16 @@ dns_poll(void)
          return;
       }
       b->u.host.dns = name;
+      hosts_db_changed();
    }
 }
 
+static void
+dns_event(void *arg _unused_, const int events _unused_)
+{
+   dns_poll();
+}
+
 /* ------------------------------------------------------------------------ */
 
 struct qitem {
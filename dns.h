@@ -8,10 +8,11 @@
  */
 
 struct addr;
+struct str;
 
 void dns_init(const char *privdrop_user);
 void dns_stop(void);
 void dns_queue(const struct addr *const ipaddr);
-void dns_poll(void);
+void dns_metrics(struct str *buf); /* for /metrics */
 
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,415 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * event.c: the main event loop's file descriptors and timers.
+ *
+ * On Linux, fds stay registered with epoll for as long as they're watched,
+ * and timers are timerfds in the same epoll set, so each trip around the
+ * loop only costs as much as the fds that are actually ready.  Elsewhere,
+ * we fall back to poll(), which at least has no FD_SETSIZE limit.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "cdefs.h"
+#include "config.h"
+#include "conv.h"
+#include "err.h"
+#include "event.h"
+#include "queue.h"
+
+#if defined(HAVE_EPOLL_CREATE1) && defined(HAVE_TIMERFD_CREATE)
+# define USE_EPOLL
+#endif
+
+#ifdef USE_EPOLL
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+#else
+# include <poll.h>
+# include <time.h>
+#endif
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct watcher {
+   int fd, events, dead;
+   event_handler *handler;
+   void *arg;
+   struct watcher *next_dead;
+};
+
+/* Indexed by fd. */
+static struct watcher **watchers = NULL;
+static unsigned int watchers_size = 0;
+
+/* A handler can event_del() an fd that's further along in the list of ready
+ * ones, so watchers are only freed after event_dispatch().
+ */
+static struct watcher *dead_watchers = NULL;
+
+#ifdef USE_EPOLL
+#define MAX_EVENTS 64
+static int epfd = -1;
+static struct epoll_event ready[MAX_EVENTS];
+static int num_ready = 0;
+
+struct event_timer {
+   int fd;
+   event_handler *handler;
+   void *arg;
+};
+#else
+static struct pollfd *pollfds = NULL;
+static struct watcher **pollwatchers = NULL;
+static unsigned int num_pollfds = 0;
+static int pollfds_dirty = 0;
+
+struct event_timer {
+   LIST_ENTRY(event_timer) entries;
+   unsigned int msec;
+   struct timespec due;
+   int dead;
+   event_handler *handler;
+   void *arg;
+};
+static LIST_HEAD(timers_head, event_timer) timers =
+   LIST_HEAD_INITIALIZER(timers);
+#endif
+
+void event_init(void) {
+#ifdef USE_EPOLL
+   epfd = epoll_create1(EPOLL_CLOEXEC);
+   if (epfd == -1)
+      err(1, "epoll_create1()");
+#endif
+}
+
+static void free_dead(void) {
+   while (dead_watchers != NULL) {
+      struct watcher *w = dead_watchers;
+
+      dead_watchers = w->next_dead;
+      free(w);
+   }
+#ifndef USE_EPOLL
+   {
+      struct event_timer *t, *next;
+
+      LIST_FOREACH_SAFE(t, &timers, entries, next)
+         if (t->dead) {
+            LIST_REMOVE(t, entries);
+            free(t);
+         }
+   }
+#endif
+}
+
+void event_free(void) {
+   unsigned int i;
+
+   for (i=0; i<watchers_size; i++)
+      free(watchers[i]);
+   free(watchers);
+   watchers = NULL;
+   watchers_size = 0;
+   free_dead();
+#ifdef USE_EPOLL
+   if (epfd != -1)
+      close(epfd);
+   epfd = -1;
+#else
+   free(pollfds);
+   free(pollwatchers);
+   pollfds = NULL;
+   pollwatchers = NULL;
+   num_pollfds = 0;
+   {
+      struct event_timer *t, *next;
+
+      LIST_FOREACH_SAFE(t, &timers, entries, next) {
+         LIST_REMOVE(t, entries);
+         free(t);
+      }
+   }
+#endif
+}
+
+#ifdef USE_EPOLL
+static uint32_t to_epoll(const int events) {
+   return ((events & EVENT_READ) ? EPOLLIN : 0) |
+          ((events & EVENT_WRITE) ? EPOLLOUT : 0);
+}
+#endif
+
+void event_add(const int fd,
+               const int events,
+               const int edge,
+               event_handler *handler,
+               void *arg) {
+   struct watcher *w;
+
+   assert(fd >= 0);
+   if ((unsigned int)fd >= watchers_size) {
+      unsigned int size = MAX((unsigned int)fd + 1, watchers_size * 2);
+
+      watchers = xrealloc(watchers, size * sizeof(*watchers));
+      memset(watchers + watchers_size, 0,
+             (size - watchers_size) * sizeof(*watchers));
+      watchers_size = size;
+   }
+   assert(watchers[fd] == NULL);
+
+   w = xmalloc(sizeof(*w));
+   w->fd = fd;
+   w->events = events;
+   w->dead = 0;
+   w->handler = handler;
+   w->arg = arg;
+   watchers[fd] = w;
+
+#ifdef USE_EPOLL
+   {
+      struct epoll_event ev;
+
+      memset(&ev, 0, sizeof(ev));
+      ev.events = to_epoll(events) | (edge ? EPOLLET : 0);
+      ev.data.ptr = w;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+         err(1, "epoll_ctl(ADD, %d)", fd);
+   }
+#else
+   (void)edge; /* poll() is level-triggered, see event_blocked() */
+   pollfds_dirty = 1;
+#endif
+}
+
+void event_del(const int fd) {
+   struct watcher *w;
+
+   assert((fd >= 0) && ((unsigned int)fd < watchers_size));
+   w = watchers[fd];
+   assert(w != NULL);
+#ifdef USE_EPOLL
+   if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+      err(1, "epoll_ctl(DEL, %d)", fd);
+#else
+   pollfds_dirty = 1;
+#endif
+   watchers[fd] = NULL;
+   w->dead = 1;
+   w->next_dead = dead_watchers;
+   dead_watchers = w;
+}
+
+void event_blocked(const int fd, const int events) {
+#ifdef USE_EPOLL
+   /* Nothing to do: an edge-triggered fd is registered once, for everything
+    * it will ever wait for.
+    */
+   (void)fd;
+   (void)events;
+#else
+   struct watcher *w = watchers[fd];
+
+   if (w->events != events) {
+      w->events = events;
+      pollfds_dirty = 1;
+   }
+#endif
+}
+
+#ifdef USE_EPOLL
+static void timer_fired(void *arg, const int events _unused_) {
+   struct event_timer *t = arg;
+   uint64_t expirations;
+
+   if (read(t->fd, &expirations, sizeof(expirations)) == -1) {
+      if (errno == EAGAIN)
+         return;
+      err(1, "read() from timerfd");
+   }
+   t->handler(t->arg, 0);
+}
+#else
+static void timespec_add_msec(struct timespec *ts, const unsigned int msec) {
+   ts->tv_sec += msec / 1000;
+   ts->tv_nsec += (long)(msec % 1000) * 1000000;
+   if (ts->tv_nsec >= 1000000000) {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000;
+   }
+}
+#endif
+
+struct event_timer *event_timer_add(const unsigned int msec,
+                                    event_handler *handler,
+                                    void *arg) {
+   struct event_timer *t = xmalloc(sizeof(*t));
+
+   assert(msec > 0);
+   t->handler = handler;
+   t->arg = arg;
+#ifdef USE_EPOLL
+   {
+      struct itimerspec its;
+
+      t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (t->fd == -1)
+         err(1, "timerfd_create()");
+      its.it_interval.tv_sec = msec / 1000;
+      its.it_interval.tv_nsec = (long)(msec % 1000) * 1000000;
+      its.it_value = its.it_interval;
+      if (timerfd_settime(t->fd, 0, &its, NULL) == -1)
+         err(1, "timerfd_settime()");
+      event_add(t->fd, EVENT_READ, 0, timer_fired, t);
+   }
+#else
+   t->msec = msec;
+   t->dead = 0;
+   clock_gettime(CLOCK_MONOTONIC, &t->due);
+   timespec_add_msec(&t->due, msec);
+   LIST_INSERT_HEAD(&timers, t, entries);
+#endif
+   return t;
+}
+
+void event_timer_del(struct event_timer *t) {
+#ifdef USE_EPOLL
+   event_del(t->fd);
+   close(t->fd);
+   free(t);
+#else
+   t->dead = 1; /* freed after event_dispatch() */
+#endif
+}
+
+#ifdef USE_EPOLL
+void event_wait(void) {
+   num_ready = epoll_wait(epfd, ready, MAX_EVENTS, -1);
+   if (num_ready == -1) {
+      num_ready = 0;
+      if (errno != EINTR)
+         err(1, "epoll_wait()");
+   }
+}
+
+void event_dispatch(void) {
+   int i;
+
+   for (i=0; i<num_ready; i++) {
+      struct watcher *w = ready[i].data.ptr;
+      int events = 0;
+
+      if (w->dead)
+         continue;
+      /* Let the handler find errors and hangups by reading or writing. */
+      if (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+         events |= EVENT_READ;
+      if (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+         events |= EVENT_WRITE;
+      w->handler(w->arg, events & w->events);
+   }
+   num_ready = 0;
+   free_dead();
+}
+#else
+static void rebuild_pollfds(void) {
+   unsigned int i;
+
+   num_pollfds = 0;
+   for (i=0; i<watchers_size; i++)
+      if (watchers[i] != NULL)
+         num_pollfds++;
+   pollfds = xrealloc(pollfds, num_pollfds * sizeof(*pollfds));
+   pollwatchers = xrealloc(pollwatchers, num_pollfds * sizeof(*pollwatchers));
+   num_pollfds = 0;
+   for (i=0; i<watchers_size; i++) {
+      struct watcher *w = watchers[i];
+
+      if (w == NULL)
+         continue;
+      pollfds[num_pollfds].fd = w->fd;
+      pollfds[num_pollfds].events =
+         ((w->events & EVENT_READ) ? POLLIN : 0) |
+         ((w->events & EVENT_WRITE) ? POLLOUT : 0);
+      pollwatchers[num_pollfds] = w;
+      num_pollfds++;
+   }
+   pollfds_dirty = 0;
+}
+
+void event_wait(void) {
+   struct event_timer *t;
+   struct timespec now;
+   int timeout = -1;
+
+   if (pollfds_dirty)
+      rebuild_pollfds();
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   LIST_FOREACH(t, &timers, entries) {
+      int64_t msec;
+
+      if (t->dead)
+         continue;
+      msec = (int64_t)(t->due.tv_sec - now.tv_sec) * 1000 +
+             (t->due.tv_nsec - now.tv_nsec + 999999) / 1000000;
+      if (msec < 0)
+         msec = 0;
+      if ((timeout == -1) || (msec < timeout))
+         timeout = (int)msec;
+   }
+
+   if (poll(pollfds, num_pollfds, timeout) == -1) {
+      unsigned int i;
+
+      if (errno != EINTR)
+         err(1, "poll()");
+      for (i=0; i<num_pollfds; i++)
+         pollfds[i].revents = 0;
+   }
+}
+
+void event_dispatch(void) {
+   struct event_timer *t;
+   struct timespec now;
+   unsigned int i, n = num_pollfds;
+
+   for (i=0; i<n; i++) {
+      struct watcher *w = pollwatchers[i];
+      short revents = pollfds[i].revents;
+      int events = 0;
+
+      pollfds[i].revents = 0;
+      if ((revents == 0) || w->dead)
+         continue;
+      if (revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+         events |= EVENT_READ;
+      if (revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
+         events |= EVENT_WRITE;
+      w->handler(w->arg, events & w->events);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   LIST_FOREACH(t, &timers, entries) {
+      if (t->dead)
+         continue;
+      if ((t->due.tv_sec > now.tv_sec) ||
+          ((t->due.tv_sec == now.tv_sec) && (t->due.tv_nsec > now.tv_nsec)))
+         continue;
+      /* Don't try to catch up on expirations we missed. */
+      t->due = now;
+      timespec_add_msec(&t->due, t->msec);
+      t->handler(t->arg, 0);
+   }
+   free_dead();
+}
+#endif
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,49 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * event.h: the main event loop's file descriptors and timers.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_EVENT_H
+#define __DARKSTAT_EVENT_H
+
+#define EVENT_READ  1
+#define EVENT_WRITE 2
+
+typedef void (event_handler)(void *arg, const int events);
+
+void event_init(void);
+void event_free(void);
+
+/* Watch fd until event_del().  With edge set, the handler is only told when
+ * the fd becomes ready, so it must read or write until EAGAIN and then call
+ * event_blocked().  Otherwise the handler is called as long as the fd is
+ * ready.
+ */
+void event_add(const int fd,
+               const int events,
+               const int edge,
+               event_handler *handler,
+               void *arg);
+void event_del(const int fd);
+
+/* An edge-triggered fd hit EAGAIN and now waits for these events. */
+void event_blocked(const int fd, const int events);
+
+/* Call the handler every msec until event_timer_del(). */
+struct event_timer;
+struct event_timer *event_timer_add(const unsigned int msec,
+                                    event_handler *handler,
+                                    void *arg);
+void event_timer_del(struct event_timer *t);
+
+/* Block until something is ready, or a signal arrives. */
+void event_wait(void);
+
+/* Run the handlers for whatever event_wait() found. */
+void event_dispatch(void);
+
+#endif /* __DARKSTAT_EVENT_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
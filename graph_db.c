@@ -17,6 +17,7 @@
 #include "str.h"
 #include "html.h"
 #include "graph_db.h"
+#include "json.h"
 #include "now.h"
 #include "opt.h"
 
@@ -48,6 +49,9 @@ static struct graph *graph_db[] = {
 
 static unsigned int graph_db_size = sizeof(graph_db)/sizeof(*graph_db);
 static time_t start_mono, start_real, last_real;
+static uint64_t generation = 0; /* see graph_generation() */
+static uint64_t redrawn = 0; /* bars moved other than by advance() */
+static uint64_t changes = 0; /* see graph_changes() */
 
 void graph_init(void) {
    unsigned int i;
@@ -64,6 +68,8 @@ void graph_init(void) {
 static void zero_graph(struct graph *g) {
    memset(g->in,  0, sizeof(uint64_t) * g->num_bars);
    memset(g->out, 0, sizeof(uint64_t) * g->num_bars);
+   redrawn++;
+   changes++;
 }
 
 void graph_reset(void) {
@@ -72,6 +78,7 @@ void graph_reset(void) {
    for (i=0; i<graph_db_size; i++)
       zero_graph(graph_db[i]);
    last_real = 0;
+   generation++;
 }
 
 void graph_free(void) {
@@ -85,6 +92,7 @@ void graph_free(void) {
 
 void graph_acct(uint64_t amount, enum graph_dir dir) {
    unsigned int i;
+   changes++;
    for (i=0; i<graph_db_size; i++)
       if (dir == GRAPH_IN) {
          graph_db[i]->in[  graph_db[i]->pos ] += amount;
@@ -100,7 +108,10 @@ static void advance(struct graph *g, const unsigned int pos) {
       return; /* didn't need to advance */
    do {
       g->pos = (g->pos + 1) % g->num_bars;
-      g->in[g->pos] = g->out[g->pos] = 0;
+      if (g->in[g->pos] != 0 || g->out[g->pos] != 0) {
+         g->in[g->pos] = g->out[g->pos] = 0;
+         changes++;
+      }
    } while (g->pos != pos);
 }
 
@@ -166,6 +177,8 @@ static void graph_resync(const time_t new_real) {
    rotate(&graph_mins, tm->tm_min);
    rotate(&graph_hrs, tm->tm_hour);
    rotate(&graph_days, tm->tm_mday - 1);
+   redrawn++;
+   changes++;
 
    last_real = new_real;
 }
@@ -186,11 +199,14 @@ void graph_rotate(void) {
       graph_mins.pos = tm->tm_min;
       graph_hrs.pos = tm->tm_hour;
       graph_days.pos = tm->tm_mday - 1;
+      generation++;
+      changes++;
       return;
    }
 
    if (t == last_real)
       return; /* time has not advanced a full second, don't rotate */
+   generation++;
 
    if (t < last_real) {
       verbosef("graph_db: realtime went backwards! "
@@ -216,6 +232,30 @@ void graph_rotate(void) {
    advance(&graph_days, tm->tm_mday - 1);
 }
 
+/* Goes up whenever the graphs move on, at most once a second. */
+uint64_t graph_generation(void) {
+   return generation;
+}
+
+/* Goes up whenever anything on the graph pages changes, apart from the
+ * time: a bar or total goes up, a bar that wasn't empty is zeroed, or the
+ * capture counters move.  An idle darkstat leaves it alone.
+ */
+uint64_t graph_changes(void) {
+   static unsigned int recv = 0, drop = 0, peak = 0;
+   static uint64_t overflows = 0;
+
+   if (recv != cap_pkts_recv || drop != cap_pkts_drop ||
+       peak != cap_ring_peak || overflows != cap_ring_overflows) {
+      recv = cap_pkts_recv;
+      drop = cap_pkts_drop;
+      peak = cap_ring_peak;
+      overflows = cap_ring_overflows;
+      changes++;
+   }
+   return changes;
+}
+
 /* ---------------------------------------------------------------------------
  * Database Import: Grab graphs from a file provided by the caller.
  *
@@ -229,6 +269,9 @@ int graph_import(const int fd) {
 
    if (!read64(fd, &last)) return 0;
    last_real = last;
+   generation++;
+   redrawn++;
+   changes++;
 
    for (i=0; i<graph_db_size; i++) {
       unsigned char num_bars, pos;
@@ -314,12 +357,21 @@ struct str *html_front_page(void) {
       "<b>Total</b> <span id=\"tb\">%'qu</span> <b>bytes, "
       "in</b> <span id=\"tp\">%'qu</span> <b>packets.</b> "
       "(<span id=\"pc\">%'u</span> <b>captured,</b> "
-      "<span id=\"pd\">%'u</span> <b>dropped)</b><br>\n"
-      "</p>\n",
+      "<span id=\"pd\">%'u</span> <b>dropped)</b><br>\n",
       (qu)acct_total_bytes,
       (qu)acct_total_packets,
       cap_pkts_recv,
       cap_pkts_drop);
+   if (cap_ring_size > 0)
+      str_appendf(buf,
+         "<b>Capture ring</b> <span id=\"ru\">%'u</span> <b>of</b> %'u "
+         "<b>used, peak</b> <span id=\"rp\">%'u</span><b>,</b> "
+         "<span id=\"ro\">%'qu</span> <b>overflowed.</b><br>\n",
+         cap_ring_used,
+         cap_ring_size,
+         cap_ring_peak,
+         (qu)cap_ring_overflows);
+   str_append(buf, "</p>\n");
 
    str_append(buf,
       "<div id=\"graphs\">\n"
@@ -330,6 +382,7 @@ struct str *html_front_page(void) {
       "var graph_height = " GRAPH_HEIGHT ";\n"
       "var bar_gap = 1;\n"
       "var graphs_uri = \"graphs.xml\";\n"
+      "var graphs_events_uri = \"graphs.events\";\n"
       "var graphs = [\n"
    );
 
@@ -363,11 +416,15 @@ struct str *xml_graphs(void) {
    unsigned int i, j;
    struct str *buf = str_make(), *rf;
 
-   str_appendf(buf, "<graphs tp=\"%qu\" tb=\"%qu\" pc=\"%u\" pd=\"%u\" rf=\"",
+   str_appendf(buf, "<graphs tp=\"%qu\" tb=\"%qu\" pc=\"%u\" pd=\"%u\" "
+      "ru=\"%u\" rp=\"%u\" ro=\"%qu\" rf=\"",
       (qu)acct_total_packets,
       (qu)acct_total_bytes,
       cap_pkts_recv,
-      cap_pkts_drop);
+      cap_pkts_drop,
+      cap_ring_used,
+      cap_ring_peak,
+      (qu)cap_ring_overflows);
    rf = length_of_time(now_real() - start_real);
    str_appendstr(buf, rf);
    str_free(rf);
@@ -392,4 +449,147 @@ struct str *xml_graphs(void) {
    return (buf);
 }
 
+/* ---------------------------------------------------------------------------
+ * JSON API: graphs.json has what graphs.xml has, with each graph's bars
+ * oldest first.
+ */
+struct str *json_graphs(void) {
+   unsigned int i, j;
+   struct str *buf = str_make();
+   struct json js;
+
+   json_init(&js, buf);
+   json_object(&js, NULL);
+   json_uint(&js, "packets", acct_total_packets);
+   json_uint(&js, "bytes", acct_total_bytes);
+   json_uint(&js, "pcap_received", cap_pkts_recv);
+   json_uint(&js, "pcap_dropped", cap_pkts_drop);
+   json_uint(&js, "ring_used", cap_ring_used);
+   json_uint(&js, "ring_peak", cap_ring_peak);
+   json_uint(&js, "ring_overflows", cap_ring_overflows);
+   json_uint(&js, "started", (uint64_t)start_real);
+   json_uint(&js, "now", (uint64_t)now_real());
+
+   for (i=0; i<graph_db_size; i++) {
+      const struct graph *g = graph_db[i];
+
+      json_object(&js, g->unit);
+      json_uint(&js, "bar_secs", g->bar_secs);
+      json_array(&js, "bars");
+      j = g->pos;
+      do {
+         j = (j + 1) % g->num_bars;
+         json_object(&js, NULL);
+         json_uint(&js, "pos", g->offset + j);
+         json_uint(&js, "in", g->in[j]);
+         json_uint(&js, "out", g->out[j]);
+         json_object_end(&js);
+      } while (j != g->pos);
+      json_array_end(&js);
+      json_object_end(&js);
+   }
+   json_object_end(&js);
+   return (buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * Server-sent events: graphs.events starts with everything graphs.json has,
+ * then each time the graphs move on, only the bars that could have changed
+ * since the last push.  That's the bar that was current then, any that have
+ * been advanced over (and zeroed) since, and the current one.  Bars are
+ * [pos, in, out], and totals are only there if they changed.
+ */
+#define SSE_TOTALS 7
+
+static struct {
+   uint64_t redrawn;
+   unsigned int pos[sizeof(graph_db)/sizeof(*graph_db)];
+   uint64_t in[sizeof(graph_db)/sizeof(*graph_db)],
+           out[sizeof(graph_db)/sizeof(*graph_db)]; /* of the bar at pos */
+   uint64_t totals[SSE_TOTALS];
+} pushed; /* as of the last sse_graphs_delta() */
+
+static const char *sse_total_names[SSE_TOTALS] = {
+   "packets", "bytes", "pcap_received", "pcap_dropped",
+   "ring_used", "ring_peak", "ring_overflows"
+};
+
+static void sse_totals(uint64_t *totals) {
+   totals[0] = acct_total_packets;
+   totals[1] = acct_total_bytes;
+   totals[2] = cap_pkts_recv;
+   totals[3] = cap_pkts_drop;
+   totals[4] = cap_ring_used;
+   totals[5] = cap_ring_peak;
+   totals[6] = cap_ring_overflows;
+}
+
+struct str *sse_graphs(void) {
+   struct str *buf = str_make(), *js = json_graphs();
+
+   str_append(buf, "event: graphs\ndata: ");
+   str_appendstr(buf, js);
+   str_append(buf, "\n\n");
+   str_free(js);
+   return (buf);
+}
+
+struct str *sse_graphs_delta(void) {
+   uint64_t totals[SSE_TOTALS];
+   unsigned int i, j;
+   struct str *buf;
+   struct json js;
+
+   sse_totals(totals);
+   if (pushed.redrawn != redrawn) {
+      /* Too much has moved to say what: start over. */
+      pushed.redrawn = redrawn;
+      for (i=0; i<graph_db_size; i++) {
+         pushed.pos[i] = graph_db[i]->pos;
+         pushed.in[i] = graph_db[i]->in[graph_db[i]->pos];
+         pushed.out[i] = graph_db[i]->out[graph_db[i]->pos];
+      }
+      memcpy(pushed.totals, totals, sizeof(totals));
+      return (sse_graphs());
+   }
+
+   buf = str_make();
+   str_append(buf, "event: bars\ndata: ");
+   json_init(&js, buf);
+   json_object(&js, NULL);
+   json_uint(&js, "now", (uint64_t)now_real());
+   for (i=0; i<SSE_TOTALS; i++)
+      if (totals[i] != pushed.totals[i]) {
+         json_uint(&js, sse_total_names[i], totals[i]);
+         pushed.totals[i] = totals[i];
+      }
+
+   for (i=0; i<graph_db_size; i++) {
+      const struct graph *g = graph_db[i];
+
+      if (g->pos == pushed.pos[i] && g->in[g->pos] == pushed.in[i] &&
+          g->out[g->pos] == pushed.out[i])
+         continue; /* nothing new */
+      json_array(&js, g->unit);
+      j = pushed.pos[i];
+      for (;;) {
+         json_array(&js, NULL);
+         json_uint(&js, NULL, g->offset + j);
+         json_uint(&js, NULL, g->in[j]);
+         json_uint(&js, NULL, g->out[j]);
+         json_array_end(&js);
+         if (j == g->pos)
+            break;
+         j = (j + 1) % g->num_bars;
+      }
+      json_array_end(&js);
+      pushed.pos[i] = g->pos;
+      pushed.in[i] = g->in[g->pos];
+      pushed.out[i] = g->out[g->pos];
+   }
+   json_object_end(&js);
+   str_append(buf, "\n\n");
+   return (buf);
+}
+
 /* vim:set ts=3 sw=3 tw=80 et: */
@@ -20,11 +20,16 @@ void graph_reset(void);
 void graph_free(void);
 void graph_acct(uint64_t amount, enum graph_dir dir);
 void graph_rotate(void);
+uint64_t graph_generation(void);
+uint64_t graph_changes(void);
 int graph_import(const int fd);
 int graph_export(const int fd);
 
 struct str *html_front_page(void);
 struct str *xml_graphs(void);
+struct str *json_graphs(void);
+struct str *sse_graphs(void);
+struct str *sse_graphs_delta(void); /* since the last call */
 
 #endif
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -15,14 +15,20 @@
 #include "hosts_db.h"
 #include "db.h"
 #include "html.h"
+#include "json.h"
+#include "metrics.h"
 #include "ncache.h"
 #include "now.h"
 #include "opt.h"
+#include "pool.h"
+#include "siphash.h"
 #include "str.h"
+#include "topk.h"
 
 #include <netdb.h>  /* struct addrinfo */
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h> /* offsetof() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> /* memset(), strcmp() */
@@ -33,23 +39,77 @@ int hosts_db_show_macs = 0;
 
 /* FIXME: specify somewhere more sane/tunable */
 #define MAX_ENTRIES 30 /* in an HTML table rendered from a hashtable */
+#define TOPK_ENTRIES (4 * MAX_ENTRIES) /* first pages of hosts kept ready */
+#define TOPK_KEEP (2 * TOPK_ENTRIES) /* room for hosts to go away */
 
 typedef uint32_t (hash_func_t)(const struct hashtable *, const void *);
 typedef void (free_func_t)(struct bucket *);
 typedef const void * (key_func_t)(const struct bucket *);
 typedef int (find_func_t)(const struct bucket *, const void *);
-typedef struct bucket * (make_func_t)(const void *);
+typedef struct bucket * (make_func_t)(struct pool *, const void *);
+typedef uint64_t (score_func_t)(const struct bucket *, const time_t now);
 typedef void (format_cols_func_t)(struct str *);
 typedef void (format_row_func_t)(struct str *, const struct bucket *,
    const char *);
 
+/* A hosts table in sort order, see sorted_view(). */
+struct sorted_view {
+   const struct bucket **table;
+   uint64_t *keys;      /* each one's sort value when it was made */
+   uint32_t count;
+   uint64_t generation;
+   struct timespec made;
+   unsigned int refs;   /* the cache's, and any streams' still sending it */
+};
+
+/* Open addressing with linear probing and Robin Hood insertion: an entry
+ * that's further from its home slot than the one in its way takes that slot
+ * and pushes the other one along.  That keeps probe sequences short and
+ * sorted by distance from home, so a search can give up as soon as it sees
+ * an entry that's closer to home than it would be.
+ *
+ * Buckets are still allocated one at a time, so that pointers to them stay
+ * valid across inserts, but each slot's hash is kept in its own array.
+ * Probing only reads those, and only a matching hash costs a trip out to
+ * the bucket.  Keys and counters stay in the buckets: a hit goes out to its
+ * bucket anyway to count the packet, so this mostly makes misses cheaper.
+ *
+ * Growing is done a bit at a time: the old table is kept, and searched as
+ * well, while every search moves the next few of its slots into the new
+ * one.  No single packet has to wait for millions of entries to move.
+ */
 struct hashtable {
    uint8_t bits;     /* size of hashtable in bits */
    uint32_t size, mask;
    uint32_t count, count_max, count_keep;   /* items in table */
-   uint32_t coeff;   /* coefficient for Fibonacci hashing */
+   uint64_t generation; /* goes up whenever buckets are freed */
+   uint64_t changes;    /* hosts tables: see hosts_db_changes() */
+   uint32_t *hashes; /* zero for an empty slot, else hash | SLOT_USED */
    struct bucket **table;
 
+   /* While growing: the table we're moving out of.  Slots before "moved"
+    * have been emptied into the new one, the rest haven't been touched.
+    */
+   uint32_t old_size, old_mask, moved;
+   uint32_t *old_hashes;
+   struct bucket **old_table;
+
+   struct pool *pool;            /* where our buckets come from */
+   struct bucket_pools *pools;   /* only in hosts tables, see below */
+   struct topk **topk;           /* one per sort_dir, only in hosts_db */
+   struct sorted_view **views;   /* likewise, see sorted_view() */
+
+   /* Only used in hosts tables, see hosts_db_evict(). */
+   struct {
+      int active;
+      uint32_t cursor;        /* next slot to look at */
+      uint64_t cutoff;        /* evicting scores up to this */
+      uint64_t inserts_seen;  /* stats.inserts as of the last step */
+      uint64_t rounds, evicted, forced;
+      uint32_t last_evicted;  /* in the current or last round */
+      time_t last_start, last_secs;
+   } evict;
+
    struct {
       uint64_t inserts, searches, deletions, rehashes;
    } stats;
@@ -67,7 +127,11 @@ struct hashtable {
    /* returns true if given bucket matches key (passed as void*) */
 
    make_func_t *make_func;
-   /* returns bucket containing new record with key (passed as void*) */
+   /* returns bucket from the pool containing new record with key (passed as
+    * void*) */
+
+   score_func_t *score_func;
+   /* how much a bucket is worth keeping when the table is reduced */
 
    format_cols_func_t *format_cols_func;
    /* append table columns to str */
@@ -76,62 +140,61 @@ struct hashtable {
    /* format record and append to str */
 };
 
+/* Every bucket under a hosts table, including those in its hosts' port and
+ * protocol tables, comes from the same set of pools.  Emptying the hosts
+ * table can then give them all back at once.
+ */
+struct bucket_pools {
+   struct pool *host, *port_tcp, *port_udp, *ip_proto;
+};
+
 static void hashtable_reduce(struct hashtable *ht);
 static void hashtable_free(struct hashtable *h);
 
-#define HOST_BITS 1  /* initial size of hosts table */
-#define PORT_BITS 1  /* initial size of ports tables */
-#define PROTO_BITS 1 /* initial size of proto table */
-
-/* We only use one hosts_db hashtable and this is it. */
-static struct hashtable *hosts_db = NULL;
+#define SLOT_USED 0x80000000U /* tables never get big enough to see this bit */
 
-/* phi^-1 (reciprocal of golden ratio) = (sqrt(5) - 1) / 2 */
-static const double phi_1 =
-   0.61803398874989490252573887119069695472717285156250;
+/* Old slots moved into the new table by each search while growing.  Growth
+ * doubles the size at 80% occupancy, so the new table has room for the old
+ * table's size in inserts before it grows again: any step over 1 finishes
+ * in time.
+ */
+#define REHASH_STEP 16
 
-/* Co-prime of u, using phi^-1 */
-inline static uint32_t
-coprime(const uint32_t u)
+/* The bucket in slot i, counting the old table's slots after the new
+ * table's.
+ */
+inline static struct bucket *
+slot_bucket(const struct hashtable *h, const uint32_t i)
 {
-   return ( (uint32_t)( (double)(u) * phi_1 ) | 1U );
+   if (i < h->size)
+      return (h->table[i]);
+   if (i - h->size < h->moved)
+      return (NULL);
+   return (h->old_table[i - h->size]);
 }
 
-/*
- * This is the "recommended" IPv4 hash function, as seen in FreeBSD's
- * src/sys/netinet/tcp_hostcache.c 1.1
+/* Visit every bucket b in hashtable h, using i as the slot index.  While
+ * it's growing, the walk mustn't change the table or search it: a search
+ * moves buckets between the two parts.
  */
-inline static uint32_t
-ipv4_hash(const struct addr *const a)
-{
-   uint32_t ip = a->ip.v4;
-   return ( (ip) ^ ((ip) >> 7) ^ ((ip) >> 17) );
-}
+#define FOREACH_BUCKET(h, i, b) \
+   for ((i)=0; (i)<(h)->size + (h)->old_size; (i)++) \
+      if (((b) = slot_bucket((h), (i))) != NULL)
 
-#ifndef s6_addr32
-# ifdef sun
-/*
- * http://src.opensolaris.org/source/xref/onnv/onnv-gate/usr/src/uts/common/netinet/in.h#130
+#define HOST_BITS 1  /* initial size of hosts table */
+#define PORT_BITS 1  /* initial size of ports tables */
+#define PROTO_BITS 1 /* initial size of proto table */
+
+/* The global hosts_db hashtable.  Capture worker threads point this at their
+ * own private shard instead, see hosts_db_shard_use().
  */
-#  define s6_addr32 _S6_un._S6_u32
-# else
-/* Covers OpenBSD and FreeBSD.  The macro __USE_GNU has
- * taken care of GNU/Linux and GNU/kfreebsd.  */
-#  define s6_addr32 __u6_addr.__u6_addr32
-# endif
-#endif
+static _thread_local_ struct hashtable *hosts_db = NULL;
 
-/*
- * This is the IPv6 hash function used by FreeBSD in the same file as above,
- * svn rev 122922.
+/* Keys for every table's hash.  An attacker choosing addresses or ports
+ * can't tell where they'll land, so they can't line up long probe sequences
+ * on purpose.  Only set by hosts_db_init(), before any table is made.
  */
-inline static uint32_t
-ipv6_hash(const struct addr *const a)
-{
-   const struct in6_addr *const ip6 = &(a->ip.v6);
-   return ( ip6->s6_addr32[0] ^ ip6->s6_addr32[1] ^
-            ip6->s6_addr32[2] ^ ip6->s6_addr32[3] );
-}
+static struct siphash_key hash_key;
 
 /* ---------------------------------------------------------------------------
  * hash_func collection
@@ -141,25 +204,55 @@ hash_func_host(const struct hashtable *h _unused_, const void *key)
 {
    const struct addr *a = key;
    if (a->family == IPv4)
-      return (ipv4_hash(a));
+      return ((uint32_t)siphash13(&hash_key, &(a->ip.v4), sizeof(a->ip.v4)));
    else {
       assert(a->family == IPv6);
-      return (ipv6_hash(a));
+      return ((uint32_t)siphash13(&hash_key, &(a->ip.v6), sizeof(a->ip.v6)));
    }
 }
 
 #define CASTKEY(type) (*((const type *)key))
 
 static uint32_t
-hash_func_short(const struct hashtable *h, const void *key)
+hash_func_short(const struct hashtable *h _unused_, const void *key)
 {
-   return (CASTKEY(uint16_t) * h->coeff);
+   return ((uint32_t)siphash13(&hash_key, key, sizeof(uint16_t)));
 }
 
 static uint32_t
-hash_func_byte(const struct hashtable *h, const void *key)
+hash_func_byte(const struct hashtable *h _unused_, const void *key)
+{
+   return ((uint32_t)siphash13(&hash_key, key, sizeof(uint8_t)));
+}
+
+/* ---------------------------------------------------------------------------
+ * score_func collection
+ */
+static uint64_t
+score_func_total(const struct bucket *b, const time_t now _unused_)
 {
-   return (CASTKEY(uint8_t) * h->coeff);
+   return (b->total);
+}
+
+/* With --evict-halflife, a host's total counts for half as much for every
+ * halflife seconds since it was last seen, and linearly in between.
+ */
+static uint64_t
+score_func_host(const struct bucket *b, const time_t now)
+{
+   time_t age;
+   uint64_t score;
+
+   if (opt_evict_halflife == 0)
+      return (b->total);
+   age = now - b->u.host.last_seen_mono;
+   if (age <= 0)
+      return (b->total);
+   if ((uint64_t)age / opt_evict_halflife >= 64)
+      return (0);
+   score = b->total >> (age / opt_evict_halflife);
+   return (score - (uint64_t)((double)score *
+      (double)(age % opt_evict_halflife) / (2.0 * opt_evict_halflife)));
 }
 
 /* ---------------------------------------------------------------------------
@@ -222,17 +315,16 @@ find_func_ip_proto(const struct bucket *b, const void *key)
  * make_func collection
  */
 
-#define MAKE_BUCKET(name_bucket, name_content, type) struct { \
-   struct bucket *next; \
-   uint64_t in, out, total; \
-   union { struct type t; } u; } _custom_bucket; \
-   struct bucket *name_bucket = xcalloc(1, sizeof(_custom_bucket)); \
+/* A bucket only needs room for its own kind of record. */
+#define BUCKET_SIZE(type) (offsetof(struct bucket, u) + sizeof(struct type))
+
+#define MAKE_BUCKET(name_bucket, name_content, type) \
+   struct bucket *name_bucket = pool_get(pool); \
    struct type *name_content = &(name_bucket->u.type); \
-   name_bucket->next = NULL; \
    name_bucket->in = name_bucket->out = name_bucket->total = 0;
 
 static struct bucket *
-make_func_host(const void *key)
+make_func_host(struct pool *pool, const void *key)
 {
    MAKE_BUCKET(b, h, host);
    h->addr = CASTKEY(struct addr);
@@ -256,7 +348,7 @@ free_func_host(struct bucket *b)
 }
 
 static struct bucket *
-make_func_port_tcp(const void *key)
+make_func_port_tcp(struct pool *pool, const void *key)
 {
    MAKE_BUCKET(b, p, port_tcp);
    p->port = CASTKEY(uint16_t);
@@ -265,7 +357,7 @@ make_func_port_tcp(const void *key)
 }
 
 static struct bucket *
-make_func_port_udp(const void *key)
+make_func_port_udp(struct pool *pool, const void *key)
 {
    MAKE_BUCKET(b, p, port_udp);
    p->port = CASTKEY(uint16_t);
@@ -273,7 +365,7 @@ make_func_port_udp(const void *key)
 }
 
 static struct bucket *
-make_func_ip_proto(const void *key)
+make_func_ip_proto(struct pool *pool, const void *key)
 {
    MAKE_BUCKET(b, p, ip_proto);
    p->proto = CASTKEY(uint8_t);
@@ -499,6 +591,7 @@ static struct hashtable *
 hashtable_make(const uint8_t bits,
    const unsigned int count_max,
    const unsigned int count_keep,
+   struct pool *pool,
    hash_func_t *hash_func,
    free_func_t *free_func,
    key_func_t *key_func,
@@ -516,150 +609,316 @@ hashtable_make(const uint8_t bits,
    hash->count_keep = count_keep;
    hash->size = 1U << bits;
    hash->mask = hash->size - 1;
-   hash->coeff = coprime(hash->size);
    hash->hash_func = hash_func;
    hash->free_func = free_func;
    hash->key_func = key_func;
    hash->find_func = find_func;
    hash->make_func = make_func;
+   hash->score_func = score_func_total;
+   memset(&(hash->evict), 0, sizeof(hash->evict));
    hash->format_cols_func = format_cols_func;
    hash->format_row_func = format_row_func;
    hash->count = 0;
+   hash->generation = 0;
+   hash->changes = 0;
+   hash->hashes = xcalloc(hash->size, sizeof(*hash->hashes));
    hash->table = xcalloc(hash->size, sizeof(*hash->table));
+   hash->old_size = hash->old_mask = hash->moved = 0;
+   hash->old_hashes = NULL;
+   hash->old_table = NULL;
+   hash->pool = pool;
+   hash->pools = NULL;
+   hash->topk = NULL;
+   hash->views = NULL;
    memset(&(hash->stats), 0, sizeof(hash->stats));
    return (hash);
 }
 
+/* A hosts table, with its own pools. */
+static struct hashtable *
+hosts_table_make(void)
+{
+   struct bucket_pools *pools = xmalloc(sizeof(*pools));
+   struct hashtable *h;
+
+   pools->host = pool_make("hosts", BUCKET_SIZE(host));
+   pools->port_tcp = pool_make("TCP ports", BUCKET_SIZE(port_tcp));
+   pools->port_udp = pool_make("UDP ports", BUCKET_SIZE(port_udp));
+   pools->ip_proto = pool_make("protocols", BUCKET_SIZE(ip_proto));
+   h = hashtable_make(HOST_BITS, opt_hosts_max, opt_hosts_keep, pools->host,
+      hash_func_host, free_func_host, key_func_host, find_func_host,
+      make_func_host, format_cols_host, format_row_host);
+   h->pools = pools;
+   h->score_func = score_func_host;
+   return (h);
+}
+
+static void
+bucket_pools_free(struct bucket_pools *pools)
+{
+   pool_free(pools->host);
+   pool_free(pools->port_tcp);
+   pool_free(pools->port_udp);
+   pool_free(pools->ip_proto);
+   free(pools);
+}
+
 /* ---------------------------------------------------------------------------
  * Initialise global hosts_db.
  */
 void
 hosts_db_init(void)
 {
+   int d;
+
    assert(hosts_db == NULL);
-   hosts_db = hashtable_make(HOST_BITS, opt_hosts_max, opt_hosts_keep,
-      hash_func_host, free_func_host, key_func_host, find_func_host,
-      make_func_host, format_cols_host, format_row_host);
+   siphash_keygen(&hash_key);
+   hosts_db = hosts_table_make();
+
+   /* Shards don't need these: pages are only made from hosts_db. */
+   hosts_db->topk = xmalloc(SORT_DIRS * sizeof(*hosts_db->topk));
+   for (d=0; d<SORT_DIRS; d++)
+      hosts_db->topk[d] = topk_make((enum sort_dir)d, TOPK_KEEP);
+   hosts_db->views = xcalloc(SORT_DIRS, sizeof(*hosts_db->views));
+}
+
+/* How far the entry with this hash in slot pos is from its home slot. */
+inline static uint32_t
+probe_dist(const uint32_t mask, const uint32_t pos, const uint32_t hash)
+{
+   return ((pos - hash) & mask);
+}
+
+/* Put a bucket into a table that has room for it. */
+static void
+hashtable_place(struct hashtable *h, uint32_t hash, struct bucket *b)
+{
+   uint32_t pos = hash & h->mask, dist = 0;
+
+   for (;;) {
+      uint32_t d;
+
+      if (h->hashes[pos] == 0) {
+         h->hashes[pos] = hash;
+         h->table[pos] = b;
+         return;
+      }
+      d = probe_dist(h->mask, pos, h->hashes[pos]);
+      if (d < dist) {
+         /* Take the slot from the entry that's closer to home. */
+         uint32_t tmp_hash = h->hashes[pos];
+         struct bucket *tmp_b = h->table[pos];
+
+         h->hashes[pos] = hash;
+         h->table[pos] = b;
+         hash = tmp_hash;
+         b = tmp_b;
+         dist = d;
+      }
+      pos = (pos + 1) & h->mask;
+      dist++;
+   }
+}
+
+/* Move up to n of the old table's slots into the new one.  Hashes don't
+ * depend on the table size, so this doesn't need to look at the buckets.
+ */
+static void
+hashtable_rehash_step(struct hashtable *h, uint32_t n)
+{
+   if (h->old_table == NULL)
+      return;
+   for (; (n > 0) && (h->moved < h->old_size); n--, h->moved++)
+      if (h->old_hashes[h->moved] != 0)
+         hashtable_place(h, h->old_hashes[h->moved],
+            h->old_table[h->moved]);
+   if (h->moved == h->old_size) {
+      free(h->old_hashes);
+      free(h->old_table);
+      h->old_hashes = NULL;
+      h->old_table = NULL;
+      h->old_size = h->old_mask = h->moved = 0;
+   }
+}
+
+/* Move whatever's left of the old table, if we're growing. */
+static void
+hashtable_rehash_finish(struct hashtable *h)
+{
+   if (h->old_table != NULL)
+      hashtable_rehash_step(h, h->old_size);
 }
 
+/* Start moving everything into a table of 2^bits slots. */
 static void
-hashtable_rehash(struct hashtable *h, const uint8_t bits)
+hashtable_rehash_begin(struct hashtable *h, const uint8_t bits)
 {
-   struct bucket **old_table, **new_table;
-   uint32_t i, old_size;
    assert(h != NULL);
    assert(bits > 0);
+   assert(bits < 32); /* SLOT_USED */
 
+   hashtable_rehash_finish(h);
    h->stats.rehashes++;
-   old_size = h->size;
-   old_table = h->table;
+   h->old_size = h->size;
+   h->old_mask = h->mask;
+   h->old_hashes = h->hashes;
+   h->old_table = h->table;
+   h->moved = 0;
 
    h->bits = bits;
    h->size = 1U << bits;
    h->mask = h->size - 1;
-   h->coeff = coprime(h->size);
-   new_table = xcalloc(h->size, sizeof(*new_table));
-
-   for (i=0; i<old_size; i++) {
-      struct bucket *next, *b = old_table[i];
-      while (b != NULL) {
-         uint32_t pos = h->hash_func(h, h->key_func(b)) & h->mask;
-         next = b->next;
-         b->next = new_table[pos];
-         new_table[pos] = b;
-         b = next;
-      }
-   }
-
-   free(h->table);
-   h->table = new_table;
+   h->hashes = xcalloc(h->size, sizeof(*h->hashes));
+   h->table = xcalloc(h->size, sizeof(*h->table));
 }
 
 static void
-hashtable_insert(struct hashtable *h, struct bucket *b)
+hashtable_insert(struct hashtable *h, struct bucket *b, const uint32_t hash)
 {
-   uint32_t pos;
    assert(h != NULL);
    assert(b != NULL);
-   assert(b->next == NULL);
 
-   /* Rehash on 80% occupancy */
-   if ((h->count > h->size) ||
-       ((h->size - h->count) < h->size / 5))
-      hashtable_rehash(h, h->bits+1);
+   /* Grow rather than go over 80% occupancy. */
+   if ((uint64_t)(h->count + 1) * 5 > (uint64_t)h->size * 4)
+      hashtable_rehash_begin(h, h->bits+1);
 
-   pos = h->hash_func(h, h->key_func(b)) & h->mask;
-   if (h->table[pos] == NULL)
-      h->table[pos] = b;
-   else {
-      /* Insert at top of chain. */
-      b->next = h->table[pos];
-      h->table[pos] = b;
-   }
+   hashtable_place(h, hash | SLOT_USED, b);
    h->count++;
    h->stats.inserts++;
 }
 
+/* Search one set of slots. */
+static struct bucket *
+slots_search(const struct hashtable *h, const uint32_t *hashes,
+   struct bucket *const *table, const uint32_t mask, const void *key,
+   const uint32_t hash)
+{
+   const uint32_t want = hash | SLOT_USED;
+   uint32_t pos = hash & mask, dist;
+
+   for (dist = 0; ; dist++) {
+      const uint32_t found = hashes[pos];
+
+      /* If the key were here, it would have taken this slot. */
+      if ((found == 0) || (probe_dist(mask, pos, found) < dist))
+         return (NULL);
+      if ((found == want) && h->find_func(table[pos], key))
+         return (table[pos]);
+      pos = (pos + 1) & mask;
+   }
+}
+
 /* Return bucket matching key, or NULL if no such entry. */
 static struct bucket *
-hashtable_search(struct hashtable *h, const void *key)
+hashtable_search_hashed(struct hashtable *h, const void *key,
+   const uint32_t hash)
 {
-   uint32_t pos;
    struct bucket *b;
 
    h->stats.searches++;
-   pos = h->hash_func(h, key) & h->mask;
-   b = h->table[pos];
-   while (b != NULL) {
-      if (h->find_func(b, key))
-         return (b);
-      else
-         b = b->next;
-   }
-   return (NULL);
+   hashtable_rehash_step(h, REHASH_STEP);
+   b = slots_search(h, h->hashes, h->table, h->mask, key, hash);
+   /* The old table is never changed while it's being moved out of, so an
+    * entry that isn't in the new table yet is still where it was.
+    */
+   if ((b == NULL) && (h->old_table != NULL))
+      b = slots_search(h, h->old_hashes, h->old_table, h->old_mask, key,
+         hash);
+   return (b);
+}
+
+static struct bucket *
+hashtable_search(struct hashtable *h, const void *key)
+{
+   return (hashtable_search_hashed(h, key, h->hash_func(h, key)));
 }
 
 typedef enum { NO_REDUCE = 0, ALLOW_REDUCE = 1 } reduce_bool;
 /* Search for a key.  If it's not there, make and insert a bucket for it. */
 static struct bucket *
-hashtable_find_or_insert(struct hashtable *h, const void *key,
-      const reduce_bool allow_reduce)
+hashtable_find_or_insert_hashed(struct hashtable *h, const void *key,
+      const uint32_t hash, const reduce_bool allow_reduce)
 {
-   struct bucket *b = hashtable_search(h, key);
+   struct bucket *b = hashtable_search_hashed(h, key, hash);
 
    if (b == NULL) {
       /* Not found, so insert after checking occupancy. */
       if (allow_reduce && (h->count >= h->count_max))
          hashtable_reduce(h);
-      b = h->make_func(key);
-      hashtable_insert(h, b);
+      b = h->make_func(h->pool, key);
+      hashtable_insert(h, b, hash);
    }
    return (b);
 }
 
+static struct bucket *
+hashtable_find_or_insert(struct hashtable *h, const void *key,
+      const reduce_bool allow_reduce)
+{
+   return (hashtable_find_or_insert_hashed(h, key, h->hash_func(h, key),
+      allow_reduce));
+}
+
+/* Free a bucket's contents, then give it back to its pool. */
+static void
+hashtable_free_bucket(struct hashtable *h, struct bucket *b)
+{
+   if (h->topk != NULL) {
+      int d;
+
+      for (d=0; d<SORT_DIRS; d++)
+         topk_remove(h->topk[d], b);
+   }
+   h->free_func(b);
+   pool_put(h->pool, b);
+   h->generation++;
+}
+
+/* Free the table, but not its buckets. */
+static void
+hashtable_drop(struct hashtable *h)
+{
+   if (h == NULL)
+      return;
+   free(h->old_hashes);
+   free(h->old_table);
+   free(h->hashes);
+   free(h->table);
+   free(h);
+}
+
+static void hosts_table_empty(struct hashtable *h);
+static void sorted_views_free(struct hashtable *h);
+
 /*
- * Frees the hashtable and the buckets.  The contents are assumed to be
- * "simple" -- i.e. no "destructor" action is required beyond simply freeing
- * the bucket.
+ * Frees the hashtable and the buckets.
  */
 static void
 hashtable_free(struct hashtable *h)
 {
+   struct bucket *b;
    uint32_t i;
 
    if (h == NULL)
       return;
-   for (i=0; i<h->size; i++) {
-      struct bucket *tmp, *b = h->table[i];
-      while (b != NULL) {
-         tmp = b;
-         b = b->next;
-         h->free_func(tmp);
-         free(tmp);
+   if (h->pools != NULL) {
+      hosts_table_empty(h);
+      bucket_pools_free(h->pools);
+      if (h->topk != NULL) {
+         int d;
+
+         for (d=0; d<SORT_DIRS; d++)
+            topk_free(h->topk[d]);
+         free(h->topk);
       }
-   }
-   free(h->table);
-   free(h);
+      if (h->views != NULL) {
+         sorted_views_free(h);
+         free(h->views);
+      }
+   } else
+      FOREACH_BUCKET(h, i, b)
+         hashtable_free_bucket(h, b);
+   hashtable_drop(h);
 }
 
 /* ---------------------------------------------------------------------------
@@ -671,6 +930,108 @@ host_get(const struct addr *const a)
    return (hashtable_find_or_insert(hosts_db, a, NO_REDUCE));
 }
 
+/* ---------------------------------------------------------------------------
+ * Batched host lookups, for acct_for_batch().  An address's hash doesn't
+ * depend on the table size, so it stays valid if the table grows between
+ * the prefetches and the host_get_hashed().
+ */
+uint32_t
+host_hash(const struct addr *const a)
+{
+   return (hash_func_host(hosts_db, a));
+}
+
+/* Start pulling the home slot into cache.  While the table is growing, the
+ * host might still be in the old table, and these just miss.
+ */
+void
+host_prefetch_slot(const uint32_t hash)
+{
+   const uint32_t pos = hash & hosts_db->mask;
+
+   _prefetch_(&hosts_db->hashes[pos]);
+   _prefetch_(&hosts_db->table[pos]);
+}
+
+/* Once the slot is cached, start pulling in the bucket the search will
+ * probably end at.
+ */
+void
+host_prefetch_bucket(const uint32_t hash)
+{
+   const uint32_t want = hash | SLOT_USED;
+   uint32_t pos = hash & hosts_db->mask, dist;
+
+   for (dist = 0; ; dist++) {
+      const uint32_t found = hosts_db->hashes[pos];
+
+      if ((found == 0) || (probe_dist(hosts_db->mask, pos, found) < dist))
+         return;
+      if (found == want) {
+         _prefetch_(hosts_db->table[pos]);
+         return;
+      }
+      pos = (pos + 1) & hosts_db->mask;
+   }
+}
+
+struct bucket *
+host_get_hashed(const struct addr *const a, const uint32_t hash)
+{
+   return (hashtable_find_or_insert_hashed(hosts_db, a, hash, NO_REDUCE));
+}
+
+/* ---------------------------------------------------------------------------
+ * Pages made from hosts_db are good until this changes, or counters go up.
+ */
+uint64_t
+hosts_db_generation(void)
+{
+   return (hosts_db->generation);
+}
+
+/* Goes up whenever anything on the hosts pages changes, apart from the
+ * time: counters go up, hosts come or go, or a host gets its name.
+ */
+uint64_t
+hosts_db_changes(void)
+{
+   return (hosts_db->generation + hosts_db->changes);
+}
+
+void
+hosts_db_changed(void)
+{
+   hosts_db->changes++;
+}
+
+/* ---------------------------------------------------------------------------
+ * Keep the top hosts up to date.
+ */
+void
+host_counted(struct bucket *host)
+{
+   int d;
+
+   hosts_db->changes++;
+   if (hosts_db->topk == NULL)
+      return;
+   for (d=0; d<SORT_DIRS; d++)
+      topk_update(hosts_db->topk[d], host);
+}
+
+/* Refill a top-K from the whole table. */
+static void
+topk_rebuild(struct hashtable *h, const enum sort_dir dir)
+{
+   struct bucket *b;
+   uint32_t i;
+
+   topk_clear(h->topk[dir]);
+   FOREACH_BUCKET(h, i, b)
+      topk_update(h->topk[dir], b);
+}
+
 /* ---------------------------------------------------------------------------
  * Find host, returns NULL if not in DB.
  */
@@ -715,122 +1076,315 @@ host_search(const char *ipstr)
    return (hashtable_search(hosts_db, &a));
 }
 
+/* ---------------------------------------------------------------------------
+ * Remove the entry in slot pos, and pull back the entries after it that
+ * aren't in their home slots.  That leaves the table just as if the entry
+ * had never been inserted, so searches still work.
+ */
+static void
+hashtable_remove_slot(struct hashtable *h, uint32_t pos)
+{
+   for (;;) {
+      const uint32_t next = (pos + 1) & h->mask;
+      const uint32_t hash = h->hashes[next];
+
+      if ((hash == 0) || (probe_dist(h->mask, next, hash) == 0))
+         break;
+      h->hashes[pos] = hash;
+      h->table[pos] = h->table[next];
+      pos = next;
+   }
+   h->hashes[pos] = 0;
+   h->table[pos] = NULL;
+   h->count--;
+   h->stats.deletions++;
+}
+
 /* ---------------------------------------------------------------------------
  * Reduce a hashtable to the top <keep> entries.
  */
+static uint64_t reductions = 0; /* in any table, by any thread: atomic */
+
 static void
 hashtable_reduce(struct hashtable *ht)
 {
    uint32_t i, pos, rmd;
-   const struct bucket **table;
-   uint64_t cutoff;
+   uint64_t *scores, cutoff;
+   const struct bucket *b;
+   const time_t now = now_mono();
 
    assert(ht->count_keep < ht->count);
+   hashtable_rehash_finish(ht); /* so that buckets can be removed by slot */
 
-   /* Fill table with pointers to buckets in hashtable. */
-   table = xcalloc(ht->count, sizeof(*table));
-   for (pos=0, i=0; i<ht->size; i++) {
-      struct bucket *b = ht->table[i];
-      while (b != NULL) {
-         table[pos++] = b;
-         b = b->next;
-      }
-   }
+   /* Find the score of the first bucket that doesn't make the cut. */
+   scores = xmalloc(ht->count * sizeof(*scores));
+   pos = 0;
+   FOREACH_BUCKET(ht, i, b)
+      scores[pos++] = ht->score_func(b, now);
    assert(pos == ht->count);
-   qsort_buckets(table, ht->count, 0, ht->count_keep, TOTAL);
-   cutoff = table[ht->count_keep]->total;
-   free(table);
+   cutoff = select_nth_value(scores, ht->count, ht->count_keep);
+   free(scores);
 
-   /* Remove all elements with total <= cutoff. */
+   /* Remove all elements with score <= cutoff.  Removing pulls the next
+    * entries back, so look at the same slot again afterwards.  Entries that
+    * wrap around from slot 0 have already been kept, so keeping them again
+    * at the end is harmless.
+    */
    rmd = 0;
-   for (i=0; i<ht->size; i++) {
-      struct bucket *last = NULL, *next, *b = ht->table[i];
-      while (b != NULL) {
-         next = b->next;
-         if (b->total <= cutoff) {
-            /* Remove this one. */
-            ht->free_func(b);
-            free(b);
-            if (last == NULL)
-               ht->table[i] = next;
-            else
-               last->next = next;
-            rmd++;
-            ht->count--;
-         } else {
-            last = b;
-         }
-         b = next;
-      }
+   i = 0;
+   while (i < ht->size) {
+      struct bucket *victim = ht->table[i];
+
+      if ((victim != NULL) && (ht->score_func(victim, now) <= cutoff)) {
+         hashtable_free_bucket(ht, victim);
+         hashtable_remove_slot(ht, i);
+         rmd++;
+      } else
+         i++;
    }
+   __atomic_add_fetch(&reductions, 1, __ATOMIC_RELAXED);
    verbosef("hashtable_reduce: removed %u buckets, left %u",
       rmd, ht->count);
-   hashtable_rehash(ht, ht->bits); /* is this needed? */
 }
 
-/* Reduce hosts_db if needed. */
+/* How many times any hosts, port or protocol table has been cut down. */
+uint64_t
+hosts_db_reductions(void)
+{
+   return (__atomic_load_n(&reductions, __ATOMIC_RELAXED));
+}
+
+/* Whether hosts_db has reached --hosts-max, so that accounting the next
+ * packet cuts it down.
+ */
+int
+hosts_db_full(void)
+{
+   return (hosts_db->count >= hosts_db->count_max);
+}
+
+/* Reduce hosts_db if needed.  This is the hard limit: hosts_db_evict()
+ * normally keeps the table well under it.
+ */
 void hosts_db_reduce(void)
 {
-   if (hosts_db->count >= hosts_db->count_max)
+   if (hosts_db_full()) {
       hashtable_reduce(hosts_db);
+      hosts_db->evict.active = 0;
+      hosts_db->evict.forced++;
+   }
 }
 
 /* ---------------------------------------------------------------------------
- * Reset hosts_db to empty.
+ * Amortized eviction.  Once the hosts table is halfway from --hosts-keep to
+ * --hosts-max, start a round: estimate the score that about --hosts-keep
+ * hosts are above, then sweep the table a few slots per call, evicting
+ * every host at or below it.  Like hashtable_reduce(), that takes all the
+ * hosts tied at the cutoff, not however many of them come first in slot
+ * order, which depends on the hash key.  The round ends when the sweep
+ * reaches the end.
+ *
+ * Each call sweeps EVICT_STEP slots, plus more for every host inserted
+ * since the last call: enough that, at that rate, the sweep will be done
+ * before the table gets to --hosts-max.  A flood of new hosts makes the
+ * steps bigger instead of running into the hard limit.
+ *
+ * A small table is scored in full, which finds the same cutoff that
+ * hashtable_reduce() would.  A big one is sampled at evenly spaced slots:
+ * the hash puts hosts in slots at random, so that's a random sample.
+ *
+ * The sweep goes through the table in blocks, visited in a scrambled order.
+ * Going straight through would empty out one end while new hosts fill up
+ * the other, and the probe sequences there would get very long.
+ *
+ * The sample, and which new hosts land in slots the sweep has already been
+ * past, both depend on the hash key, which is picked at random each run.
+ * Reading capture files, nobody is waiting on a page, so there's no round:
+ * the table is only cut down by hashtable_reduce() when it's full, the
+ * same way every time.
  */
-void
-hosts_db_reset(void)
+#define EVICT_SAMPLES 1024 /* scores used to estimate the cutoff */
+#define EVICT_STEP 64      /* least slots swept per hosts_db_evict() */
+#define EVICT_BLOCK 64     /* slots swept in order before skipping ahead */
+#define EVICT_STRIDE 2654435769U /* odd, so it visits every block */
+
+/* The slot that the sweep looks at c'th. */
+static uint32_t
+evict_slot(const struct hashtable *h, const uint32_t c)
 {
-   unsigned int i;
+   const uint32_t block_size = MIN(EVICT_BLOCK, h->size);
+   const uint32_t block_mask = h->size / block_size - 1;
+   const uint32_t block = ((c / block_size) * EVICT_STRIDE) & block_mask;
+
+   return (block * block_size + c % block_size);
+}
+
+static uint32_t
+evict_start_count(const struct hashtable *h)
+{
+   return (h->count_keep + (h->count_max - h->count_keep) / 2);
+}
 
-   for (i=0; i<hosts_db->size; i++) {
-      struct bucket *next, *b = hosts_db->table[i];
-      while (b != NULL) {
-         next = b->next;
-         hosts_db->free_func(b);
-         free(b);
-         b = next;
+static void
+evict_begin(struct hashtable *h, const time_t now)
+{
+   uint64_t scores[EVICT_SAMPLES];
+   const struct bucket *b;
+   uint32_t i, n = 0, k;
+
+   if (h->count <= EVICT_SAMPLES) {
+      FOREACH_BUCKET(h, i, b)
+         scores[n++] = h->score_func(b, now);
+      assert(n == h->count);
+      k = h->count_keep;
+   } else {
+      for (n = 0; n < EVICT_SAMPLES; n++) {
+         uint32_t pos = (uint32_t)((uint64_t)n * h->size / EVICT_SAMPLES);
+
+         while (h->table[pos] == NULL)
+            pos = (pos + 1) & h->mask;
+         scores[n] = h->score_func(h->table[pos], now);
       }
-      hosts_db->table[i] = NULL;
+      k = (uint32_t)((uint64_t)EVICT_SAMPLES * h->count_keep / h->count);
+   }
+   k = MIN(k, n - 1);
+   h->evict.cutoff = select_nth_value(scores, n, k);
+   h->evict.cursor = 0;
+   h->evict.active = 1;
+   h->evict.rounds++;
+   h->evict.last_evicted = 0;
+   h->evict.last_start = now;
+}
+
+void
+hosts_db_evict(void)
+{
+   struct hashtable *h = hosts_db;
+   const time_t now = now_mono();
+   const uint64_t inserted = h->stats.inserts - h->evict.inserts_seen;
+   uint64_t budget;
+
+   h->evict.inserts_seen = h->stats.inserts;
+   if ((h->count_max == 0) || (h->old_table != NULL))
+      return; /* no limit, or growing: buckets are moving between slots */
+   if (opt_capfile != NULL)
+      return; /* reading capture files: see above */
+
+   if (!h->evict.active) {
+      if ((h->count < evict_start_count(h)) || (h->count <= h->count_keep))
+         return;
+      evict_begin(h, now);
+   }
+
+   if (h->count >= h->count_max)
+      budget = h->size;
+   else
+      budget = EVICT_STEP + inserted * (h->size - h->evict.cursor) /
+         (h->count_max - h->count);
+   for (; (budget > 0) && (h->evict.cursor < h->size); budget--) {
+      const uint32_t pos = evict_slot(h, h->evict.cursor);
+      struct bucket *victim = h->table[pos];
+
+      /* Removing pulls the next entries back, so look at the same slot
+       * again afterwards.  Entries might be seen twice or not at all, but
+       * this is only an estimate anyway.
+       */
+      if ((victim != NULL) &&
+          (h->score_func(victim, now) <= h->evict.cutoff)) {
+         hashtable_free_bucket(h, victim);
+         hashtable_remove_slot(h, pos);
+         h->evict.evicted++;
+         h->evict.last_evicted++;
+      } else
+         h->evict.cursor++;
+   }
+   if (h->evict.cursor == h->size) {
+      h->evict.active = 0;
+      h->evict.last_secs = now - h->evict.last_start;
+      verbosef("hosts_db_evict: evicted %u hosts, left %u",
+         h->evict.last_evicted, h->count);
    }
-   verbosef("hosts_db reset to empty, freed %u hosts", hosts_db->count);
-   hosts_db->count = 0;
 }
 
 /* ---------------------------------------------------------------------------
- * Deallocate hosts_db.
+ * Free all buckets, leaving a hosts table empty but at its current size.
+ * Only the hosts need a look, for their names and their tables: the buckets
+ * all go back to the pools in one go.
  */
-void hosts_db_free(void)
+static void
+hosts_table_empty(struct hashtable *h)
 {
+   struct bucket *b;
    uint32_t i;
 
-   assert(hosts_db != NULL);
-   for (i=0; i<hosts_db->size; i++) {
-      struct bucket *tmp, *b = hosts_db->table[i];
-      while (b != NULL) {
-         tmp = b;
-         b = b->next;
-         hosts_db->free_func(tmp);
-         free(tmp);
-      }
+   assert(h->pools != NULL);
+   if (h->topk != NULL) {
+      int d;
+
+      for (d=0; d<SORT_DIRS; d++)
+         topk_clear(h->topk[d]);
    }
-   free(hosts_db->table);
-   free(hosts_db);
-   hosts_db = NULL;
+   FOREACH_BUCKET(h, i, b) {
+      struct host *host = &(b->u.host);
+
+      free(host->dns);
+      hashtable_drop(host->ports_tcp);
+      hashtable_drop(host->ports_udp);
+      hashtable_drop(host->ip_protos);
+   }
+   free(h->old_hashes);
+   free(h->old_table);
+   h->old_hashes = NULL;
+   h->old_table = NULL;
+   h->old_size = h->old_mask = h->moved = 0;
+   memset(h->hashes, 0, h->size * sizeof(*h->hashes));
+   memset(h->table, 0, h->size * sizeof(*h->table));
+   h->count = 0;
+   h->generation++;
+   h->evict.active = 0;
+   if (h->views != NULL)
+      sorted_views_free(h);
+   pool_empty(h->pools->host);
+   pool_empty(h->pools->port_tcp);
+   pool_empty(h->pools->port_udp);
+   pool_empty(h->pools->ip_proto);
 }
 
 /* ---------------------------------------------------------------------------
- * Find or create a port_tcp inside a host.
+ * Reset hosts_db to empty.
  */
-struct bucket *
-host_get_port_tcp(struct bucket *host, const uint16_t port)
+void
+hosts_db_reset(void)
 {
-   struct host *h = &host->u.host;
-   assert(h != NULL);
+   uint32_t count = hosts_db->count;
+
+   hosts_table_empty(hosts_db);
+   hosts_db->changes++;
+   verbosef("hosts_db reset to empty, freed %u hosts", count);
+}
+
+/* ---------------------------------------------------------------------------
+ * Deallocate hosts_db.
+ */
+void hosts_db_free(void)
+{
+   assert(hosts_db != NULL);
+   hashtable_free(hosts_db);
+   hosts_db = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Find or create a port_tcp inside a host.
+ */
+struct bucket *
+host_get_port_tcp(struct bucket *host, const uint16_t port)
+{
+   struct host *h = &host->u.host;
+   assert(h != NULL);
    if (h->ports_tcp == NULL)
       h->ports_tcp = hashtable_make(PORT_BITS, opt_ports_max, opt_ports_keep,
-         hash_func_short, free_func_simple, key_func_port_tcp,
-         find_func_port_tcp, make_func_port_tcp,
+         hosts_db->pools->port_tcp, hash_func_short, free_func_simple,
+         key_func_port_tcp, find_func_port_tcp, make_func_port_tcp,
          format_cols_port_tcp, format_row_port_tcp);
    return (hashtable_find_or_insert(h->ports_tcp, &port, ALLOW_REDUCE));
 }
@@ -845,8 +1399,8 @@ host_get_port_udp(struct bucket *host, const uint16_t port)
    assert(h != NULL);
    if (h->ports_udp == NULL)
       h->ports_udp = hashtable_make(PORT_BITS, opt_ports_max, opt_ports_keep,
-         hash_func_short, free_func_simple, key_func_port_udp,
-         find_func_port_udp, make_func_port_udp,
+         hosts_db->pools->port_udp, hash_func_short, free_func_simple,
+         key_func_port_udp, find_func_port_udp, make_func_port_udp,
          format_cols_port_udp, format_row_port_udp);
    return (hashtable_find_or_insert(h->ports_udp, &port, ALLOW_REDUCE));
 }
@@ -862,20 +1416,103 @@ host_get_ip_proto(struct bucket *host, const uint8_t proto)
    assert(h != NULL);
    if (h->ip_protos == NULL)
       h->ip_protos = hashtable_make(PROTO_BITS, PROTOS_MAX, PROTOS_KEEP,
-         hash_func_byte, free_func_simple, key_func_ip_proto,
-         find_func_ip_proto, make_func_ip_proto,
+         hosts_db->pools->ip_proto, hash_func_byte, free_func_simple,
+         key_func_ip_proto, find_func_ip_proto, make_func_ip_proto,
          format_cols_ip_proto, format_row_ip_proto);
    return (hashtable_find_or_insert(h->ip_protos, &proto, ALLOW_REDUCE));
 }
 
-static struct str *html_hosts_main(const char *qs);
+/* ---------------------------------------------------------------------------
+ * Shards: private hosts tables for capture worker threads.  A worker calls
+ * hosts_db_shard_use() once, then host_get() and friends work on its shard.
+ * The main thread periodically folds each shard into the global hosts_db
+ * with hosts_db_merge().
+ */
+struct hashtable *
+hosts_db_shard_make(void)
+{
+   return (hosts_table_make());
+}
+
+void
+hosts_db_shard_use(struct hashtable *shard)
+{
+   assert(hosts_db == NULL || shard == NULL);
+   hosts_db = shard;
+}
+
+void
+hosts_db_shard_free(struct hashtable *shard)
+{
+   hashtable_free(shard);
+}
+
+static void
+merge_counts(struct bucket *dst, const struct bucket *src)
+{
+   dst->in    += src->in;
+   dst->out   += src->out;
+   dst->total += src->total;
+}
+
+static void
+merge_host(struct bucket *dst, const struct bucket *src)
+{
+   const struct host *s = &src->u.host;
+   struct host *d = &dst->u.host;
+   const struct bucket *b;
+   uint32_t i;
+
+   merge_counts(dst, src);
+   memcpy(d->mac_addr, s->mac_addr, sizeof(d->mac_addr));
+   if (s->last_seen_mono > d->last_seen_mono)
+      d->last_seen_mono = s->last_seen_mono;
+
+   if (s->ports_tcp != NULL)
+      FOREACH_BUCKET(s->ports_tcp, i, b) {
+         struct bucket *p = host_get_port_tcp(dst, b->u.port_tcp.port);
+         merge_counts(p, b);
+         p->u.port_tcp.syn += b->u.port_tcp.syn;
+      }
+   if (s->ports_udp != NULL)
+      FOREACH_BUCKET(s->ports_udp, i, b)
+         merge_counts(host_get_port_udp(dst, b->u.port_udp.port), b);
+   if (s->ip_protos != NULL)
+      FOREACH_BUCKET(s->ip_protos, i, b)
+         merge_counts(host_get_ip_proto(dst, b->u.ip_proto.proto), b);
+   host_counted(dst);
+}
+
+/* ---------------------------------------------------------------------------
+ * Add everything in the shard to the calling thread's hosts_db, and empty
+ * the shard.  The caller must keep the shard's owner out while we do this.
+ */
+void
+hosts_db_merge(struct hashtable *shard)
+{
+   const struct bucket *b;
+   uint32_t i;
+
+   assert(hosts_db != shard);
+   if (shard->count == 0)
+      return;
+   FOREACH_BUCKET(shard, i, b) {
+      hosts_db_evict();
+      hosts_db_reduce();
+      merge_host(host_get(&b->u.host.addr), b);
+   }
+   hosts_table_empty(shard);
+}
+
+static struct str *html_hosts_main(const char *qs,
+   struct hosts_stream **stream);
 static struct str *html_hosts_detail(const char *ip);
 
 /* ---------------------------------------------------------------------------
  * Web interface: delegate the /hosts/ space.
  */
 struct str *
-html_hosts(const char *uri, const char *query)
+html_hosts(const char *uri, const char *query, struct hosts_stream **stream)
 {
    unsigned int i, num_elems;
    char **elem = split('/', uri, &num_elems);
@@ -884,9 +1521,10 @@ html_hosts(const char *uri, const char *query)
    assert(num_elems >= 1);
    assert(strcmp(elem[0], "hosts") == 0);
 
+   *stream = NULL;
    if (num_elems == 1)
       /* /hosts/ */
-      buf = html_hosts_main(query);
+      buf = html_hosts_main(query, stream);
    else if (num_elems == 2)
       /* /hosts/<IP of host>/ */
       buf = html_hosts_detail(elem[1]);
@@ -898,6 +1536,72 @@ html_hosts(const char *uri, const char *query)
    other codes to be possible */
 }
 
+/* ---------------------------------------------------------------------------
+ * Deep pages and full views need the whole hosts table in order.  Walking
+ * through the pages shouldn't sort it again for each one, so the sorted
+ * table is kept for up to --sort-cache msecs.  It's only good while none of
+ * its hosts have gone away: a changed generation throws it out.  Hosts that
+ * turned up since it was made are left off until the next one.
+ */
+static void
+sorted_view_put(struct sorted_view *v)
+{
+   assert(v->refs > 0);
+   if (--v->refs == 0) {
+      free(v->table);
+      free(v->keys);
+      free(v);
+   }
+}
+
+static void
+sorted_views_free(struct hashtable *h)
+{
+   int d;
+
+   for (d=0; d<SORT_DIRS; d++)
+      if (h->views[d] != NULL) {
+         sorted_view_put(h->views[d]);
+         h->views[d] = NULL;
+      }
+}
+
+/* Returns the table sorted by dir, and hosts that are level in a fixed order
+ * by address, with more than start hosts in it.  It belongs to the cache, so
+ * take a reference to keep it past the next call.
+ */
+static struct sorted_view *
+sorted_view(struct hashtable *h, const enum sort_dir dir,
+   const unsigned int start)
+{
+   struct sorted_view *v = h->views[dir];
+   struct bucket *b;
+   uint32_t i, pos;
+
+   assert(h->count > 0);
+   if ((v != NULL) && (v->generation == h->generation) &&
+       (v->count > start) &&
+       (timer_nsec(&v->made) < (int64_t)opt_sort_cache * 1000000))
+      return (v);
+
+   if (v != NULL)
+      sorted_view_put(v);
+   v = xmalloc(sizeof(*v));
+   v->table = xcalloc(h->count, sizeof(*v->table));
+   pos = 0;
+   FOREACH_BUCKET(h, i, b)
+      v->table[pos++] = b;
+   assert(pos == h->count);
+   v->keys = xmalloc(h->count * sizeof(*v->keys));
+   radix_sort_hosts(v->table, v->keys, h->count, dir);
+   v->count = h->count;
+   v->generation = h->generation;
+   timer_start(&v->made);
+   v->refs = 1;
+   h->views[dir] = v;
+   return (v);
+}
+
 /* ---------------------------------------------------------------------------
  * Format hashtable into HTML.
  */
@@ -906,54 +1610,454 @@ format_table(struct str *buf, struct hashtable *ht, unsigned int start,
    const enum sort_dir sort, const int full)
 {
    const struct bucket **table;
+   struct bucket *b;
    unsigned int i, pos, end;
-   int alt = 0;
+   uint32_t count;
+   int alt = 0, own_table = 1;
 
    if ((ht == NULL) || (ht->count == 0)) {
       str_append(buf, "<p>The table is empty.</p>\n");
       return;
    }
 
-   /* Fill table with pointers to buckets in hashtable. */
-   table = xcalloc(ht->count, sizeof(*table));
-   for (pos=0, i=0; i<ht->size; i++) {
-      struct bucket *b = ht->table[i];
-      while (b != NULL) {
+   if (full)
+      start = 0; /* full report overrides start and end */
+   count = ht->count;
+   end = full ? count : MIN(count, (uint32_t)start+MAX_ENTRIES);
+
+   if (!full && (ht->topk != NULL) && (start+MAX_ENTRIES <= TOPK_ENTRIES)) {
+      /* The first few pages are kept ready, unless too many of the top
+       * hosts have gone away since the last rebuild.
+       */
+      int n = topk_count(ht->topk[sort]);
+
+      if ((n < 0) || ((uint32_t)n < end))
+         topk_rebuild(ht, sort);
+      table = xcalloc(TOPK_KEEP, sizeof(*table));
+      pos = topk_sorted(ht->topk[sort], table);
+      assert(pos >= end);
+   } else if (ht->views != NULL) {
+      const struct sorted_view *v = sorted_view(ht, sort, start);
+
+      table = v->table;
+      count = v->count;
+      end = full ? count : MIN(count, (uint32_t)start+MAX_ENTRIES);
+      own_table = 0;
+   } else {
+      /* Fill table with pointers to buckets in hashtable. */
+      table = xcalloc(ht->count, sizeof(*table));
+      pos = 0;
+      FOREACH_BUCKET(ht, i, b)
          table[pos++] = b;
-         b = b->next;
-      }
+      assert(pos == ht->count);
+      if (full)
+         radix_sort_buckets(table, ht->count, sort);
+      else
+         qsort_buckets(table, ht->count, start, end, sort);
    }
-   assert(pos == ht->count);
-
-   if (full) {
-      /* full report overrides start and end */
-      start = 0;
-      end = ht->count;
-   } else
-      end = MIN(ht->count, (uint32_t)start+MAX_ENTRIES);
 
-   str_appendf(buf, "(%u-%u of %u)<br>\n", start+1, end, ht->count);
-   qsort_buckets(table, ht->count, start, end, sort);
+   str_appendf(buf, "(%u-%u of %u)<br>\n", start+1, end, count);
    ht->format_cols_func(buf);
 
    for (i=start; i<end; i++) {
       ht->format_row_func(buf, table[i], alt ? "alt1" : "alt2");
       alt = !alt; /* alternate class for table rows */
    }
-   free(table);
+   if (own_table)
+      free(table);
    str_append(buf, "</table>\n");
 }
 
+/* ---------------------------------------------------------------------------
+ * How full the bucket pools are.
+ */
+static void
+format_pool_stats(struct str *buf)
+{
+   const struct bucket_pools *pools = hosts_db->pools;
+   const struct pool *list[4];
+   unsigned int i;
+
+   list[0] = pools->host;
+   list[1] = pools->port_tcp;
+   list[2] = pools->port_udp;
+   list[3] = pools->ip_proto;
+   str_append(buf, "<p>Buckets in use:");
+   for (i=0; i<4; i++) {
+      struct pool_stats st;
+
+      pool_stats(list[i], &st);
+      str_appendf(buf, "%s %s %'qu of %'qu (%'qu KB)",
+         (i == 0) ? "" : ",", st.name, (qu)st.in_use, (qu)st.capacity,
+         (qu)(st.bytes / 1024));
+   }
+   str_append(buf, "</p>\n");
+}
+
+/* ---------------------------------------------------------------------------
+ * Where eviction is up to, for tuning --hosts-keep and --hosts-max.
+ */
+static void
+format_evict_stats(struct str *buf)
+{
+   const struct hashtable *h = hosts_db;
+
+   if (h->count_max == 0)
+      return;
+   str_appendf(buf, "<p>Eviction: ");
+   if (h->evict.active)
+      str_appendf(buf, "evicting hosts with scores up to %'qu, "
+         "at slot %'u of %'u",
+         (qu)h->evict.cutoff, h->evict.cursor, h->size);
+   else
+      str_appendf(buf, "idle until %'u hosts",
+         evict_start_count(h));
+   str_appendf(buf, ".  Keeping %'u hosts, hard limit %'u.<br>\n",
+      h->count_keep, h->count_max);
+   str_appendf(buf, "Evicted %'qu hosts in %'qu rounds",
+      (qu)h->evict.evicted, (qu)h->evict.rounds);
+   if (!h->evict.active && (h->evict.rounds > 0))
+      str_appendf(buf, ", the last one evicted %'u in %'u secs",
+         h->evict.last_evicted, (unsigned int)h->evict.last_secs);
+   str_appendf(buf, ".  Hit the hard limit %'qu times.</p>\n",
+      (qu)h->evict.forced);
+}
+
+/* ---------------------------------------------------------------------------
+ * The same numbers for /metrics, straight from the counters: nothing here
+ * looks at a single host.
+ */
+void
+hosts_db_metrics(struct str *buf)
+{
+   const struct hashtable *h = hosts_db;
+   const struct pool *list[4];
+   struct pool_stats st[4];
+   unsigned int i;
+
+   metric(buf, "darkstat_hosts", "gauge",
+      "Hosts in the table.", h->count);
+   metric(buf, "darkstat_hosts_table_slots", "gauge",
+      "Slots in the hosts table.", h->size);
+   metric_head(buf, "darkstat_hosts_table_load", "gauge",
+      "Fraction of the hosts table's slots in use.");
+   metric_sample_ratio(buf, "darkstat_hosts_table_load", h->count, h->size);
+   metric(buf, "darkstat_hosts_table_inserts_total", "counter",
+      "Hosts added to the table.", h->stats.inserts);
+   metric(buf, "darkstat_hosts_table_searches_total", "counter",
+      "Lookups in the hosts table.", h->stats.searches);
+   metric(buf, "darkstat_hosts_table_deletions_total", "counter",
+      "Hosts removed from the table.", h->stats.deletions);
+   metric(buf, "darkstat_hosts_table_rehashes_total", "counter",
+      "Times the hosts table has grown.", h->stats.rehashes);
+   if (h->count_max != 0) {
+      metric(buf, "darkstat_hosts_max", "gauge",
+         "Hard limit on hosts, from --hosts-max.", h->count_max);
+      metric(buf, "darkstat_hosts_evicted_total", "counter",
+         "Hosts evicted to stay under the limit.", h->evict.evicted);
+      metric(buf, "darkstat_hosts_evict_rounds_total", "counter",
+         "Rounds of eviction started.", h->evict.rounds);
+      metric(buf, "darkstat_hosts_limit_hits_total", "counter",
+         "Times the hard limit was hit and the table cut down at once.",
+         h->evict.forced);
+   }
+
+   list[0] = h->pools->host;
+   list[1] = h->pools->port_tcp;
+   list[2] = h->pools->port_udp;
+   list[3] = h->pools->ip_proto;
+   for (i=0; i<4; i++)
+      pool_stats(list[i], &st[i]);
+   metric_head(buf, "darkstat_pool_objects", "gauge",
+      "Buckets handed out, per pool.");
+   for (i=0; i<4; i++)
+      metric_sample(buf, "darkstat_pool_objects", "pool", st[i].name,
+         st[i].in_use);
+   metric_head(buf, "darkstat_pool_capacity", "gauge",
+      "Buckets the pool's slabs can hold.");
+   for (i=0; i<4; i++)
+      metric_sample(buf, "darkstat_pool_capacity", "pool", st[i].name,
+         st[i].capacity);
+   metric_head(buf, "darkstat_pool_bytes", "gauge",
+      "Memory in the pool's slabs.");
+   for (i=0; i<4; i++)
+      metric_sample(buf, "darkstat_pool_bytes", "pool", st[i].name,
+         st[i].bytes);
+}
+
+/* ---------------------------------------------------------------------------
+ * Probe lengths: how far past its home slot each entry sits, which is how
+ * many extra slots a search for it has to look at.
+ */
+#define PROBE_HIST 7
+static const char *probe_hist_labels[PROBE_HIST] =
+   { "0", "1", "2", "3", "4-7", "8-15", "16+" };
+
+struct probe_hist {
+   uint64_t n[PROBE_HIST], count, sum;
+   uint32_t max;
+};
+
+static void
+probe_hist_one(struct probe_hist *ph, const uint32_t dist)
+{
+   unsigned int i;
+
+   if (dist < 4)
+      i = dist;
+   else if (dist < 8)
+      i = 4;
+   else if (dist < 16)
+      i = 5;
+   else
+      i = 6;
+   ph->n[i]++;
+   ph->count++;
+   ph->sum += dist;
+   if (dist > ph->max)
+      ph->max = dist;
+}
+
+static void
+probe_hist_add(struct probe_hist *ph, const struct hashtable *h)
+{
+   uint32_t i;
+
+   if (h == NULL)
+      return;
+   for (i=0; i<h->size; i++)
+      if (h->hashes[i] != 0)
+         probe_hist_one(ph, probe_dist(h->mask, i, h->hashes[i]));
+   for (i=h->moved; i<h->old_size; i++)
+      if (h->old_hashes[i] != 0)
+         probe_hist_one(ph, probe_dist(h->old_mask, i, h->old_hashes[i]));
+}
+
+static void
+format_probe_hist(struct str *buf, const char *name,
+   const struct probe_hist *ph)
+{
+   unsigned int i;
+   uint64_t mean100 = (ph->count == 0) ? 0 : ph->sum * 100 / ph->count;
+
+   str_appendf(buf, "<tr>\n <td>%s</td>\n", name);
+   for (i=0; i<PROBE_HIST; i++)
+      str_appendf(buf, " <td class=\"num\">%'qu</td>\n", (qu)ph->n[i]);
+   str_appendf(buf,
+      " <td class=\"num\">%u</td>\n"
+      " <td class=\"num\">%qu.%s%qu</td>\n"
+      "</tr>\n",
+      ph->max, (qu)(mean100 / 100), (mean100 % 100 < 10) ? "0" : "",
+      (qu)(mean100 % 100));
+}
+
+static void
+format_probe_stats(struct str *buf)
+{
+   struct probe_hist hosts, tcp, udp, protos;
+   const struct bucket *b;
+   uint32_t i;
+
+   memset(&hosts, 0, sizeof(hosts));
+   memset(&tcp, 0, sizeof(tcp));
+   memset(&udp, 0, sizeof(udp));
+   memset(&protos, 0, sizeof(protos));
+   probe_hist_add(&hosts, hosts_db);
+   FOREACH_BUCKET(hosts_db, i, b) {
+      probe_hist_add(&tcp, b->u.host.ports_tcp);
+      probe_hist_add(&udp, b->u.host.ports_udp);
+      probe_hist_add(&protos, b->u.host.ip_protos);
+   }
+
+   str_append(buf,
+      "<table>\n"
+      "<tr>\n"
+      " <th>Probe length</th>\n");
+   for (i=0; i<PROBE_HIST; i++)
+      str_appendf(buf, " <th>%s</th>\n", probe_hist_labels[i]);
+   str_append(buf,
+      " <th>Max</th>\n"
+      " <th>Mean</th>\n"
+      "</tr>\n");
+   format_probe_hist(buf, "hosts", &hosts);
+   format_probe_hist(buf, "TCP ports", &tcp);
+   format_probe_hist(buf, "UDP ports", &udp);
+   format_probe_hist(buf, "protocols", &protos);
+   str_append(buf, "</table>\n");
+}
+
+#define PREV "&lt;&lt;&lt; prev page"
+#define NEXT "next page &gt;&gt;&gt;"
+#define FULL "full table"
+
+/* <prev | full | next>, then the stats, then the end of the page.  The
+ * probe lengths take a walk over every host and its ports, so they're only
+ * there if asked for with ?probes=1.
+ */
+static void
+format_hosts_foot(struct str *buf, const int start, const int full,
+   const char *sortstr, const int probes)
+{
+   if (start > 0) {
+      int prev = start - MAX_ENTRIES;
+      if (prev < 0)
+         prev = 0;
+      str_appendf(buf, "<a href=\"?start=%d&sort=%s\">" PREV "</a>",
+         prev, sortstr);
+   } else
+      str_append(buf, PREV);
+
+   if (full)
+      str_append(buf, " | " FULL);
+   else
+      str_appendf(buf, " | <a href=\"?full=yes&sort=%s\">" FULL "</a>",
+         sortstr);
+
+   if (start+MAX_ENTRIES < (int)hosts_db->count)
+      str_appendf(buf, " | <a href=\"?start=%d&sort=%s\">" NEXT "</a>",
+         start+MAX_ENTRIES, sortstr);
+   else
+      str_append(buf, " | " NEXT);
+
+   str_append(buf, "<br>\n");
+   format_evict_stats(buf);
+   format_pool_stats(buf);
+   if (probes)
+      format_probe_stats(buf);
+   else
+      str_appendf(buf, "<p><a href=\"?probes=1&start=%d&sort=%s\">"
+         "Probe lengths</a></p>\n", start, sortstr);
+
+   html_close(buf);
+}
+
+#undef PREV
+#undef NEXT
+#undef FULL
+
+/* ---------------------------------------------------------------------------
+ * Web interface: the full table of hosts, made a piece at a time while it's
+ * being sent, instead of all at once.  It holds its own reference to a
+ * sorted view, so the order can't change under it.  If any host goes away
+ * before it's done, the rest of the table is left out instead of following
+ * pointers to freed hosts.
+ */
+struct hosts_stream {
+   enum { STREAM_HEAD, STREAM_ROWS, STREAM_FOOT, STREAM_DONE } part;
+   enum sort_dir sort;
+   char *sortstr;
+   struct sorted_view *view;  /* NULL if the table was empty */
+   uint32_t next;             /* row */
+   int alt;
+
+   /* Only for JSON, see json_hosts_main(). */
+   int json, cut_short;
+   struct json j;
+   unsigned int fields;
+   uint32_t limit;            /* rows, or 0 for all of them */
+   uint32_t end;              /* row to stop at */
+   int have_key;              /* the cursor, then the last row sent: */
+   uint64_t key;              /* its sort value */
+   struct addr key_addr;      /* and its address */
+};
+
+static int json_stream_more(struct hosts_stream *s, struct str *buf,
+   const size_t want);
+
+static struct hosts_stream *
+hosts_stream_make(const enum sort_dir sort, const char *sortstr)
+{
+   struct hosts_stream *s = xmalloc(sizeof(*s));
+
+   s->part = STREAM_HEAD;
+   s->sort = sort;
+   s->sortstr = xstrdup(sortstr);
+   s->view = NULL;
+   s->next = 0;
+   s->alt = 0;
+   s->json = 0;
+   s->cut_short = 0;
+   s->fields = 0;
+   s->limit = 0;
+   s->end = 0;
+   s->have_key = 0;
+   s->key = 0;
+   memset(&(s->key_addr), 0, sizeof(s->key_addr));
+   return (s);
+}
+
+void
+hosts_stream_free(struct hosts_stream *s)
+{
+   if (s->view != NULL)
+      sorted_view_put(s->view);
+   free(s->sortstr);
+   free(s);
+}
+
+int
+hosts_stream_more(struct hosts_stream *s, struct str *buf, const size_t want)
+{
+   const size_t stop = str_len(buf) + want;
+
+   if (s->json)
+      return (json_stream_more(s, buf, want));
+   switch (s->part) {
+   case STREAM_HEAD:
+      html_open(buf, "Hosts", /*path_depth=*/1, /*want_graph_js=*/0);
+      if (hosts_db->count == 0) {
+         str_append(buf, "<p>The table is empty.</p>\n");
+         s->part = STREAM_FOOT;
+         break;
+      }
+      s->view = sorted_view(hosts_db, s->sort, 0);
+      s->view->refs++;
+      str_appendf(buf, "(1-%u of %u)<br>\n", s->view->count, s->view->count);
+      hosts_db->format_cols_func(buf);
+      s->part = STREAM_ROWS;
+      /* FALLTHROUGH */
+
+   case STREAM_ROWS:
+      if (s->view->generation != hosts_db->generation) {
+         str_append(buf, "</table>\n");
+         str_appendf(buf, "<p>Hosts went away while this table was being "
+            "sent, so the last %u were left out.</p>\n",
+            s->view->count - s->next);
+         s->part = STREAM_FOOT;
+         break;
+      }
+      while ((s->next < s->view->count) && (str_len(buf) < stop)) {
+         hosts_db->format_row_func(buf, s->view->table[s->next++],
+            s->alt ? "alt1" : "alt2");
+         s->alt = !s->alt;
+      }
+      if (s->next == s->view->count) {
+         str_append(buf, "</table>\n");
+         s->part = STREAM_FOOT;
+      }
+      break;
+
+   case STREAM_FOOT:
+      format_hosts_foot(buf, 0, /*full=*/1, s->sortstr, /*probes=*/0);
+      s->part = STREAM_DONE;
+      break;
+
+   case STREAM_DONE:
+      break;
+   }
+   return (s->part != STREAM_DONE);
+}
+
 /* ---------------------------------------------------------------------------
  * Web interface: sorted table of hosts.
  */
 static struct str *
-html_hosts_main(const char *qs)
+html_hosts_main(const char *qs, struct hosts_stream **stream)
 {
    struct str *buf = str_make();
-   char *qs_start, *qs_sort, *qs_full, *ep;
+   char *qs_start, *qs_sort, *qs_full, *qs_probes, *ep;
    const char *sortstr;
-   int start, full = 0;
+   int start, full = 0, probes = 0;
    enum sort_dir sort;
 
    /* parse query string */
@@ -964,6 +2068,11 @@ html_hosts_main(const char *qs)
       full = 1;
       free(qs_full);
    }
+   qs_probes = qs_get(qs, "probes");
+   if (qs_probes != NULL) {
+      probes = 1;
+      free(qs_probes);
+   }
 
    /* validate sort */
    if (qs_sort == NULL) sort = TOTAL;
@@ -975,6 +2084,16 @@ html_hosts_main(const char *qs)
       str_append(buf, "Error: invalid value for \"sort\".\n");
       goto done;
    }
+   sortstr = qs_sort;
+   if (sortstr == NULL) sortstr = "total";
+
+   if (full) {
+      /* Could be millions of rows: don't make them all now. */
+      *stream = hosts_stream_make(sort, sortstr);
+      str_free(buf);
+      buf = NULL;
+      goto done;
+   }
 
    /* parse start */
    if (qs_start == NULL)
@@ -992,47 +2111,13 @@ html_hosts_main(const char *qs)
       }
    }
 
-#define PREV "&lt;&lt;&lt; prev page"
-#define NEXT "next page &gt;&gt;&gt;"
-#define FULL "full table"
-
    html_open(buf, "Hosts", /*path_depth=*/1, /*want_graph_js=*/0);
    format_table(buf, hosts_db, start, sort, full);
-
-   /* <prev | full | stats | next> */
-   sortstr = qs_sort;
-   if (sortstr == NULL) sortstr = "total";
-   if (start > 0) {
-      int prev = start - MAX_ENTRIES;
-      if (prev < 0)
-         prev = 0;
-      str_appendf(buf, "<a href=\"?start=%d&sort=%s\">" PREV "</a>",
-         prev, sortstr);
-   } else
-      str_append(buf, PREV);
-
-   if (full)
-      str_append(buf, " | " FULL);
-   else
-      str_appendf(buf, " | <a href=\"?full=yes&sort=%s\">" FULL "</a>",
-         sortstr);
-
-   if (start+MAX_ENTRIES < (int)hosts_db->count)
-      str_appendf(buf, " | <a href=\"?start=%d&sort=%s\">" NEXT "</a>",
-         start+MAX_ENTRIES, sortstr);
-   else
-      str_append(buf, " | " NEXT);
-
-   str_append(buf, "<br>\n");
-
-   html_close(buf);
+   format_hosts_foot(buf, start, full, sortstr, probes);
 done:
    if (qs_start != NULL) free(qs_start);
    if (qs_sort != NULL) free(qs_sort);
    return buf;
-#undef PREV
-#undef NEXT
-#undef FULL
 }
 
 /* ---------------------------------------------------------------------------
@@ -1120,6 +2205,460 @@ static struct str *html_hosts_detail(const char *ip) {
    return buf;
 }
 
+/* ---------------------------------------------------------------------------
+ * JSON API: the same hosts as the web pages, for programs instead of people.
+ * Counters are raw numbers, and last seen is a Unix time, or 0 for never.
+ */
+#define JF_IP        0x01
+#define JF_HOSTNAME  0x02
+#define JF_MAC       0x04
+#define JF_IN        0x08
+#define JF_OUT       0x10
+#define JF_TOTAL     0x20
+#define JF_LASTSEEN  0x40
+
+#define JSON_BUILT_MAX 1000 /* pages with more hosts than this are streamed */
+
+static const struct {
+   const char *name;
+   unsigned int flag;
+} json_fields[] = {
+   { "ip",        JF_IP },
+   { "hostname",  JF_HOSTNAME },
+   { "mac",       JF_MAC },
+   { "in",        JF_IN },
+   { "out",       JF_OUT },
+   { "total",     JF_TOTAL },
+   { "lastseen",  JF_LASTSEEN }
+};
+
+/* Everything the HTML shows. */
+static unsigned int
+json_default_fields(void)
+{
+   unsigned int fields = JF_IP | JF_HOSTNAME | JF_IN | JF_OUT | JF_TOTAL |
+      JF_LASTSEEN;
+
+   if (hosts_db_show_macs)
+      fields |= JF_MAC;
+   return (fields);
+}
+
+/* Parse "in,out,lastseen".  Returns 0 if a field isn't known. */
+static unsigned int
+json_parse_fields(const char *s)
+{
+   const size_t known = sizeof(json_fields) / sizeof(*json_fields);
+   unsigned int i, num, fields = 0;
+   int unknown = 0;
+   char **names = split(',', s, &num);
+
+   for (i=0; i<num; i++) {
+      size_t f;
+
+      for (f=0; f<known; f++)
+         if (strcmp(names[i], json_fields[f].name) == 0) {
+            fields |= json_fields[f].flag;
+            break;
+         }
+      if (f == known)
+         unknown = 1;
+      free(names[i]);
+   }
+   free(names);
+   return (unknown ? 0 : fields);
+}
+
+/* A host's fields, as members of the object we're in. */
+static void
+json_host_fields(struct json *j, const struct bucket *b,
+   const unsigned int fields)
+{
+   if (fields & JF_IP)
+      json_string(j, "ip", addr_to_str(&(b->u.host.addr)));
+   if (fields & JF_HOSTNAME) {
+      json_string(j, "hostname", b->u.host.dns);
+      /* Only resolve hosts "on demand" */
+      if (b->u.host.dns == NULL)
+         dns_queue(&(b->u.host.addr));
+   }
+   if (fields & JF_MAC) {
+      static const char hex[] = "0123456789abcdef";
+      char mac[18];
+      int i;
+
+      for (i=0; i<6; i++) {
+         mac[i*3] = hex[b->u.host.mac_addr[i] >> 4];
+         mac[i*3 + 1] = hex[b->u.host.mac_addr[i] & 15];
+         mac[i*3 + 2] = ':';
+      }
+      mac[17] = '\0';
+      json_string(j, "mac", mac);
+   }
+   if (fields & JF_IN)
+      json_uint(j, "in", b->in);
+   if (fields & JF_OUT)
+      json_uint(j, "out", b->out);
+   if (fields & JF_TOTAL)
+      json_uint(j, "total", b->total);
+   if (fields & JF_LASTSEEN)
+      json_uint(j, "lastseen", (b->u.host.last_seen_mono == 0) ? 0 :
+         (uint64_t)mono_to_real(b->u.host.last_seen_mono));
+}
+
+/* A cursor is the last host sent: its sort value, then its address in hex,
+ * so that it needs no escaping in a URL.
+ */
+static void
+json_cursor(struct json *j, const struct hosts_stream *s)
+{
+   char cursor[21 + 1 + 32 + 1];
+   const unsigned char *ip;
+   size_t i, len, n;
+
+   if ((s->view == NULL) || (s->next >= s->view->count) || !s->have_key) {
+      json_string(j, "next", NULL);
+      return;
+   }
+   if (s->key_addr.family == IPv4) {
+      ip = (const unsigned char *)&(s->key_addr.ip.v4);
+      len = sizeof(s->key_addr.ip.v4);
+   } else {
+      ip = (const unsigned char *)&(s->key_addr.ip.v6);
+      len = sizeof(s->key_addr.ip.v6);
+   }
+   n = (size_t)snprintf(cursor, sizeof(cursor), "%llu.", (llu)s->key);
+   for (i=0; i<len; i++)
+      n += (size_t)snprintf(cursor + n, sizeof(cursor) - n, "%02x", ip[i]);
+   json_string(j, "next", cursor);
+}
+
+static int
+hexval(const char c)
+{
+   if ((c >= '0') && (c <= '9')) return (c - '0');
+   if ((c >= 'a') && (c <= 'f')) return (c - 'a' + 10);
+   if ((c >= 'A') && (c <= 'F')) return (c - 'A' + 10);
+   return (-1);
+}
+
+static int
+cursor_parse(const char *str, uint64_t *key, struct addr *a)
+{
+   unsigned char *ip;
+   char *ep;
+   size_t i, len;
+
+   errno = 0;
+   *key = strtoull(str, &ep, 10);
+   if ((ep == str) || (*ep != '.') || (errno == ERANGE))
+      return (0);
+   ep++;
+   memset(a, 0, sizeof(*a));
+   if (strlen(ep) == 2 * sizeof(a->ip.v4)) {
+      a->family = IPv4;
+      ip = (unsigned char *)&(a->ip.v4);
+      len = sizeof(a->ip.v4);
+   } else if (strlen(ep) == 2 * sizeof(a->ip.v6)) {
+      a->family = IPv6;
+      ip = (unsigned char *)&(a->ip.v6);
+      len = sizeof(a->ip.v6);
+   } else
+      return (0);
+   for (i=0; i<len; i++) {
+      const int hi = hexval(ep[2*i]), lo = hexval(ep[2*i + 1]);
+
+      if ((hi < 0) || (lo < 0))
+         return (0);
+      ip[i] = (unsigned char)(hi << 4 | lo);
+   }
+   return (1);
+}
+
+/* The first row of v that comes after the host with this sort value and
+ * address, whether or not it's still there.
+ */
+static uint32_t
+sorted_view_after(const struct sorted_view *v, const uint64_t key,
+   const struct addr *a)
+{
+   uint32_t lo = 0, hi = v->count;
+
+   while (lo < hi) {
+      const uint32_t mid = lo + (hi - lo) / 2;
+
+      if ((v->keys[mid] > key) || ((v->keys[mid] == key) &&
+          (host_order_cmp(&(v->table[mid]->u.host.addr), a) <= 0)))
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return (lo);
+}
+
+/* Like the HTML stream, but a page can start at a cursor and stop at a
+ * limit.  The cursor is the last host of the page before, and the page
+ * starts after it in the current sorted view, wherever that puts it.  Hosts
+ * whose counters didn't move them past the cursor in between aren't skipped
+ * or sent twice, however many times the view has been made again.
+ */
+static int
+json_stream_more(struct hosts_stream *s, struct str *buf, const size_t want)
+{
+   const size_t stop = str_len(buf) + want;
+   struct json *j = &(s->j);
+
+   j->buf = buf;
+   switch (s->part) {
+   case STREAM_HEAD:
+      json_object(j, NULL);
+      json_string(j, "sort", s->sortstr);
+      if (hosts_db->count == 0) {
+         json_uint(j, "count", 0);
+         json_array(j, "hosts");
+         json_array_end(j);
+         s->part = STREAM_FOOT;
+         break;
+      }
+      s->view = sorted_view(hosts_db, s->sort, 0);
+      s->view->refs++;
+      json_uint(j, "count", s->view->count);
+      json_array(j, "hosts");
+      s->end = s->view->count;
+      if (s->have_key)
+         s->next = sorted_view_after(s->view, s->key, &(s->key_addr));
+      if ((s->limit > 0) && (s->end - s->next > s->limit))
+         s->end = s->next + s->limit;
+      s->part = STREAM_ROWS;
+      /* FALLTHROUGH */
+
+   case STREAM_ROWS:
+      if (s->view->generation != hosts_db->generation) {
+         s->cut_short = 1;
+         s->end = s->next;
+      }
+      while ((s->next < s->end) && (str_len(buf) < stop)) {
+         const struct bucket *b = s->view->table[s->next];
+
+         json_object(j, NULL);
+         json_host_fields(j, b, s->fields);
+         json_object_end(j);
+         s->have_key = 1;
+         s->key = s->view->keys[s->next];
+         s->key_addr = b->u.host.addr;
+         s->next++;
+      }
+      if (s->next == s->end) {
+         json_array_end(j);
+         s->part = STREAM_FOOT;
+      }
+      break;
+
+   case STREAM_FOOT:
+      if (s->cut_short)
+         /* Hosts went away while the table was being sent. */
+         json_bool(j, "incomplete", 1);
+      json_cursor(j, s);
+      json_object_end(j);
+      s->part = STREAM_DONE;
+      break;
+
+   case STREAM_DONE:
+      break;
+   }
+   return (s->part != STREAM_DONE);
+}
+
+static struct str *
+json_error(const char *error)
+{
+   struct str *buf = str_make();
+   struct json j;
+
+   json_init(&j, buf);
+   json_object(&j, NULL);
+   json_string(&j, "error", error);
+   json_object_end(&j);
+   return (buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * JSON API: /hosts.json?sort=in&limit=100&cursor=...&fields=ip,in,out
+ */
+static struct str *
+json_hosts_main(const char *qs, struct hosts_stream **stream)
+{
+   struct str *buf = NULL;
+   struct hosts_stream *s;
+   char *qs_sort, *qs_limit, *qs_cursor, *qs_fields, *ep;
+   const char *sortstr;
+   enum sort_dir sort;
+   unsigned long limit = 0;
+   uint64_t key = 0;
+   struct addr key_addr;
+   unsigned int fields;
+
+   qs_sort = qs_get(qs, "sort");
+   qs_limit = qs_get(qs, "limit");
+   qs_cursor = qs_get(qs, "cursor");
+   qs_fields = qs_get(qs, "fields");
+
+   if (qs_sort == NULL) sort = TOTAL;
+   else if (strcmp(qs_sort, "total") == 0) sort = TOTAL;
+   else if (strcmp(qs_sort, "in") == 0) sort = IN;
+   else if (strcmp(qs_sort, "out") == 0) sort = OUT;
+   else if (strcmp(qs_sort, "lastseen") == 0) sort = LASTSEEN;
+   else {
+      buf = json_error("invalid value for \"sort\"");
+      goto done;
+   }
+   sortstr = (qs_sort == NULL) ? "total" : qs_sort;
+
+   if (qs_limit != NULL) {
+      errno = 0;
+      limit = strtoul(qs_limit, &ep, 10);
+      if ((*ep != '\0') || (errno == ERANGE) || (limit == 0) ||
+          (limit > UINT32_MAX)) {
+         buf = json_error("\"limit\" is not a number of hosts");
+         goto done;
+      }
+   }
+
+   if ((qs_cursor != NULL) && !cursor_parse(qs_cursor, &key, &key_addr)) {
+      buf = json_error("invalid \"cursor\"");
+      goto done;
+   }
+
+   if (qs_fields == NULL)
+      fields = json_default_fields();
+   else if ((fields = json_parse_fields(qs_fields)) == 0) {
+      buf = json_error("unknown name in \"fields\"");
+      goto done;
+   }
+
+   s = hosts_stream_make(sort, sortstr);
+   s->json = 1;
+   s->fields = fields;
+   s->limit = (uint32_t)limit;
+   if (qs_cursor != NULL) {
+      s->have_key = 1;
+      s->key = key;
+      s->key_addr = key_addr;
+   }
+   json_init(&(s->j), NULL);
+
+   if ((limit == 0) || (limit > JSON_BUILT_MAX)) {
+      /* Could be millions of hosts: don't make them all now. */
+      *stream = s;
+      goto done;
+   }
+   buf = str_make();
+   while (hosts_stream_more(s, buf, 65536))
+      ;
+   hosts_stream_free(s);
+done:
+   free(qs_sort);
+   free(qs_limit);
+   free(qs_cursor);
+   free(qs_fields);
+   return (buf);
+}
+
+/* A table of ports or protocols, in no particular order. */
+typedef void (json_row_func_t)(struct json *, const struct bucket *);
+
+static void
+json_row_port_tcp(struct json *j, const struct bucket *b)
+{
+   json_uint(j, "port", b->u.port_tcp.port);
+   json_uint(j, "syn", b->u.port_tcp.syn);
+}
+
+static void
+json_row_port_udp(struct json *j, const struct bucket *b)
+{
+   json_uint(j, "port", b->u.port_udp.port);
+}
+
+static void
+json_row_ip_proto(struct json *j, const struct bucket *b)
+{
+   json_uint(j, "proto", b->u.ip_proto.proto);
+}
+
+static void
+json_table(struct json *j, const char *key, const struct hashtable *ht,
+   json_row_func_t *row_func)
+{
+   struct bucket *b;
+   uint32_t i;
+
+   json_array(j, key);
+   if (ht != NULL)
+      FOREACH_BUCKET(ht, i, b) {
+         json_object(j, NULL);
+         row_func(j, b);
+         json_uint(j, "in", b->in);
+         json_uint(j, "out", b->out);
+         json_uint(j, "total", b->total);
+         json_object_end(j);
+      }
+   json_array_end(j);
+}
+
+/* ---------------------------------------------------------------------------
+ * JSON API: /hosts/<IP of host>.json
+ */
+static struct str *
+json_hosts_detail(const char *ip)
+{
+   struct bucket *h;
+   struct str *buf;
+   struct json j;
+
+   h = host_search(ip);
+   if (h == NULL)
+      return (NULL); /* no such host */
+
+   buf = str_make();
+   json_init(&j, buf);
+   json_object(&j, NULL);
+   json_host_fields(&j, h, json_default_fields());
+   json_table(&j, "tcp", h->u.host.ports_tcp, json_row_port_tcp);
+   json_table(&j, "udp", h->u.host.ports_udp, json_row_port_udp);
+   json_table(&j, "protocols", h->u.host.ip_protos, json_row_ip_proto);
+   json_object_end(&j);
+   return (buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * JSON API: delegate /hosts.json and /hosts/<IP of host>.json
+ */
+struct str *
+json_hosts(const char *uri, const char *query, struct hosts_stream **stream)
+{
+   unsigned int i, num_elems;
+   char **elem;
+   struct str *buf = NULL;
+   size_t len;
+
+   *stream = NULL;
+   if (strcmp(uri, "/hosts.json") == 0)
+      return (json_hosts_main(query, stream));
+
+   elem = split('/', uri, &num_elems);
+   if ((num_elems == 2) && (strcmp(elem[0], "hosts") == 0) &&
+       ((len = strlen(elem[1])) > 5) &&
+       (strcmp(elem[1] + len - 5, ".json") == 0)) {
+      elem[1][len - 5] = '\0';
+      buf = json_hosts_detail(elem[1]);
+   }
+   for (i=0; i<num_elems; i++)
+      free(elem[i]);
+   free(elem);
+   return (buf); /* NULL becomes 404 Not Found */
+}
+
 /* ---------------------------------------------------------------------------
  * Database import and export code:
  * Initially written and contributed by Ben Stewart.
@@ -1330,6 +2869,14 @@ int hosts_db_import(const int fd)
    for (i=0; i<host_count; i++)
       if (!hosts_db_import_host(fd)) return 0;
 
+   /* Counters were set, not added to. */
+   hosts_db->generation++;
+   if (hosts_db->topk != NULL) {
+      int d;
+
+      for (d=0; d<SORT_DIRS; d++)
+         topk_invalidate(hosts_db->topk[d]);
+   }
    return 1;
 }
 
@@ -1344,8 +2891,7 @@ int hosts_db_export(const int fd)
 
    if (!write32(fd, hosts_db->count)) return 0;
 
-   for (i = 0; i<hosts_db->size; i++)
-   for (b = hosts_db->table[i]; b != NULL; b = b->next) {
+   FOREACH_BUCKET(hosts_db, i, b) {
       /* For each host: */
       if (!writen(fd, export_tag_host_ver3, sizeof(export_tag_host_ver3)))
          return 0;
@@ -1408,8 +2954,7 @@ hosts_db_export_ip(const struct hashtable *h, const int fd)
    assert(h->count < 256);
    if (!write8(fd, (uint8_t)h->count)) return 0;
 
-   for (i = 0; i<h->size; i++)
-   for (b = h->table[i]; b != NULL; b = b->next) {
+   FOREACH_BUCKET(h, i, b) {
       /* For each ip_proto bucket: */
 
       if (!write8(fd, b->u.ip_proto.proto)) return 0;
@@ -1442,8 +2987,7 @@ hosts_db_export_tcp(const struct hashtable *h, const int fd)
    assert(h->count < 65536);
    if (!write16(fd, (uint16_t)h->count)) return 0;
 
-   for (i = 0; i<h->size; i++)
-   for (b = h->table[i]; b != NULL; b = b->next) {
+   FOREACH_BUCKET(h, i, b) {
       if (!write16(fd, b->u.port_tcp.port)) return 0;
       if (!write64(fd, b->u.port_tcp.syn)) return 0;
       if (!write64(fd, b->in)) return 0;
@@ -1475,8 +3019,7 @@ hosts_db_export_udp(const struct hashtable *h, const int fd)
    assert(h->count < 65536);
    if (!write16(fd, (uint16_t)h->count)) return 0;
 
-   for (i = 0; i<h->size; i++)
-   for (b = h->table[i]; b != NULL; b = b->next) {
+   FOREACH_BUCKET(h, i, b) {
       if (!write16(fd, b->u.port_udp.port)) return 0;
       if (!write64(fd, b->in)) return 0;
       if (!write64(fd, b->out)) return 0;
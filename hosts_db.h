@@ -15,10 +15,14 @@
 
 struct hashtable;
 
+enum sort_dir { IN, OUT, TOTAL, LASTSEEN };
+#define SORT_DIRS 4
+
 struct host {
    struct addr addr;
    char *dns;
    uint8_t mac_addr[6];
+   uint16_t topk_pos[SORT_DIRS]; /* see topk.c */
    time_t last_seen_mono;
    struct hashtable *ports_tcp, *ports_udp, *ip_protos;
 };
@@ -37,7 +41,6 @@ struct ip_proto {
 };
 
 struct bucket {
-   struct bucket *next;
    uint64_t in, out, total;
    union {
       struct host host;
@@ -47,29 +50,66 @@ struct bucket {
    } u;
 };
 
-enum sort_dir { IN, OUT, TOTAL, LASTSEEN };
-
 extern int hosts_db_show_macs;
 
 void hosts_db_init(void);
 void hosts_db_reduce(void);
+uint64_t hosts_db_reductions(void);
+int hosts_db_full(void);
+void hosts_db_evict(void);
 void hosts_db_reset(void);
 void hosts_db_free(void);
 int hosts_db_import(const int fd);
 int hosts_db_export(const int fd);
 
+/* Per-thread shards, see hosts_db.c */
+struct hashtable *hosts_db_shard_make(void);
+void hosts_db_shard_use(struct hashtable *shard);
+void hosts_db_shard_free(struct hashtable *shard);
+void hosts_db_merge(struct hashtable *shard);
+
 struct bucket *host_find(const struct addr *const a); /* can return NULL */
 struct bucket *host_get(const struct addr *const a);
+uint32_t host_hash(const struct addr *const a);
+void host_prefetch_slot(const uint32_t hash);
+void host_prefetch_bucket(const uint32_t hash);
+struct bucket *host_get_hashed(const struct addr *const a, const uint32_t hash);
+void host_counted(struct bucket *host); /* after its counters go up */
+uint64_t hosts_db_generation(void); /* goes up whenever hosts are freed */
+uint64_t hosts_db_changes(void); /* goes up whenever the hosts pages change */
+void hosts_db_changed(void); /* after a host changes other than by counting */
 struct bucket *host_get_port_tcp(struct bucket *host, const uint16_t port);
 struct bucket *host_get_port_udp(struct bucket *host, const uint16_t port);
 struct bucket *host_get_ip_proto(struct bucket *host, const uint8_t proto);
 
 /* Web pages. */
-struct str *html_hosts(const char *uri, const char *query);
+struct hosts_stream;
+struct str *html_hosts(const char *uri, const char *query,
+   struct hosts_stream **stream);
+
+/* Pages too big to make at once come back as a stream instead: append
+ * about want bytes more of it to buf.  Returns 0 once it's all there.
+ */
+int hosts_stream_more(struct hosts_stream *s, struct str *buf,
+   const size_t want);
+void hosts_stream_free(struct hosts_stream *s);
+
+/* The same, as JSON: /hosts.json and /hosts/<ip>.json */
+struct str *json_hosts(const char *uri, const char *query,
+   struct hosts_stream **stream);
+
+/* Counters about the table itself, for /metrics. */
+void hosts_db_metrics(struct str *buf);
 
 /* From hosts_sort */
 void qsort_buckets(const struct bucket **a, size_t n,
    size_t left, size_t right, const enum sort_dir d);
+void radix_sort_buckets(const struct bucket **a, const size_t n,
+   const enum sort_dir dir);
+void radix_sort_hosts(const struct bucket **a, uint64_t *values,
+   const size_t n, const enum sort_dir dir);
+int host_order_cmp(const struct addr *a, const struct addr *b);
+uint64_t select_nth_value(uint64_t *v, const size_t n, const size_t k);
 
 #endif /* __DARKSTAT_HOSTS_DB_H */
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -1,15 +1,25 @@
 /* darkstat 3
  * copyright (c) 2001-2012 Emil Mikulic.
  *
- * hosts_sort.c: quicksort a table of buckets.
+ * hosts_sort.c: quicksort a table of buckets, radix sort a whole one, and
+ * quickselect a cutoff.
  *
  * You may use, modify and redistribute this file under the terms of the
  * GNU General Public License version 2. (see COPYING.GPL)
  */
 
 #include "cdefs.h"
+#include "conv.h"
 #include "err.h"
 #include "hosts_db.h"
+#include "opt.h"
+
+#include <arpa/inet.h> /* for ntohl */
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* ---------------------------------------------------------------------------
  * comparator for sorting (biggest first)
@@ -203,4 +213,337 @@ loop:
 /*		qsort(pn - r, r, cmp);*/
 }
 
+/* ---------------------------------------------------------------------------
+ * LSD radix sort, for when the whole table is wanted in order.  The sort keys
+ * are pulled out of the buckets once, instead of on every comparison, then
+ * sorted eight bits at a time.  Bytes that are the same in every key are
+ * skipped, so small counters take fewer passes.
+ *
+ * Hosts can also be put in a fixed order where their sort values are the
+ * same, see host_order_cmp().  That's a second key, sorted first, so that
+ * sorting by the value keeps it wherever the values are equal.
+ *
+ * Very big tables are split between up to --jobs threads: each one counts
+ * and moves its own slice, into places worked out from everyone's counts, so
+ * the result is the same as with one thread.
+ */
+#define RADIX_BITS 8
+#define RADIX_DIGITS (1 << RADIX_BITS)
+#define RADIX_MIN_PER_THREAD 262144 /* items, below this a thread won't pay */
+
+struct radix_item {
+   uint64_t key, tie;
+   const struct bucket *b;
+};
+
+enum radix_phase { EXTRACT, COUNT, SCATTER, STORE };
+
+struct radix_job {
+   enum radix_phase phase;
+   const struct bucket **a;
+   uint64_t *values;             /* if wanted, see radix_sort_hosts() */
+   struct radix_item *src, *dst;
+   size_t lo, hi;                /* this job's slice */
+   enum sort_dir dir;
+   int by_addr;
+   int on_tie;                   /* sorting on tie instead of key */
+   unsigned int shift;
+   uint64_t keys_and, keys_or, ties_and, ties_or;
+   size_t count[RADIX_DIGITS];   /* then where each digit goes */
+};
+
+static uint64_t
+sort_value(const struct bucket *b, const enum sort_dir dir)
+{
+   switch (dir) {
+   case IN:       return (b->in);
+   case OUT:      return (b->out);
+   case TOTAL:    return (b->total);
+   case LASTSEEN: return ((uint64_t)b->u.host.last_seen_mono);
+   default:
+      errx(1, "sort_value: unknown direction: %d", dir);
+   }
+}
+
+/* Most of an address, in as few bits as a radix sort can use.  IPv4 comes
+ * first, in numeric order.  IPv6 goes by its last 63 bits, which differ
+ * between hosts on the same network.
+ */
+static uint64_t
+addr_tie(const struct addr *a)
+{
+   uint64_t lo = 0;
+   int i;
+
+   if (a->family == IPv4)
+      return ((uint64_t)ntohl(a->ip.v4));
+   for (i=8; i<16; i++)
+      lo = (lo << 8) | a->ip.v6.s6_addr[i];
+   return (((uint64_t)1 << 63) | (lo >> 1));
+}
+
+/* The order of hosts with the same sort value: by addr_tie(), then if that's
+ * the same too, by addr_cmp().
+ */
+int
+host_order_cmp(const struct addr *a, const struct addr *b)
+{
+   const uint64_t x = addr_tie(a), y = addr_tie(b);
+
+   if (x != y)
+      return ((x < y) ? -1 : 1);
+   return (addr_cmp(a, b));
+}
+
+static int
+cmp_addr(const void *x, const void *y)
+{
+   const struct radix_item *a = x, *b = y;
+
+   return (addr_cmp(&(a->b->u.host.addr), &(b->b->u.host.addr)));
+}
+
+static void *
+radix_job_run(void *arg)
+{
+   struct radix_job *j = arg;
+   size_t i;
+
+#define DIGIT(item) \
+   (((j->on_tie ? (item).tie : (item).key) >> j->shift) & (RADIX_DIGITS - 1))
+   switch (j->phase) {
+   case EXTRACT:
+      j->keys_and = j->ties_and = ~(uint64_t)0;
+      j->keys_or = j->ties_or = 0;
+      for (i=j->lo; i<j->hi; i++) {
+         /* Biggest first is smallest first, flipped. */
+         uint64_t key = ~sort_value(j->a[i], j->dir);
+         uint64_t tie = j->by_addr ? addr_tie(&(j->a[i]->u.host.addr)) : 0;
+
+         j->src[i].key = key;
+         j->src[i].tie = tie;
+         j->src[i].b = j->a[i];
+         j->keys_and &= key;
+         j->keys_or |= key;
+         j->ties_and &= tie;
+         j->ties_or |= tie;
+      }
+      break;
+   case COUNT:
+      memset(j->count, 0, sizeof(j->count));
+      for (i=j->lo; i<j->hi; i++)
+         j->count[DIGIT(j->src[i])]++;
+      break;
+   case SCATTER:
+      for (i=j->lo; i<j->hi; i++)
+         j->dst[j->count[DIGIT(j->src[i])]++] = j->src[i];
+      break;
+   case STORE:
+      for (i=j->lo; i<j->hi; i++) {
+         j->a[i] = j->src[i].b;
+         if (j->values != NULL)
+            j->values[i] = ~j->src[i].key;
+      }
+      break;
+   }
+#undef DIGIT
+   return (NULL);
+}
+
+static void
+radix_jobs_run(struct radix_job *jobs, const unsigned int num_jobs,
+   const enum radix_phase phase, struct radix_item *src,
+   struct radix_item *dst)
+{
+   pthread_t *threads;
+   sigset_t all, old;
+   unsigned int i;
+
+   for (i=0; i<num_jobs; i++) {
+      jobs[i].phase = phase;
+      jobs[i].src = src;
+      jobs[i].dst = dst;
+   }
+   if (num_jobs == 1) {
+      radix_job_run(&jobs[0]);
+      return;
+   }
+
+   /* Signals are for the main thread. */
+   sigfillset(&all);
+   if (pthread_sigmask(SIG_BLOCK, &all, &old) != 0)
+      errx(1, "pthread_sigmask() failed");
+   threads = xcalloc(num_jobs, sizeof(*threads));
+   for (i=1; i<num_jobs; i++)
+      if (pthread_create(&threads[i], NULL, radix_job_run, &jobs[i]) != 0)
+         errx(1, "pthread_create() failed");
+   if (pthread_sigmask(SIG_SETMASK, &old, NULL) != 0)
+      errx(1, "pthread_sigmask() failed");
+
+   radix_job_run(&jobs[0]);
+   for (i=1; i<num_jobs; i++)
+      if (pthread_join(threads[i], NULL) != 0)
+         errx(1, "pthread_join() failed");
+   free(threads);
+}
+
+static void
+radix_sort(const struct bucket **a, uint64_t *values, const size_t n,
+   const enum sort_dir dir, const int by_addr)
+{
+   struct radix_item *src, *dst, *tmp;
+   struct radix_job *jobs;
+   unsigned int i, num_jobs, shift;
+   uint64_t keys_and = ~(uint64_t)0, keys_or = 0;
+   uint64_t ties_and = ~(uint64_t)0, ties_or = 0;
+   int on_tie;
+   size_t lo, hi;
+
+   if (n < 1)
+      return;
+   num_jobs = (unsigned int)MIN((size_t)opt_jobs, n / RADIX_MIN_PER_THREAD);
+   if (num_jobs == 0)
+      num_jobs = 1;
+   jobs = xcalloc(num_jobs, sizeof(*jobs));
+   for (i=0; i<num_jobs; i++) {
+      jobs[i].a = a;
+      jobs[i].values = values;
+      jobs[i].lo = n * i / num_jobs;
+      jobs[i].hi = n * (i + 1) / num_jobs;
+      jobs[i].dir = dir;
+      jobs[i].by_addr = by_addr;
+   }
+   src = xmalloc(n * sizeof(*src));
+   dst = xmalloc(n * sizeof(*dst));
+
+   radix_jobs_run(jobs, num_jobs, EXTRACT, src, dst);
+   for (i=0; i<num_jobs; i++) {
+      keys_and &= jobs[i].keys_and;
+      keys_or |= jobs[i].keys_or;
+      ties_and &= jobs[i].ties_and;
+      ties_or |= jobs[i].ties_or;
+   }
+
+   for (on_tie=1; on_tie>=0; on_tie--)
+   for (shift=0; shift<64; shift+=RADIX_BITS) {
+      const uint64_t differ = on_tie ?
+         (ties_and ^ ties_or) : (keys_and ^ keys_or);
+      size_t sum = 0;
+      unsigned int d;
+
+      if (((differ >> shift) & (RADIX_DIGITS - 1)) == 0)
+         continue; /* every key has the same digit here */
+      for (i=0; i<num_jobs; i++) {
+         jobs[i].on_tie = on_tie;
+         jobs[i].shift = shift;
+      }
+      radix_jobs_run(jobs, num_jobs, COUNT, src, dst);
+
+      /* Each job's items with a given digit go after every job's items with
+       * smaller digits, and after earlier jobs' items with the same digit.
+       */
+      for (d=0; d<RADIX_DIGITS; d++)
+         for (i=0; i<num_jobs; i++) {
+            size_t c = jobs[i].count[d];
+
+            jobs[i].count[d] = sum;
+            sum += c;
+         }
+      assert(sum == n);
+      radix_jobs_run(jobs, num_jobs, SCATTER, src, dst);
+      tmp = src;
+      src = dst;
+      dst = tmp;
+   }
+
+   /* Only IPv6 hosts can have the same tie, and only a few. */
+   if (by_addr)
+      for (lo=0; lo<n; lo=hi) {
+         for (hi=lo+1; (hi < n) && (src[hi].key == src[lo].key) &&
+              (src[hi].tie == src[lo].tie); hi++)
+            ;
+         if (hi - lo > 1)
+            qsort(src + lo, hi - lo, sizeof(*src), cmp_addr);
+      }
+
+   radix_jobs_run(jobs, num_jobs, STORE, src, dst);
+   free(src);
+   free(dst);
+   free(jobs);
+}
+
+/* Sort the whole of a, biggest first. */
+void
+radix_sort_buckets(const struct bucket **a, const size_t n,
+   const enum sort_dir dir)
+{
+   if (n >= 2)
+      radix_sort(a, NULL, n, dir, 0);
+}
+
+/* Sort a whole table of hosts, biggest first, then in host_order_cmp()
+ * order.  values[i] gets a[i]'s sort value.
+ */
+void
+radix_sort_hosts(const struct bucket **a, uint64_t *values, const size_t n,
+   const enum sort_dir dir)
+{
+   radix_sort(a, values, n, dir, 1);
+}
+
+/* ---------------------------------------------------------------------------
+ * Quickselect: reorder v so that v[k] is the value that would be there if v
+ * were sorted biggest first, and return it.  Expected linear time.
+ */
+static uint64_t
+med3_value(const uint64_t a, const uint64_t b, const uint64_t c)
+{
+   if (a < b)
+      return (b < c) ? b : ((a < c) ? c : a);
+   else
+      return (b > c) ? b : ((a < c) ? a : c);
+}
+
+#define SWAP_VALUES(x, y) { uint64_t t = (x); (x) = (y); (y) = t; }
+
+uint64_t
+select_nth_value(uint64_t *v, const size_t n, const size_t k)
+{
+   size_t lo = 0, hi = n - 1;
+
+   assert(k < n);
+   while (lo < hi) {
+      size_t i, j, mid = lo + (hi - lo) / 2;
+      uint64_t pivot = med3_value(v[lo], v[mid], v[hi]);
+
+      /* Put the pivot first, so the scans below can't run off the ends. */
+      if (v[mid] == pivot)
+         SWAP_VALUES(v[lo], v[mid])
+      else if (v[hi] == pivot)
+         SWAP_VALUES(v[lo], v[hi])
+
+      /* Bigger to the left, smaller to the right.  Stopping on equal
+       * values keeps the halves even when lots of them are the same.
+       */
+      i = lo;
+      j = hi + 1;
+      for (;;) {
+         do i++; while ((i <= hi) && (v[i] > pivot));
+         do j--; while (v[j] < pivot);
+         if (i >= j)
+            break;
+         SWAP_VALUES(v[i], v[j])
+      }
+      SWAP_VALUES(v[lo], v[j])
+
+      if (k == j)
+         return (v[k]);
+      if (k < j)
+         hi = j - 1;
+      else
+         lo = j + 1;
+   }
+   return (v[k]);
+}
+
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -8,14 +8,19 @@
  * GNU General Public License version 2. (see COPYING.GPL)
  */
 
+#include "acct.h"
+#include "cap.h"
 #include "cdefs.h"
 #include "config.h"
 #include "conv.h"
 #include "err.h"
+#include "event.h"
 #include "graph_db.h"
 #include "hosts_db.h"
 #include "http.h"
+#include "metrics.h"
 #include "now.h"
+#include "pool.h"
 #include "queue.h"
 #include "str.h"
 
@@ -23,6 +28,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <assert.h>
 #include <ctype.h>
@@ -44,18 +50,38 @@ static const char mime_type_xml[] = "text/xml";
 static const char mime_type_html[] = "text/html; charset=us-ascii";
 static const char mime_type_css[] = "text/css";
 static const char mime_type_js[] = "text/javascript";
+static const char mime_type_json[] = "application/json";
+static const char mime_type_metrics[] = "text/plain; version=0.0.4";
+static const char mime_type_events[] = "text/event-stream";
 static const char encoding_identity[] = "identity";
 static const char encoding_gzip[] = "gzip";
 
 static const char server[] = PACKAGE_NAME "/" PACKAGE_VERSION;
 static int idletime = 60;
+#define IDLE_CHECK_MSEC 1000
 #define MAX_REQUEST_LENGTH 4000
+#define MAX_REQUESTS 100 /* per connection, then it's closed */
+#define STREAM_BUF 32768 /* bytes of a streamed reply body made at a time */
+#define CHUNK_HEAD 10    /* room for a chunk's "%zx\r\n" size line */
+#define CHUNK_TAIL 7     /* and its "\r\n", plus the last "0\r\n\r\n" */
+
+/* gzip effort, see gzip_level(). */
+#define GZIP_MIN 256              /* smaller replies go out as they are */
+#define GZIP_MEDIUM (64 * 1024)
+#define GZIP_BIG (1024 * 1024)
+#define GZIP_STREAM_MIN (256 * 1024) /* compressed a piece at a time */
+#define BUSY_PPS 50000            /* capture is busy above this rate */
+
+#define CACHE_MAX 32 /* replies, see cache_find() */
 
 static int *insocks = NULL;
 static unsigned int insock_num = 0;
+static struct event_timer *idle_timer = NULL;
+static struct pool *conn_pool = NULL; /* where connections come from */
+static unsigned int event_conns = 0; /* on graphs.events */
 
 struct connection {
-    LIST_ENTRY(connection) entries;
+    TAILQ_ENTRY(connection) entries;
 
     int socket;
     struct sockaddr_storage client;
@@ -65,6 +91,7 @@ struct connection {
         SEND_HEADER_AND_REPLY, /* try to send header+reply together */
         SEND_HEADER,           /* sending generated header */
         SEND_REPLY,            /* sending reply */
+        WAIT_EVENT,            /* graphs.events: waiting for the next push */
         DONE                   /* conn closed, need to remove from queue */
         } state;
 
@@ -78,6 +105,9 @@ struct connection {
 
     char *header;
     const char *mime_type, *encoding, *header_extra;
+    const char *etag; /* can be NULL */
+    char dynamic_etag[64]; /* etag points here for pages we make */
+    time_t last_modified; /* 0 if there isn't one */
     size_t header_length, header_sent;
     int header_dont_free, header_only, http_code;
 
@@ -85,11 +115,37 @@ struct connection {
     int reply_dont_free;
     size_t reply_length, reply_sent;
 
+    /* A reply that's made as it's sent, see stream_fill().  The stream is
+     * NULL once it's made all of its HTML.
+     */
+    struct hosts_stream *stream;
+    char *stream_buf, *html;
+    size_t html_length, html_sent;
+    z_stream zs;
+    int zs_active, chunked, stream_end;
+
     unsigned int total_sent; /* header + body = total, for logging */
+
+    /* Keep-alive: whatever came in after this request, and how many more
+     * requests we'll take before closing.
+     */
+    char *pipelined;
+    size_t pipelined_length;
+    unsigned int requests_left;
+    int keep_alive;
+
+    /* graphs.events: the reply never ends.  Between events, the connection
+     * waits for http_push_graphs() to give it the next one.
+     */
+    int events, events_missed;
+    uint64_t events_pushed; /* graph generation it was last given */
 };
 
-static LIST_HEAD(conn_list_head, connection) connlist =
-    LIST_HEAD_INITIALIZER(conn_list_head);
+/* Least recently active first, so idle connections can be expired from the
+ * head without looking at the rest.
+ */
+static TAILQ_HEAD(conn_list_head, connection) connlist =
+    TAILQ_HEAD_INITIALIZER(connlist);
 
 struct bindaddr_entry {
     STAILQ_ENTRY(bindaddr_entry) entries;
@@ -262,15 +318,10 @@ static char *make_safe_uri(char *uri)
 }
 
 /* ---------------------------------------------------------------------------
- * Allocate and initialize an empty connection.
+ * Initialize everything that's made for one request and its reply.
  */
-static struct connection *new_connection(void)
+static void reset_request(struct connection *conn)
 {
-    struct connection *conn = xmalloc(sizeof(*conn));
-
-    conn->socket = -1;
-    memset(&conn->client, 0, sizeof(conn->client));
-    conn->last_active_mono = now_mono();
     conn->request = NULL;
     conn->request_length = 0;
     conn->accept_gzip = 0;
@@ -281,6 +332,9 @@ static struct connection *new_connection(void)
     conn->mime_type = NULL;
     conn->encoding = NULL;
     conn->header_extra = "";
+    conn->etag = NULL;
+    conn->dynamic_etag[0] = '\0';
+    conn->last_modified = 0;
     conn->header_length = 0;
     conn->header_sent = 0;
     conn->header_dont_free = 0;
@@ -290,7 +344,41 @@ static struct connection *new_connection(void)
     conn->reply_dont_free = 0;
     conn->reply_length = 0;
     conn->reply_sent = 0;
+    conn->stream = NULL;
+    conn->stream_buf = NULL;
+    conn->html = NULL;
+    conn->html_length = 0;
+    conn->html_sent = 0;
+    conn->zs_active = 0;
+    conn->chunked = 0;
+    conn->stream_end = 0;
     conn->total_sent = 0;
+    conn->keep_alive = 0;
+    conn->events = 0;
+    conn->events_missed = 0;
+    conn->events_pushed = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Allocate and initialize an empty connection.  They come from a pool, so a
+ * steady stream of clients reuses the same few instead of going through
+ * malloc() every time.
+ */
+static struct connection *new_connection(void)
+{
+    struct connection *conn;
+
+    if (conn_pool == NULL)
+        conn_pool = pool_make("connections", sizeof(*conn));
+    conn = pool_get(conn_pool);
+
+    conn->socket = -1;
+    memset(&conn->client, 0, sizeof(conn->client));
+    conn->last_active_mono = now_mono();
+    reset_request(conn);
+    conn->pipelined = NULL;
+    conn->pipelined_length = 0;
+    conn->requests_left = MAX_REQUESTS;
 
     /* Make it harmless so it gets garbage-collected if it should, for some
      * reason, fail to be correctly filled out.
@@ -302,11 +390,14 @@ static struct connection *new_connection(void)
 
 
 
+static void conn_event(void *arg, const int events);
+
 /* ---------------------------------------------------------------------------
  * Accept a connection from sockin and add it to the connection queue.
  */
-static void accept_connection(const int sockin)
+static void accept_connection(void *arg, const int events _unused_)
 {
+    const int sockin = *(const int *)arg;
     struct sockaddr_storage addrin;
     socklen_t sin_size;
     struct connection *conn;
@@ -317,6 +408,8 @@ static void accept_connection(const int sockin)
     sock = accept(sockin, (struct sockaddr *)&addrin, &sin_size);
     if (sock == -1)
     {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return; /* the client went away before we got to it */
         if (errno == ECONNABORTED || errno == EINTR)
         {
             verbosef("accept() failed: %s", strerror(errno));
@@ -327,12 +420,24 @@ static void accept_connection(const int sockin)
 
     fd_set_nonblock(sock);
 
+    /* Replies are always written whole, and with keep-alive the client
+     * would otherwise sit on the ACK for the last bit of one while we wait
+     * for it before sending the next.
+     */
+    {
+        int one = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                       &one, sizeof(one)) == -1)
+            verbosef("can't set TCP_NODELAY: %s", strerror(errno));
+    }
+
     /* allocate and initialise struct connection */
     conn = new_connection();
     conn->socket = sock;
     conn->state = RECV_REQUEST;
     memcpy(&conn->client, &addrin, sizeof(conn->client));
-    LIST_INSERT_HEAD(&connlist, conn, entries);
+    TAILQ_INSERT_TAIL(&connlist, conn, entries);
+    event_add(sock, EVENT_READ | EVENT_WRITE, 1, conn_event, conn);
 
     getnameinfo((struct sockaddr *) &addrin, sin_size,
             ipaddr, sizeof(ipaddr), portstr, sizeof(portstr),
@@ -343,13 +448,10 @@ static void accept_connection(const int sockin)
 
 
 /* ---------------------------------------------------------------------------
- * Log a connection, then cleanly deallocate its internals.
+ * Free everything that was made for the last request and its reply.
  */
-static void free_connection(struct connection *conn)
+static void free_request(struct connection *conn)
 {
-    dverbosef("free_connection(%d)", conn->socket);
-    if (conn->socket != -1)
-        close(conn->socket);
     free(conn->request);
     free(conn->method);
     free(conn->uri);
@@ -358,6 +460,29 @@ static void free_connection(struct connection *conn)
         free(conn->header);
     if (!conn->reply_dont_free)
         free(conn->reply);
+    if (conn->stream != NULL)
+        hosts_stream_free(conn->stream);
+    free(conn->stream_buf);
+    free(conn->html);
+    if (conn->zs_active)
+        deflateEnd(&conn->zs);
+}
+
+/* ---------------------------------------------------------------------------
+ * Log a connection, then cleanly deallocate it.
+ */
+static void free_connection(struct connection *conn)
+{
+    dverbosef("free_connection(%d)", conn->socket);
+    if (conn->socket != -1) {
+        event_del(conn->socket);
+        close(conn->socket);
+    }
+    free_request(conn);
+    free(conn->pipelined);
+    if (conn->events)
+        event_conns--;
+    pool_put(conn_pool, conn);
 }
 
 
@@ -374,38 +499,73 @@ static char *rfc1123_date(char *dest, time_t when) {
     return dest;
 }
 
+/* The ETag and Last-Modified lines of a header, if the reply has them. */
+static void format_validators(const struct connection *conn,
+    char *dest, const size_t len)
+{
+    char date[DATE_LEN];
+    int n = 0;
+
+    dest[0] = '\0';
+    if (conn->etag != NULL)
+        n = snprintf(dest, len, "ETag: %s\r\n", conn->etag);
+    if (conn->last_modified != 0 && n >= 0 && (size_t)n < len)
+        snprintf(dest + n, len - n, "Last-Modified: %s\r\n",
+            rfc1123_date(date, conn->last_modified));
+}
+
 static void generate_header(struct connection *conn,
     const int code, const char *text)
 {
-    char date[DATE_LEN];
+    char date[DATE_LEN], length[64], validators[160];
 
     assert(conn->header == NULL);
     assert(conn->mime_type != NULL);
     if (conn->encoding == NULL)
         conn->encoding = encoding_identity;
 
-    verbosef("http: %d %s (%s: %zu bytes)",
-             code,
-             text,
-             conn->encoding,
-             conn->reply_length);
+    if (conn->events) {
+        verbosef("http: %d %s (events)", code, text);
+        length[0] = '\0';
+        conn->keep_alive = 0; /* the reply never ends */
+    } else if (conn->stream_buf != NULL) {
+        verbosef("http: %d %s (%s: streamed)", code, text, conn->encoding);
+        /* Without chunks, closing the connection ends the reply. */
+        snprintf(length, sizeof(length), "%s",
+            conn->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+        if (!conn->chunked)
+            conn->keep_alive = 0;
+    } else {
+        verbosef("http: %d %s (%s: %zu bytes)",
+                 code,
+                 text,
+                 conn->encoding,
+                 conn->reply_length);
+        snprintf(length, sizeof(length), "Content-Length: %llu\r\n",
+            (llu)conn->reply_length);
+    }
+    format_validators(conn, validators, sizeof(validators));
     conn->header_length = xasprintf(&(conn->header),
         "HTTP/1.1 %d %s\r\n"
         "Date: %s\r\n"
         "Server: %s\r\n"
         "Vary: Accept-Encoding\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %qu\r\n"
+        "%s"
         "Content-Encoding: %s\r\n"
+        "%s"
         "X-Robots-Tag: noindex, noarchive\r\n"
+        "Connection: %s\r\n"
         "%s"
         "\r\n",
         code, text,
         rfc1123_date(date, now_real()),
         server,
         conn->mime_type,
-        (qu)conn->reply_length,
+        length,
         conn->encoding,
+        validators,
+        conn->keep_alive ? "keep-alive" : "close",
         conn->header_extra);
     conn->http_code = code;
 }
@@ -441,6 +601,8 @@ static void default_reply(struct connection *conn,
     /* forget any dangling metadata */
     conn->mime_type = mime_type_html;
     conn->encoding = encoding_identity;
+    conn->etag = NULL;
+    conn->last_modified = 0;
 
     generate_header(conn, errcode, errname);
 }
@@ -480,14 +642,16 @@ static char *parse_field(const struct connection *conn, const char *field)
 
 /* ---------------------------------------------------------------------------
  * Parse an HTTP request like "GET /hosts/?sort=in HTTP/1.1" to get the method
- * (GET), the uri (/hosts/), the query (sort=in) and whether the UA will
- * accept gzip encoding.  Remember to deallocate all these buffers.  Query
- * can be NULL.  The method will be returned in uppercase.
+ * (GET), the uri (/hosts/), the query (sort=in), whether the UA will accept
+ * gzip encoding, whether it knows about chunked replies (HTTP/1.1), and
+ * whether it wants the connection kept open.  Remember to deallocate all
+ * these buffers.  Query can be NULL.  The method will be returned in
+ * uppercase.
  */
 static int parse_request(struct connection *conn)
 {
     size_t bound1, bound2, mid;
-    char *accept_enc;
+    char *accept_enc, *connection;
 
     /* parse method */
     for (bound1 = 0; bound1 < conn->request_length &&
@@ -521,6 +685,15 @@ static int parse_request(struct connection *conn)
 
     conn->uri = split_string(conn->request, bound1, bound2);
 
+    /* parse version */
+    for (; bound2 < conn->request_length &&
+        conn->request[bound2] != ' ' &&
+        conn->request[bound2] != '\r'; bound2++)
+            ;
+    if (bound2 + 9 <= conn->request_length &&
+        memcmp(conn->request + bound2, " HTTP/1.1", 9) == 0)
+        conn->chunked = 1;
+
     /* parse important fields */
     accept_enc = parse_field(conn, "Accept-Encoding: ");
     if (accept_enc != NULL) {
@@ -528,42 +701,136 @@ static int parse_request(struct connection *conn)
             conn->accept_gzip = 1;
         free(accept_enc);
     }
+
+    /* HTTP/1.1 keeps the connection open unless told not to, 1.0 only if
+     * asked to.  Either way, not past the last request we'll take.
+     */
+    conn->keep_alive = conn->chunked;
+    connection = parse_field(conn, "Connection: ");
+    if (connection != NULL) {
+        strntoupper(connection, strlen(connection));
+        if (strstr(connection, "CLOSE") != NULL)
+            conn->keep_alive = 0;
+        else if (strstr(connection, "KEEP-ALIVE") != NULL)
+            conn->keep_alive = 1;
+        free(connection);
+    }
+    if (conn->requests_left == 0)
+        conn->keep_alive = 0;
     return (1);
 }
 
 /* FIXME: maybe we need a smarter way of doing static pages: */
 
 /* ---------------------------------------------------------------------------
- * Web interface: static stylesheet.
+ * Web interface: static stylesheet.  It was gzipped when darkstat was built,
+ * so there's nothing left to do but send it.
  */
 static void
 static_style_css(struct connection *conn)
 {
 #include "stylecss.h"
+#include "stylecssgz.h"
 
-    conn->reply = style_css;
-    conn->reply_length = style_css_len;
+    if (conn->accept_gzip) {
+        conn->reply = style_css_gz;
+        conn->reply_length = style_css_gz_len;
+        conn->etag = style_css_gz_etag;
+        conn->encoding = encoding_gzip;
+    } else {
+        conn->reply = style_css;
+        conn->reply_length = style_css_len;
+        conn->etag = style_css_etag;
+    }
     conn->reply_dont_free = 1;
     conn->mime_type = mime_type_css;
 }
 
 /* ---------------------------------------------------------------------------
- * Web interface: static JavaScript.
+ * Web interface: static JavaScript, likewise.
  */
 static void
 static_graph_js(struct connection *conn)
 {
 #include "graphjs.h"
+#include "graphjsgz.h"
 
-    conn->reply = graph_js;
-    conn->reply_length = graph_js_len;
+    if (conn->accept_gzip) {
+        conn->reply = graph_js_gz;
+        conn->reply_length = graph_js_gz_len;
+        conn->etag = graph_js_gz_etag;
+        conn->encoding = encoding_gzip;
+    } else {
+        conn->reply = graph_js;
+        conn->reply_length = graph_js_len;
+        conn->etag = graph_js_etag;
+    }
     conn->reply_dont_free = 1;
     conn->mime_type = mime_type_js;
 }
 
 /* ---------------------------------------------------------------------------
- * gzip a reply, if requested and possible.  Don't bother with a minimum
- * length requirement, I've never seen a page fail to compress.
+ * Is capture busy?  Compression runs on the main loop, same as accounting,
+ * so it should back off when packets are piling up in the ring, or have been
+ * coming in fast since we last looked.
+ */
+static int
+capture_busy(void)
+{
+    static struct timespec since;
+    static uint64_t since_packets = 0;
+    static int busy = 0;
+    int64_t nsec;
+
+    if (cap_ring_size > 0 && cap_ring_used >= cap_ring_size / 4)
+        return (1);
+    nsec = timer_nsec(&since);
+    if (nsec >= 1000000000) {
+        busy = ((acct_total_packets - since_packets) * 1000000000 / nsec
+                >= BUSY_PPS);
+        since_packets = acct_total_packets;
+        timer_start(&since);
+    }
+    return (busy);
+}
+
+/* ---------------------------------------------------------------------------
+ * How hard to compress a reply of len bytes.  Small pages are cheap to
+ * squeeze hard, big ones get the fast levels, and everything gets the
+ * fastest while capture is busy.
+ */
+static int
+gzip_level(const size_t len)
+{
+    if (capture_busy() || len >= GZIP_BIG)
+        return (Z_BEST_SPEED);
+    if (len >= GZIP_MEDIUM)
+        return (Z_DEFAULT_COMPRESSION);
+    return (Z_BEST_COMPRESSION);
+}
+
+/* ---------------------------------------------------------------------------
+ * Start a gzip stream.  Returns 0 on failure.
+ */
+static int
+gzip_init(z_stream *zs, const int level)
+{
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+
+    return (deflateInit2(zs,
+                         level,
+                         Z_DEFLATED,
+                         15+16, /* 15 = biggest window,
+                                   16 = add gzip header+trailer */
+                         8 /* default */,
+                         Z_DEFAULT_STRATEGY) == Z_OK);
+}
+
+/* ---------------------------------------------------------------------------
+ * gzip a reply, if requested and worth it.  The output has to come out
+ * smaller than the input, or the reply goes out as it is.
  */
 static void
 process_gzip(struct connection *conn)
@@ -572,23 +839,15 @@ process_gzip(struct connection *conn)
     size_t len;
     z_stream zs;
 
-    if (!conn->accept_gzip)
+    if (!conn->accept_gzip || conn->reply_length < GZIP_MIN)
         return;
+    if (conn->encoding != NULL)
+        return; /* already done */
 
     buf = xmalloc(conn->reply_length);
     len = conn->reply_length;
 
-    zs.zalloc = Z_NULL;
-    zs.zfree = Z_NULL;
-    zs.opaque = Z_NULL;
-
-    if (deflateInit2(&zs,
-                     Z_BEST_COMPRESSION,
-                     Z_DEFLATED,
-                     15+16, /* 15 = biggest window,
-                               16 = add gzip header+trailer */
-                     8 /* default */,
-                     Z_DEFAULT_STRATEGY) != Z_OK) {
+    if (!gzip_init(&zs, gzip_level(len))) {
         free(buf);
         return;
     }
@@ -602,7 +861,8 @@ process_gzip(struct connection *conn)
     if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
         deflateEnd(&zs);
         free(buf);
-        verbosef("failed to compress %zu bytes", len);
+        verbosef("gzip didn't shrink %zu bytes, sending them as they are",
+            len);
         return;
     }
 
@@ -616,12 +876,357 @@ process_gzip(struct connection *conn)
     deflateEnd(&zs);
 }
 
+/* ---------------------------------------------------------------------------
+ * Make the next piece of a streamed reply, and point conn->reply at it.  The
+ * HTML is made, and gzipped if it can be, STREAM_BUF bytes at a time, so
+ * only about that much of the page is held at once however big it gets, and
+ * no one piece keeps the main loop from accounting for long.  HTTP/1.1
+ * clients get it in chunks, others until the connection closes.
+ *
+ * The HTML comes from conn->stream, or is all in conn->html already when
+ * there's no stream: then it's only being compressed a piece at a time.
+ */
+static void
+stream_fill(struct connection *conn)
+{
+    char *body = conn->stream_buf + CHUNK_HEAD;
+    size_t len = 0;
+
+    while (len < STREAM_BUF && !conn->stream_end) {
+        if (conn->html_sent == conn->html_length && conn->stream != NULL) {
+            struct str *buf = str_make();
+            int more = hosts_stream_more(conn->stream, buf, STREAM_BUF);
+
+            free(conn->html);
+            str_extract(buf, &(conn->html_length), &(conn->html));
+            conn->html_sent = 0;
+            if (!more) {
+                hosts_stream_free(conn->stream);
+                conn->stream = NULL;
+            }
+        }
+
+        if (conn->zs_active) {
+            int ret;
+
+            conn->zs.next_in = (unsigned char *)conn->html + conn->html_sent;
+            conn->zs.avail_in = conn->html_length - conn->html_sent;
+            conn->zs.next_out = (unsigned char *)body + len;
+            conn->zs.avail_out = STREAM_BUF - len;
+            ret = deflate(&conn->zs,
+                (conn->stream == NULL) ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR)
+                errx(1, "deflate() failed");
+            conn->html_sent = conn->html_length - conn->zs.avail_in;
+            len = STREAM_BUF - conn->zs.avail_out;
+            if (ret == Z_STREAM_END)
+                conn->stream_end = 1;
+        } else {
+            size_t n = MIN(conn->html_length - conn->html_sent,
+                           STREAM_BUF - len);
+
+            memcpy(body + len, conn->html + conn->html_sent, n);
+            conn->html_sent += n;
+            len += n;
+            if (conn->stream == NULL && conn->html_sent == conn->html_length)
+                conn->stream_end = 1;
+        }
+    }
+
+    conn->reply = body;
+    if (conn->chunked) {
+        if (len > 0) {
+            char head[CHUNK_HEAD + 1];
+            int n = snprintf(head, sizeof(head), "%zx\r\n", len);
+
+            conn->reply -= n;
+            memcpy(conn->reply, head, (size_t)n);
+            memcpy(body + len, "\r\n", 2);
+            len += 2 + n;
+        }
+        if (conn->stream_end) {
+            memcpy(conn->reply + len, "0\r\n\r\n", 5);
+            len += 5;
+        }
+    }
+    conn->reply_length = len;
+    conn->reply_sent = 0;
+}
+
+/* Set up a streamed reply, and make its first piece.  Streams are assumed
+ * to be big.
+ */
+static void
+stream_start(struct connection *conn, struct hosts_stream *stream)
+{
+    conn->stream = stream;
+    conn->stream_buf = xmalloc(CHUNK_HEAD + STREAM_BUF + CHUNK_TAIL);
+    conn->reply_dont_free = 1;
+    if (conn->accept_gzip &&
+        gzip_init(&conn->zs, gzip_level((stream != NULL) ?
+                                        GZIP_BIG : conn->html_length))) {
+        conn->zs_active = 1;
+        conn->encoding = encoding_gzip;
+    }
+    stream_fill(conn);
+    assert(conn->reply_length > 0);
+}
+
+/* What a page we make is made from. */
+enum page_data {
+    PAGE_GRAPHS,                /* /, /graphs.xml, /graphs.json */
+    PAGE_HOSTS                  /* /hosts/..., /hosts.json */
+};
+
+static enum page_data page_data(const char *safe_url)
+{
+    return (str_starts_with(safe_url, "/hosts") ? PAGE_HOSTS : PAGE_GRAPHS);
+}
+
+/* ---------------------------------------------------------------------------
+ * Reply cache.  Pages don't change until the graphs move on (once a second)
+ * or, for the hosts pages, hosts go away, so everyone polling within the
+ * same second can share one rendering, and one gzipping, of each page.
+ * Counters that went up in the meantime just show up on the next one.
+ */
+struct cached_reply {
+    TAILQ_ENTRY(cached_reply) entries;
+    char *key;                  /* safe URI, then "?" and the query */
+    enum page_data data;
+    uint64_t graph_gen, hosts_gen;
+    const char *mime_type, *header_extra;
+    char *body, *gzipped;       /* gzipped is made for the first client */
+    size_t body_length, gzipped_length;
+    int gzip_tried;             /* it might not have been worth it */
+};
+
+/* Oldest first. */
+static TAILQ_HEAD(cache_head, cached_reply) cache =
+    TAILQ_HEAD_INITIALIZER(cache);
+static unsigned int cache_count = 0;
+
+static char *cache_key(const char *safe_url, const char *query)
+{
+    char *key;
+
+    xasprintf(&key, "%s?%s", safe_url, (query == NULL) ? "" : query);
+    return (key);
+}
+
+static void cache_remove(struct cached_reply *c)
+{
+    TAILQ_REMOVE(&cache, c, entries);
+    cache_count--;
+    free(c->key);
+    free(c->body);
+    free(c->gzipped);
+    free(c);
+}
+
+/* Returns the cached reply for this URI and query, or NULL.  Drops every
+ * reply that's out of date on the way.
+ */
+static struct cached_reply *cache_find(const char *safe_url,
+    const char *query)
+{
+    struct cached_reply *c, *next, *found = NULL;
+    const uint64_t graph_gen = graph_generation();
+    const uint64_t hosts_gen = hosts_db_generation();
+    char *key = cache_key(safe_url, query);
+
+    for (c = TAILQ_FIRST(&cache); c != NULL; c = next) {
+        next = TAILQ_NEXT(c, entries);
+        if (c->graph_gen != graph_gen ||
+            (c->data == PAGE_HOSTS && c->hosts_gen != hosts_gen))
+            cache_remove(c);
+        else if (strcmp(c->key, key) == 0)
+            found = c;
+    }
+    free(key);
+    return (found);
+}
+
+static char *memdup(const char *src, const size_t len)
+{
+    char *dest = xmalloc(len);
+
+    memcpy(dest, src, len);
+    return (dest);
+}
+
+/* Remember the gzipped reply, if process_gzip() made one. */
+static void cache_gzipped(struct cached_reply *c,
+    const struct connection *conn)
+{
+    c->gzip_tried = 1;
+    if (conn->encoding == encoding_gzip) {
+        c->gzipped = memdup(conn->reply, conn->reply_length);
+        c->gzipped_length = conn->reply_length;
+    }
+}
+
+/* Keep a copy of a freshly made (and not yet gzipped) reply. */
+static struct cached_reply *cache_add(const char *safe_url,
+    const struct connection *conn)
+{
+    struct cached_reply *c = xmalloc(sizeof(*c));
+
+    if (cache_count == CACHE_MAX)
+        cache_remove(TAILQ_FIRST(&cache));
+    c->key = cache_key(safe_url, conn->query);
+    c->data = page_data(safe_url);
+    c->graph_gen = graph_generation();
+    c->hosts_gen = hosts_db_generation();
+    c->mime_type = conn->mime_type;
+    c->header_extra = conn->header_extra;
+    c->body = memdup(conn->reply, conn->reply_length);
+    c->body_length = conn->reply_length;
+    c->gzipped = NULL;
+    c->gzipped_length = 0;
+    c->gzip_tried = 0;
+    TAILQ_INSERT_TAIL(&cache, c, entries);
+    cache_count++;
+    return (c);
+}
+
+/* Reply from the cache.  Each connection gets its own copy, so the cache
+ * can drop a reply while it's still being sent.
+ */
+static void cache_reply(struct connection *conn, struct cached_reply *c)
+{
+    conn->mime_type = c->mime_type;
+    conn->header_extra = c->header_extra;
+    if (conn->accept_gzip && c->gzipped != NULL) {
+        conn->reply = memdup(c->gzipped, c->gzipped_length);
+        conn->reply_length = c->gzipped_length;
+        conn->encoding = encoding_gzip;
+        return;
+    }
+    conn->reply = memdup(c->body, c->body_length);
+    conn->reply_length = c->body_length;
+    if (conn->accept_gzip && !c->gzip_tried) {
+        process_gzip(conn);
+        cache_gzipped(c, conn);
+    }
+}
+
+static void cache_free(void)
+{
+    while (!TAILQ_EMPTY(&cache))
+        cache_remove(TAILQ_FIRST(&cache));
+}
+
+/* Is it one of the JSON API's? */
+static int is_json(const char *url)
+{
+    size_t len = strlen(url);
+
+    return (len > 5 && strcmp(url + len - 5, ".json") == 0);
+}
+
+/* ---------------------------------------------------------------------------
+ * Validators for the pages we make.  Each one is only as new as the data it
+ * shows, so an idle darkstat keeps answering /hosts.json with 304.  The
+ * HTML and XML say how long ago things happened, and the graphs (in any
+ * format) have the current time and start their bars at the current one,
+ * so those also change whenever the graphs move on.  The time darkstat
+ * started goes in the ETag too, since the counters start over when it does.
+ */
+static void dynamic_validators(struct connection *conn, const char *safe_url)
+{
+    static time_t started = 0, changed[4];
+    static uint64_t seen[4];
+    const int json = is_json(safe_url);
+    const unsigned int kind = page_data(safe_url) * 2 + json;
+    uint64_t v;
+
+    if (started == 0)
+        started = now_real();
+    v = (page_data(safe_url) == PAGE_GRAPHS) ?
+        graph_changes() : hosts_db_changes();
+    if (!json || page_data(safe_url) == PAGE_GRAPHS)
+        v += graph_generation();
+    if (changed[kind] == 0 || v != seen[kind]) {
+        /* It changed some time since we last looked: now is close enough,
+         * and never earlier than it really was.
+         */
+        seen[kind] = v;
+        changed[kind] = now_real();
+    }
+    snprintf(conn->dynamic_etag, sizeof(conn->dynamic_etag),
+        "W/\"%llx-%llx\"", (llu)started, (llu)v);
+    conn->etag = conn->dynamic_etag;
+    conn->last_modified = changed[kind];
+}
+
+/* ---------------------------------------------------------------------------
+ * Conditional GET: if the client already has what we'd send, reply 304 with
+ * no body, before anything is made or gzipped.  If-None-Match wins over
+ * If-Modified-Since, and the date has to be the one we sent, same as the
+ * ETag.  Returns 1 if it replied.
+ */
+static int not_modified(struct connection *conn)
+{
+    char *field, date[DATE_LEN], validators[160];
+    int match = 0;
+
+    if ((field = parse_field(conn, "If-None-Match: ")) != NULL) {
+        if (conn->etag != NULL) {
+            /* Weak comparison: the W/ doesn't matter, the quotes do.  "*"
+             * isn't handled: we can't tell if a host page exists without
+             * making it.
+             */
+            const char *tag = conn->etag;
+
+            if (str_starts_with(tag, "W/"))
+                tag += 2;
+            match = (strstr(field, tag) != NULL);
+        }
+        free(field);
+    }
+    else if (conn->last_modified != 0 &&
+        (field = parse_field(conn, "If-Modified-Since: ")) != NULL) {
+        match = (strcmp(field, rfc1123_date(date, conn->last_modified)) == 0);
+        free(field);
+    }
+    if (!match)
+        return 0;
+
+    if (!conn->reply_dont_free)
+        free(conn->reply);
+    conn->reply = NULL;
+    conn->reply_length = 0;
+    conn->header_only = 1;
+
+    /* No Content-* lines: they'd describe an empty body, not the page the
+     * client is holding on to.
+     */
+    format_validators(conn, validators, sizeof(validators));
+    conn->header_length = xasprintf(&(conn->header),
+        "HTTP/1.1 304 Not Modified\r\n"
+        "Date: %s\r\n"
+        "Server: %s\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "\r\n",
+        rfc1123_date(date, now_real()),
+        server,
+        validators,
+        conn->keep_alive ? "keep-alive" : "close");
+    conn->http_code = 304;
+    verbosef("http: 304 Not Modified");
+    return 1;
+}
+
 /* ---------------------------------------------------------------------------
  * Process a GET/HEAD request
  */
 static void process_get(struct connection *conn)
 {
     char *safe_url;
+    struct cached_reply *cached;
+    int cacheable = 0;
 
     verbosef("http: %s \"%s\" %s", conn->method, conn->uri,
         (conn->query == NULL)?"":conn->query);
@@ -649,14 +1254,88 @@ static void process_get(struct connection *conn)
         }
     }
 
+    if (strcmp(safe_url, "/graphs.events") == 0) {
+        /* Not cached or gzipped: after the first event, the rest are a few
+         * hundred bytes each.
+         */
+        struct str *buf = sse_graphs();
+        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        conn->mime_type = mime_type_events;
+        conn->header_extra = "Cache-Control: no-cache\r\n";
+        conn->events = 1;
+        conn->events_pushed = graph_generation();
+        event_conns++;
+        free(safe_url);
+        generate_header(conn, 200, "OK");
+        return;
+    }
+
+    if (strcmp(safe_url, "/") == 0 ||
+        str_starts_with(safe_url, "/hosts") ||
+        str_starts_with(safe_url, "/graphs.")) {
+        /* The graph pages only need the totals and graph counters: leave
+         * the capture threads' hosts tables alone, since merging them holds
+         * each one's lock.
+         */
+        if (page_data(safe_url) == PAGE_HOSTS)
+            acct_merge_shards();
+        else
+            acct_fold_shards();
+        dynamic_validators(conn, safe_url);
+        if (not_modified(conn)) {
+            free(safe_url);
+            return;
+        }
+    }
+
+    cached = cache_find(safe_url, conn->query);
+    if (cached != NULL) {
+        free(safe_url);
+        cache_reply(conn, cached);
+        generate_header(conn, 200, "OK");
+        return;
+    }
+
     if (strcmp(safe_url, "/") == 0) {
         struct str *buf = html_front_page();
         str_extract(buf, &(conn->reply_length), &(conn->reply));
         conn->mime_type = mime_type_html;
+        cacheable = 1;
+    }
+    else if (str_starts_with(safe_url, "/hosts") && is_json(safe_url)) {
+        struct str *buf;
+        struct hosts_stream *stream;
+
+        buf = json_hosts(safe_url, conn->query, &stream);
+        conn->mime_type = mime_type_json;
+        if (stream != NULL) {
+            free(safe_url);
+            stream_start(conn, stream);
+            generate_header(conn, 200, "OK");
+            return;
+        }
+        if (buf == NULL) {
+            default_reply(conn, 404, "Not Found",
+                "The page you requested could not be found.");
+            free(safe_url);
+            return;
+        }
+        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        cacheable = 1;
     }
     else if (str_starts_with(safe_url, "/hosts/")) {
         /* FIXME here - make this saner */
-        struct str *buf = html_hosts(safe_url, conn->query);
+        struct str *buf;
+        struct hosts_stream *stream;
+
+        buf = html_hosts(safe_url, conn->query, &stream);
+        if (stream != NULL) {
+            free(safe_url);
+            conn->mime_type = mime_type_html;
+            stream_start(conn, stream);
+            generate_header(conn, 200, "OK");
+            return;
+        }
         if (buf == NULL) {
             default_reply(conn, 404, "Not Found",
                 "The page you requested could not be found.");
@@ -665,6 +1344,7 @@ static void process_get(struct connection *conn)
         }
         str_extract(buf, &(conn->reply_length), &(conn->reply));
         conn->mime_type = mime_type_html;
+        cacheable = 1;
     }
     else if (str_starts_with(safe_url, "/graphs.xml")) {
         struct str *buf = xml_graphs();
@@ -672,6 +1352,19 @@ static void process_get(struct connection *conn)
         conn->mime_type = mime_type_xml;
         /* hack around Opera caching the XML */
         conn->header_extra = "Pragma: no-cache\r\n";
+        cacheable = 1;
+    }
+    else if (strcmp(safe_url, "/graphs.json") == 0) {
+        struct str *buf = json_graphs();
+        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        conn->mime_type = mime_type_json;
+        cacheable = 1;
+    }
+    else if (strcmp(safe_url, "/metrics") == 0) {
+        /* Never cached: it's cheap, and scraped for what it says now. */
+        struct str *buf = metrics_page();
+        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        conn->mime_type = mime_type_metrics;
     }
     else if (strcmp(safe_url, "/style.css") == 0)
         static_style_css(conn);
@@ -683,10 +1376,29 @@ static void process_get(struct connection *conn)
         free(safe_url);
         return;
     }
-    free(safe_url);
 
-    process_gzip(conn);
     assert(conn->mime_type != NULL);
+    if (conn->reply_dont_free && not_modified(conn)) {
+        /* A static page the client already has. */
+        free(safe_url);
+        return;
+    }
+    if (conn->accept_gzip && conn->reply_length >= GZIP_STREAM_MIN &&
+        !conn->reply_dont_free) {
+        /* Compress it as it goes out, instead of all at once. */
+        conn->html = conn->reply;
+        conn->html_length = conn->reply_length;
+        conn->reply = NULL;
+        stream_start(conn, NULL);
+    } else if (cacheable && conn->reply_length < GZIP_STREAM_MIN) {
+        cached = cache_add(safe_url, conn);
+        if (conn->accept_gzip) {
+            process_gzip(conn);
+            cache_gzipped(cached, conn);
+        }
+    } else
+        process_gzip(conn);
+    free(safe_url);
     generate_header(conn, 200, "OK");
 }
 
@@ -697,8 +1409,11 @@ static void process_get(struct connection *conn)
  */
 static void process_request(struct connection *conn)
 {
+    if (conn->requests_left > 0)
+        conn->requests_left--;
     if (!parse_request(conn))
     {
+        conn->keep_alive = 0; /* can't tell where the next one starts */
         default_reply(conn, 400, "Bad Request",
             "You sent a request that the server couldn't understand.");
     }
@@ -713,6 +1428,7 @@ static void process_request(struct connection *conn)
     }
     else
     {
+        conn->keep_alive = 0; /* it might have a body we'd have to skip */
         default_reply(conn, 501, "Not Implemented",
             "The method you specified (%s) is not implemented.",
             conn->method);
@@ -728,49 +1444,160 @@ static void process_request(struct connection *conn)
 
 
 /* ---------------------------------------------------------------------------
- * Receiving request.
+ * The connection did something: move it to the back of the idle queue.
  */
-static void poll_recv_request(struct connection *conn)
+static void touch(struct connection *conn)
 {
-    char buf[65536];
-    ssize_t recvd;
+    conn->last_active_mono = now_mono();
+    TAILQ_REMOVE(&connlist, conn, entries);
+    TAILQ_INSERT_TAIL(&connlist, conn, entries);
+}
 
-    recvd = recv(conn->socket, buf, sizeof(buf), 0);
-    dverbosef("poll_recv_request(%d) got %d bytes", conn->socket, (int)recvd);
-    if (recvd <= 0)
-    {
-        if (recvd == -1)
-            verbosef("recv(%d) error: %s", conn->socket, strerror(errno));
+static int would_block(void)
+{
+    return (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Wait for the socket to be ready again.  Returns 0 to stop conn_event(). */
+static int blocked(const struct connection *conn, const int events)
+{
+    event_blocked(conn->socket, events);
+    return 0;
+}
+
+
+
+/* The reply is all out.  Keep the connection for the next request, starting
+ * with whatever the client already pipelined after this one, or we're done.
+ */
+static void next_request(struct connection *conn)
+{
+    if (!conn->keep_alive) {
         conn->state = DONE;
         return;
     }
-    conn->last_active_mono = now_mono();
+    free_request(conn);
+    reset_request(conn);
+    conn->request = conn->pipelined;
+    conn->request_length = conn->pipelined_length;
+    conn->pipelined = NULL;
+    conn->pipelined_length = 0;
+    conn->state = RECV_REQUEST;
+}
 
-    /* append to conn->request */
-    conn->request = xrealloc(conn->request, conn->request_length+recvd+1);
-    memcpy(conn->request+conn->request_length, buf, (size_t)recvd);
-    conn->request_length += recvd;
-    conn->request[conn->request_length] = 0;
+/* An event is out: wait for the next one. */
+static void wait_event(struct connection *conn)
+{
+    if (!conn->reply_dont_free)
+        free(conn->reply);
+    conn->reply = NULL;
+    conn->reply_dont_free = 0;
+    conn->reply_length = 0;
+    conn->reply_sent = 0;
+    conn->state = WAIT_EVENT;
+}
 
-    /* die if it's too long */
-    if (conn->request_length > MAX_REQUEST_LENGTH)
-    {
-        default_reply(conn, 413, "Request Entity Too Large",
-            "Your request was dropped because it was too long.");
-        conn->state = SEND_HEADER;
+/* All of conn->reply is out: move on to the next piece of a streamed reply,
+ * the next event, or the next request.
+ */
+static void reply_done(struct connection *conn)
+{
+    if (conn->events) {
+        wait_event(conn);
         return;
     }
+    if (conn->stream_buf != NULL && !conn->stream_end) {
+        stream_fill(conn);
+        if (conn->reply_length > 0) {
+            conn->state = SEND_REPLY;
+            return;
+        }
+    }
+    next_request(conn);
+}
 
-    /* process request if we have all of it */
-    if (conn->request_length > 4 &&
-        memcmp(conn->request+conn->request_length-4, "\r\n\r\n", 4) == 0)
-    {
-        process_request(conn);
 
-        /* request not needed anymore */
-        free(conn->request);
-        conn->request = NULL; /* important: don't free it again later */
+
+/* ---------------------------------------------------------------------------
+ * If conn->request holds a whole request, cut it off there and keep the rest
+ * for later: the client can send the next ones without waiting for replies.
+ * Returns 1 if there was a whole one.
+ */
+static int split_request(struct connection *conn)
+{
+    char *end;
+    size_t len;
+
+    if (conn->request == NULL)
+        return 0;
+    end = strstr(conn->request, "\r\n\r\n");
+    if (end == NULL)
+        return 0;
+    len = end + 4 - conn->request;
+
+    assert(conn->pipelined == NULL);
+    if (len < conn->request_length) {
+        conn->pipelined_length = conn->request_length - len;
+        conn->pipelined = xmalloc(conn->pipelined_length + 1);
+        memcpy(conn->pipelined, conn->request + len,
+            conn->pipelined_length + 1); /* and the NUL */
+        conn->request_length = len;
+        conn->request[len] = '\0';
     }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Receiving request.  A pipelined one might be here already.
+ */
+static int poll_recv_request(struct connection *conn)
+{
+    char buf[65536];
+    ssize_t recvd;
+
+    if (!split_request(conn)) {
+        recvd = recv(conn->socket, buf, sizeof(buf), 0);
+        dverbosef("poll_recv_request(%d) got %d bytes",
+            conn->socket, (int)recvd);
+        if (recvd == -1 && would_block())
+            return blocked(conn, EVENT_READ);
+        if (recvd <= 0)
+        {
+            if (recvd == -1)
+                verbosef("recv(%d) error: %s",
+                    conn->socket, strerror(errno));
+            conn->state = DONE;
+            return 1;
+        }
+        touch(conn);
+
+        /* append to conn->request */
+        conn->request = xrealloc(conn->request,
+            conn->request_length+recvd+1);
+        memcpy(conn->request+conn->request_length, buf, (size_t)recvd);
+        conn->request_length += recvd;
+        conn->request[conn->request_length] = 0;
+
+        if (!split_request(conn)) {
+            /* die if it's too long */
+            if (conn->request_length > MAX_REQUEST_LENGTH)
+            {
+                conn->keep_alive = 0;
+                default_reply(conn, 413, "Request Entity Too Large",
+                    "Your request was dropped because it was too long.");
+                conn->state = SEND_HEADER;
+            }
+            return 1;
+        }
+    }
+
+    /* We have all of it. */
+    process_request(conn);
+
+    /* request not needed anymore */
+    free(conn->request);
+    conn->request = NULL; /* important: don't free it again later */
+    return 1;
 }
 
 
@@ -778,7 +1605,7 @@ static void poll_recv_request(struct connection *conn)
 /* ---------------------------------------------------------------------------
  * Try to send header and [a part of the] reply in one packet.
  */
-static void poll_send_header_and_reply(struct connection *conn)
+static int poll_send_header_and_reply(struct connection *conn)
 {
     ssize_t sent;
     struct iovec iov[2];
@@ -797,15 +1624,17 @@ static void poll_send_header_and_reply(struct connection *conn)
     iov[1].iov_len = conn->reply_length;
 
     sent = writev(conn->socket, iov, 2);
-    conn->last_active_mono = now_mono();
+    if (sent == -1 && would_block())
+        return blocked(conn, EVENT_WRITE);
 
     /* handle any errors (-1) or closure (0) in send() */
     if (sent < 1) {
         if (sent == -1)
             verbosef("writev(%d) error: %s", conn->socket, strerror(errno));
         conn->state = DONE;
-        return;
+        return 1;
     }
+    touch(conn);
 
     /* Figure out what we've sent. */
     conn->total_sent += (unsigned int)sent;
@@ -813,7 +1642,7 @@ static void poll_send_header_and_reply(struct connection *conn)
         verbosef("partially sent header");
         conn->header_sent = sent;
         conn->state = SEND_HEADER;
-        return;
+        return 1;
     }
     /* else */
     conn->header_sent = conn->header_length;
@@ -823,24 +1652,26 @@ static void poll_send_header_and_reply(struct connection *conn)
         verbosef("partially sent reply");
         conn->reply_sent += sent;
         conn->state = SEND_REPLY;
-        return;
+        return 1;
     }
     /* else */
     conn->reply_sent = conn->reply_length;
-    conn->state = DONE;
+    reply_done(conn);
+    return 1;
 }
 
 /* ---------------------------------------------------------------------------
  * Sending header.  Assumes conn->header is not NULL.
  */
-static void poll_send_header(struct connection *conn)
+static int poll_send_header(struct connection *conn)
 {
     ssize_t sent;
 
     sent = send(conn->socket, conn->header + conn->header_sent,
         conn->header_length - conn->header_sent, 0);
-    conn->last_active_mono = now_mono();
     dverbosef("poll_send_header(%d) sent %d bytes", conn->socket, (int)sent);
+    if (sent == -1 && would_block())
+        return blocked(conn, EVENT_WRITE);
 
     /* handle any errors (-1) or closure (0) in send() */
     if (sent < 1)
@@ -848,8 +1679,9 @@ static void poll_send_header(struct connection *conn)
         if (sent == -1)
             verbosef("send(%d) error: %s", conn->socket, strerror(errno));
         conn->state = DONE;
-        return;
+        return 1;
     }
+    touch(conn);
     conn->header_sent += (unsigned int)sent;
     conn->total_sent += (unsigned int)sent;
 
@@ -857,10 +1689,11 @@ static void poll_send_header(struct connection *conn)
     if (conn->header_sent == conn->header_length)
     {
         if (conn->header_only)
-            conn->state = DONE;
+            next_request(conn);
         else
             conn->state = SEND_REPLY;
     }
+    return 1;
 }
 
 
@@ -868,19 +1701,20 @@ static void poll_send_header(struct connection *conn)
 /* ---------------------------------------------------------------------------
  * Sending reply.
  */
-static void poll_send_reply(struct connection *conn)
+static int poll_send_reply(struct connection *conn)
 {
     ssize_t sent;
 
     sent = send(conn->socket,
         conn->reply + conn->reply_sent,
         conn->reply_length - conn->reply_sent, 0);
-    conn->last_active_mono = now_mono();
     dverbosef("poll_send_reply(%d) sent %d: [%d-%d] of %d",
         conn->socket, (int)sent,
         (int)conn->reply_sent,
         (int)(conn->reply_sent + sent - 1),
         (int)conn->reply_length);
+    if (sent == -1 && would_block())
+        return blocked(conn, EVENT_WRITE);
 
     /* handle any errors (-1) or closure (0) in send() */
     if (sent < 1)
@@ -890,13 +1724,145 @@ static void poll_send_reply(struct connection *conn)
         else if (sent == 0)
             verbosef("send(%d) closure", conn->socket);
         conn->state = DONE;
-        return;
+        return 1;
     }
+    touch(conn);
     conn->reply_sent += (unsigned int)sent;
     conn->total_sent += (unsigned int)sent;
 
     /* check if we're done sending */
-    if (conn->reply_sent == conn->reply_length) conn->state = DONE;
+    if (conn->reply_sent == conn->reply_length) reply_done(conn);
+    return 1;
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Waiting for the next event.  The client has nothing more to say, so all
+ * there is to notice is it going away.
+ */
+static int poll_wait_event(struct connection *conn)
+{
+    char buf[512];
+    ssize_t recvd;
+
+    recvd = recv(conn->socket, buf, sizeof(buf), 0);
+    if (recvd == -1 && would_block())
+        return blocked(conn, EVENT_READ);
+    if (recvd <= 0)
+    {
+        if (recvd == -1)
+            verbosef("recv(%d) error: %s", conn->socket, strerror(errno));
+        conn->state = DONE;
+    }
+    return 1; /* anything it did send is ignored */
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Run the connection's state machine until it would block or is done.  The
+ * socket is edge-triggered, so stopping any earlier would leave it waiting
+ * for readiness that has already been reported.
+ */
+static void conn_event(void *arg, const int events _unused_)
+{
+    struct connection *conn = arg;
+    int more = 1;
+
+    while (more)
+    switch (conn->state)
+    {
+    case RECV_REQUEST:          more = poll_recv_request(conn); break;
+    case SEND_HEADER_AND_REPLY: more = poll_send_header_and_reply(conn); break;
+    case SEND_HEADER:           more = poll_send_header(conn); break;
+    case SEND_REPLY:            more = poll_send_reply(conn); break;
+    case WAIT_EVENT:            more = poll_wait_event(conn); break;
+
+    case DONE:
+        TAILQ_REMOVE(&connlist, conn, entries);
+        free_connection(conn);
+        return;
+
+    default: errx(1, "invalid state");
+    }
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Time out idle connections.  They're in order of last activity, so we can
+ * stop at the first one that's still alive.
+ */
+static void expire_idle(void *arg _unused_, const int events _unused_)
+{
+    struct connection *conn;
+
+    while ((conn = TAILQ_FIRST(&connlist)) != NULL &&
+           now_mono() - conn->last_active_mono >= idletime)
+    {
+        char ipaddr[INET6_ADDRSTRLEN];
+        int ret = getnameinfo((struct sockaddr *)&conn->client,
+            sizeof(conn->client), ipaddr, sizeof(ipaddr),
+            NULL, 0, NI_NUMERICHOST);
+        if (ret == 0)
+            verbosef("http socket timeout from %s (fd %d)",
+                    ipaddr, conn->socket);
+        else
+            warn("http socket timeout: getnameinfo error: %s",
+                gai_strerror(ret));
+        TAILQ_REMOVE(&connlist, conn, entries);
+        free_connection(conn);
+    }
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * The graphs moved on: send what changed to everyone on graphs.events.  One
+ * event is made for all of them.  Anyone still sending the last one misses
+ * this one, and gets everything again next time, so nobody is left with a
+ * gap.
+ */
+void http_push_graphs(void)
+{
+    static uint64_t pushed = 0; /* graph generation */
+    const uint64_t gen = graph_generation();
+    struct connection *conn, *next;
+    char *delta, *full = NULL;
+    size_t delta_len, full_len = 0;
+
+    if (event_conns == 0 || gen == pushed)
+        return;
+    pushed = gen;
+    str_extract(sse_graphs_delta(), &delta_len, &delta);
+
+    /* Sending moves a connection to the back of the list, where it comes
+     * round again: events_pushed says it's already had this one.
+     */
+    TAILQ_FOREACH_SAFE(conn, &connlist, entries, next) {
+        if (!conn->events || conn->events_pushed == gen)
+            continue;
+        if (conn->state != WAIT_EVENT) {
+            conn->events_missed = 1;
+            continue;
+        }
+        conn->events_pushed = gen;
+        if (conn->events_missed) {
+            if (full == NULL)
+                str_extract(sse_graphs(), &full_len, &full);
+            conn->reply = memdup(full, full_len);
+            conn->reply_length = full_len;
+            conn->events_missed = 0;
+        } else {
+            conn->reply = memdup(delta, delta_len);
+            conn->reply_length = delta_len;
+        }
+        conn->state = SEND_REPLY;
+        conn_event(conn, EVENT_WRITE);
+    }
+    free(delta);
+    free(full);
 }
 
 
@@ -1037,6 +2003,8 @@ static void http_listen_one(struct addrinfo *ai,
 /* Initialize the http sockets and listen on them. */
 void http_listen(const unsigned short bindport)
 {
+    unsigned int i;
+
     /* If the user didn't specify any bind addresses, add a NULL.
      * This will become a wildcard.
      */
@@ -1061,6 +2029,11 @@ void http_listen(const unsigned short bindport)
     if (insocks == NULL)
         errx(1, "was not able to bind any ports for http interface");
 
+    /* insocks won't move now. */
+    for (i=0; i<insock_num; i++)
+        event_add(insocks[i], EVENT_READ, 0, accept_connection, &insocks[i]);
+    idle_timer = event_timer_add(IDLE_CHECK_MSEC, expire_idle, NULL);
+
     /* ignore SIGPIPE */
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         err(1, "can't ignore SIGPIPE");
@@ -1068,135 +2041,31 @@ void http_listen(const unsigned short bindport)
 
 
 
-/* ---------------------------------------------------------------------------
- * Set recv/send fd_sets and calculate timeout length.
- */
-void
-http_fd_set(fd_set *recv_set, fd_set *send_set, int *max_fd,
-    struct timeval *timeout, int *need_timeout)
-{
-    struct connection *conn, *next;
-    int minidle = idletime + 1;
-    unsigned int i;
-
-    #define MAX_FD_SET(sock, fdset) do { \
-        FD_SET(sock, fdset); *max_fd = MAX(*max_fd, sock); } while(0)
-
-    for (i=0; i<insock_num; i++)
-        MAX_FD_SET(insocks[i], recv_set);
-
-    LIST_FOREACH_SAFE(conn, &connlist, entries, next)
-    {
-        int idlefor = now_mono() - conn->last_active_mono;
-
-        /* Time out dead connections. */
-        if (idlefor >= idletime) {
-            char ipaddr[INET6_ADDRSTRLEN];
-            /* FIXME: this is too late on FreeBSD, socket is invalid */
-            int ret = getnameinfo((struct sockaddr *)&conn->client,
-                sizeof(conn->client), ipaddr, sizeof(ipaddr),
-                NULL, 0, NI_NUMERICHOST);
-            if (ret == 0)
-                verbosef("http socket timeout from %s (fd %d)",
-                        ipaddr, conn->socket);
-            else
-                warn("http socket timeout: getnameinfo error: %s",
-                    gai_strerror(ret));
-            conn->state = DONE;
-        }
-
-        /* Connections that need a timeout. */
-        if (conn->state != DONE)
-            minidle = MIN(minidle, (idletime - idlefor));
-
-        switch (conn->state)
-        {
-        case DONE:
-            /* clean out stale connection */
-            LIST_REMOVE(conn, entries);
-            free_connection(conn);
-            free(conn);
-            break;
-
-        case RECV_REQUEST:
-            MAX_FD_SET(conn->socket, recv_set);
-            break;
-
-        case SEND_HEADER_AND_REPLY:
-        case SEND_HEADER:
-        case SEND_REPLY:
-            MAX_FD_SET(conn->socket, send_set);
-            break;
-
-        default: errx(1, "invalid state");
-        }
-    }
-    #undef MAX_FD_SET
-
-    /* Only set timeout if cap hasn't already. */
-    if ((*need_timeout == 0) && (minidle <= idletime)) {
-        *need_timeout = 1;
-        timeout->tv_sec = minidle;
-        timeout->tv_usec = 0;
-    }
-}
-
-
-
-/* ---------------------------------------------------------------------------
- * poll connections that select() says need attention
- */
-void http_poll(fd_set *recv_set, fd_set *send_set)
-{
-    struct connection *conn;
-    unsigned int i;
-
-    for (i=0; i<insock_num; i++)
-        if (FD_ISSET(insocks[i], recv_set))
-            accept_connection(insocks[i]);
-
-    LIST_FOREACH(conn, &connlist, entries)
-    switch (conn->state)
-    {
-    case RECV_REQUEST:
-        if (FD_ISSET(conn->socket, recv_set)) poll_recv_request(conn);
-        break;
-
-    case SEND_HEADER_AND_REPLY:
-        if (FD_ISSET(conn->socket, send_set)) poll_send_header_and_reply(conn);
-        break;
-
-    case SEND_HEADER:
-        if (FD_ISSET(conn->socket, send_set)) poll_send_header(conn);
-        break;
-
-    case SEND_REPLY:
-        if (FD_ISSET(conn->socket, send_set)) poll_send_reply(conn);
-        break;
-
-    case DONE: /* fallthrough */
-    default: errx(1, "invalid state");
-    }
-}
-
 void http_stop(void) {
-    struct connection *conn;
+    struct connection *conn, *next;
     unsigned int i;
 
     free(http_base_url);
+    event_timer_del(idle_timer);
 
     /* Close listening sockets. */
-    for (i=0; i<insock_num; i++)
+    for (i=0; i<insock_num; i++) {
+        event_del(insocks[i]);
         close(insocks[i]);
+    }
     free(insocks);
     insocks = NULL;
 
     /* Close in-flight connections. */
-    LIST_FOREACH(conn, &connlist, entries) {
-        LIST_REMOVE(conn, entries);
+    TAILQ_FOREACH_SAFE(conn, &connlist, entries, next) {
+        TAILQ_REMOVE(&connlist, conn, entries);
         free_connection(conn);
-        free(conn);
     }
+    if (conn_pool != NULL) {
+        pool_free(conn_pool);
+        conn_pool = NULL;
+    }
+    cache_free();
 }
 
 /* vim:set ts=4 sw=4 et tw=78: */
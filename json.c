@@ -0,0 +1,159 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * json.c: JSON writer, on top of struct str.
+ *
+ * It's for big documents made of lots of small numbers, so it doesn't go
+ * through printf(): numbers are turned into digits by hand, and strings are
+ * copied a run at a time between the characters that need escaping.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "err.h"
+#include "json.h"
+#include "str.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define JSON_KEY_MAX 32
+
+void
+json_init(struct json *j, struct str *buf)
+{
+   j->buf = buf;
+   j->depth = 0;
+   j->more[0] = 0;
+}
+
+/* The comma before a value, if it needs one, and its key, in one go. */
+static void
+json_key(struct json *j, const char *key)
+{
+   char head[JSON_KEY_MAX + 4]; /* ,"key": */
+   size_t len = 0;
+
+   if (j->more[j->depth])
+      head[len++] = ',';
+   j->more[j->depth] = 1;
+   if (key != NULL) {
+      size_t klen = strlen(key);
+
+      assert(klen <= JSON_KEY_MAX);
+      head[len++] = '"';
+      memcpy(head + len, key, klen);
+      len += klen;
+      head[len++] = '"';
+      head[len++] = ':';
+   }
+   if (len > 0)
+      str_appendn(j->buf, head, len);
+}
+
+static void
+json_open(struct json *j, const char *key, const char *bracket)
+{
+   json_key(j, key);
+   str_appendn(j->buf, bracket, 1);
+   if (j->depth + 1 >= JSON_DEPTH)
+      errx(1, "JSON nested too deep");
+   j->more[++j->depth] = 0;
+}
+
+static void
+json_close(struct json *j, const char *bracket)
+{
+   assert(j->depth > 0);
+   j->depth--;
+   str_appendn(j->buf, bracket, 1);
+}
+
+void
+json_object(struct json *j, const char *key)
+{
+   json_open(j, key, "{");
+}
+
+void
+json_object_end(struct json *j)
+{
+   json_close(j, "}");
+}
+
+void
+json_array(struct json *j, const char *key)
+{
+   json_open(j, key, "[");
+}
+
+void
+json_array_end(struct json *j)
+{
+   json_close(j, "]");
+}
+
+void
+json_uint(struct json *j, const char *key, const uint64_t v)
+{
+   char digits[20]; /* 2^64 has 20 of them */
+   size_t pos = sizeof(digits);
+   uint64_t n = v;
+
+   json_key(j, key);
+   do {
+      digits[--pos] = (char)('0' + n % 10);
+      n /= 10;
+   } while (n > 0);
+   str_appendn(j->buf, digits + pos, sizeof(digits) - pos);
+}
+
+void
+json_bool(struct json *j, const char *key, const int v)
+{
+   json_key(j, key);
+   if (v)
+      str_append(j->buf, "true");
+   else
+      str_append(j->buf, "false");
+}
+
+void
+json_string(struct json *j, const char *key, const char *s)
+{
+   static const char hex[] = "0123456789abcdef";
+   const unsigned char *p, *run;
+
+   json_key(j, key);
+   if (s == NULL) {
+      str_append(j->buf, "null");
+      return;
+   }
+   str_append(j->buf, "\"");
+   for (p = run = (const unsigned char *)s; *p != '\0'; p++) {
+      char esc[6];
+
+      /* Hostnames should be ASCII.  Anything else is taken to be Latin-1,
+       * so the output is always valid UTF-8.
+       */
+      if (*p >= 0x20 && *p < 0x7f && *p != '"' && *p != '\\')
+         continue;
+      str_appendn(j->buf, (const char *)run, (size_t)(p - run));
+      run = p + 1;
+      if (*p == '"' || *p == '\\') {
+         esc[0] = '\\';
+         esc[1] = (char)*p;
+         str_appendn(j->buf, esc, 2);
+      } else {
+         memcpy(esc, "\\u00", 4);
+         esc[4] = hex[*p >> 4];
+         esc[5] = hex[*p & 15];
+         str_appendn(j->buf, esc, 6);
+      }
+   }
+   str_appendn(j->buf, (const char *)run, (size_t)(p - run));
+   str_append(j->buf, "\"");
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
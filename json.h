@@ -0,0 +1,42 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * json.h: JSON writer, on top of struct str.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_JSON_H
+#define __DARKSTAT_JSON_H
+
+#include <stdint.h>
+
+struct str;
+
+#define JSON_DEPTH 8 /* deepest nesting */
+
+/* Where the commas go.  It only points at buf, so a document can be written
+ * a piece at a time, into a different buf each time.
+ */
+struct json {
+   struct str *buf;
+   unsigned int depth;
+   int more[JSON_DEPTH]; /* something's already been written at this depth */
+};
+
+void json_init(struct json *j, struct str *buf);
+
+/* Members of an object have a key.  Elements of an array, and the whole
+ * document, pass NULL.  Keys are written as they are, so they have to be
+ * plain strings that don't need escaping.
+ */
+void json_object(struct json *j, const char *key);
+void json_object_end(struct json *j);
+void json_array(struct json *j, const char *key);
+void json_array_end(struct json *j);
+void json_uint(struct json *j, const char *key, const uint64_t v);
+void json_bool(struct json *j, const char *key, const int v);
+void json_string(struct json *j, const char *key, const char *s); /* or NULL */
+
+#endif /* __DARKSTAT_JSON_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,169 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * metrics.c: counters about darkstat itself, in the Prometheus text format.
+ *
+ * Everything here comes from counters the rest of darkstat keeps anyway, so
+ * the page costs the same with ten hosts as with ten million, and can be
+ * scraped as often as anyone likes.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "acct.h"
+#include "cap.h"
+#include "dns.h"
+#include "hosts_db.h"
+#include "metrics.h"
+#include "str.h"
+
+#include <time.h>
+
+static uint64_t loop_nsec[LOOP_STAGES], loop_iterations = 0;
+
+static const char *loop_stage_names[LOOP_STAGES] = {
+   "wait", "housekeeping", "rotate", "evict", "dispatch", "capture"
+};
+
+void
+loop_stage_done(const enum loop_stage stage, struct timespec *t)
+{
+   struct timespec t1;
+   int64_t nsec;
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   nsec = (int64_t)(t1.tv_sec - t->tv_sec) * 1000000000 +
+      (t1.tv_nsec - t->tv_nsec);
+   if (nsec > 0)
+      loop_nsec[stage] += (uint64_t)nsec;
+   if (stage == LOOP_WAIT)
+      loop_iterations++;
+   *t = t1;
+}
+
+void
+metric_head(struct str *buf, const char *name, const char *type,
+   const char *help)
+{
+   str_appendf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Backslashes, double quotes and newlines need escaping. */
+static void
+append_label(struct str *buf, const char *label, const char *value)
+{
+   const char *p, *run;
+
+   str_appendf(buf, "{%s=\"", label);
+   for (p = run = value; *p != '\0'; p++) {
+      if (*p != '\\' && *p != '"' && *p != '\n')
+         continue;
+      str_appendn(buf, run, (size_t)(p - run));
+      str_append(buf, (*p == '\n') ? "\\n" : (*p == '"') ? "\\\"" : "\\\\");
+      run = p + 1;
+   }
+   str_appendn(buf, run, (size_t)(p - run));
+   str_append(buf, "\"}");
+}
+
+static void
+sample_name(struct str *buf, const char *name, const char *label,
+   const char *label_value)
+{
+   str_append(buf, name);
+   if (label != NULL)
+      append_label(buf, label, label_value);
+   str_append(buf, " ");
+}
+
+void
+metric_sample(struct str *buf, const char *name, const char *label,
+   const char *label_value, const uint64_t v)
+{
+   sample_name(buf, name, label, label_value);
+   str_appendf(buf, "%qu\n", (qu)v);
+}
+
+/* v / 10^places, without going through floating point. */
+static void
+append_fixed(struct str *buf, const uint64_t v, const unsigned int places)
+{
+   char frac[9];
+   uint64_t scale = 1, f;
+   unsigned int i;
+
+   for (i = 0; i < places; i++)
+      scale *= 10;
+   f = v % scale;
+   for (i = places; i > 0; i--) {
+      frac[i - 1] = (char)('0' + f % 10);
+      f /= 10;
+   }
+   str_appendf(buf, "%qu.", (qu)(v / scale));
+   str_appendn(buf, frac, places);
+   str_append(buf, "\n");
+}
+
+void
+metric_sample_nsec(struct str *buf, const char *name, const char *label,
+   const char *label_value, const uint64_t nsec)
+{
+   sample_name(buf, name, label, label_value);
+   append_fixed(buf, nsec, 9);
+}
+
+void
+metric_sample_ratio(struct str *buf, const char *name,
+   const uint64_t num, const uint64_t den)
+{
+   sample_name(buf, name, NULL, NULL);
+   append_fixed(buf, (den == 0) ? 0 : num * 1000000 / den, 6);
+}
+
+void
+metric(struct str *buf, const char *name, const char *type,
+   const char *help, const uint64_t v)
+{
+   metric_head(buf, name, type, help);
+   metric_sample(buf, name, NULL, NULL, v);
+}
+
+static void
+loop_metrics(struct str *buf)
+{
+   unsigned int i;
+
+   metric(buf, "darkstat_loop_iterations_total", "counter",
+      "Times around the main loop.", loop_iterations);
+   metric_head(buf, "darkstat_loop_seconds_total", "counter",
+      "Time spent in each stage of the main loop.");
+   for (i = 0; i < LOOP_STAGES; i++) {
+      uint64_t nsec = loop_nsec[i];
+
+      /* Take capture out of dispatch, so the stages add up to wall time. */
+      if (i == LOOP_DISPATCH)
+         nsec = (nsec > loop_nsec[LOOP_CAPTURE]) ?
+            nsec - loop_nsec[LOOP_CAPTURE] : 0;
+      metric_sample_nsec(buf, "darkstat_loop_seconds_total", "stage",
+         loop_stage_names[i], nsec);
+   }
+}
+
+struct str *
+metrics_page(void)
+{
+   struct str *buf = str_make();
+
+   metric(buf, "darkstat_packets_total", "counter",
+      "Packets accounted for.", acct_total_packets);
+   metric(buf, "darkstat_bytes_total", "counter",
+      "Bytes accounted for.", acct_total_bytes);
+   cap_metrics(buf);
+   hosts_db_metrics(buf);
+   dns_metrics(buf);
+   loop_metrics(buf);
+   return buf;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
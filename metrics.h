@@ -0,0 +1,54 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * metrics.h: counters about darkstat itself, in the Prometheus text format.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_METRICS_H
+#define __DARKSTAT_METRICS_H
+
+#include <stdint.h>
+
+struct str;
+struct timespec;
+
+/* Where the main loop spends its time.  Capture happens during dispatch, but
+ * is counted on its own.
+ */
+enum loop_stage {
+   LOOP_WAIT,
+   LOOP_HOUSEKEEPING,
+   LOOP_ROTATE,
+   LOOP_EVICT,
+   LOOP_DISPATCH,
+   LOOP_CAPTURE,
+   LOOP_STAGES
+};
+
+/* Adds the time since *t to the stage, and starts *t again for the next. */
+void loop_stage_done(const enum loop_stage stage, struct timespec *t);
+
+/* Each metric gets a head, then one or more samples.  Label values are
+ * escaped, names and label keys are written as they are.  Pass a NULL label
+ * for a sample without one.
+ */
+void metric_head(struct str *buf, const char *name, const char *type,
+   const char *help);
+void metric_sample(struct str *buf, const char *name, const char *label,
+   const char *label_value, const uint64_t v);
+void metric_sample_nsec(struct str *buf, const char *name, const char *label,
+   const char *label_value, const uint64_t nsec); /* as seconds */
+void metric_sample_ratio(struct str *buf, const char *name,
+   const uint64_t num, const uint64_t den);
+
+/* A metric with one sample and no labels. */
+void metric(struct str *buf, const char *name, const char *type,
+   const char *help, const uint64_t v);
+
+/* Everything, for /metrics. */
+struct str *metrics_page(void);
+
+#endif /* __DARKSTAT_METRICS_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
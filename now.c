@@ -15,6 +15,7 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include "cdefs.h"
 #include "err.h"
 #include "now.h"
 #include "str.h"
@@ -60,8 +61,9 @@ int clock_gettime(clockid_t clk_id, struct timespec *tp) {
 }
 #endif  /* __MACH__ */
 
-static struct timespec clock_real, clock_mono;
-static int now_initialized = 0;
+/* Each thread keeps its own cache, see now.h */
+static _thread_local_ struct timespec clock_real, clock_mono;
+static _thread_local_ int now_initialized = 0;
 
 time_t now_real(void) {
    assert(now_initialized);
@@ -140,6 +142,13 @@ static int64_t ts_diff(const struct timespec * const a,
           a->tv_nsec - b->tv_nsec;
 }
 
+int64_t timer_nsec(const struct timespec * const t0) {
+   struct timespec t1;
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   return ts_diff(&t1, t0);
+}
+
 void timer_stop(const struct timespec * const t0,
                 const int64_t nsec,
                 const char *warning) {
@@ -17,6 +17,9 @@
  */
 #include <sys/types.h>
 
+/* The cache is per-thread: a capture worker thread calls now_init() and
+ * now_update() for itself.
+ */
 void now_init(void);
 void now_update(void); /* once per event loop (in darkstat.c) */
 
@@ -29,6 +32,7 @@ time_t real_to_mono(const time_t t);
 /* Emits warnings if a call is too slow. */
 struct timespec;
 void timer_start(struct timespec *t);
+int64_t timer_nsec(const struct timespec * const t); /* since timer_start */
 void timer_stop(const struct timespec * const t,
                 const int64_t nsec,
                 const char *warning);
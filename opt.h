@@ -5,17 +5,29 @@
  */
 
 /* Capture options. */
+extern const char *opt_capfile;
 extern int opt_want_pppoe;
 extern int opt_want_macs;
 extern int opt_want_hexdump;
 extern int opt_want_snaplen;
 extern int opt_wait_secs;
+extern unsigned int opt_ring_size;
+
+/* TPACKET_V3 ring options (Linux only). */
+extern int opt_want_tpacket;
+extern unsigned int opt_tpacket_block_size;
+extern unsigned int opt_tpacket_blocks;
+extern unsigned int opt_tpacket_timeout;
+extern unsigned int opt_fanout;
+extern unsigned int opt_jobs;
+extern int opt_want_mmap;
 
 /* Error/logging options. */
 extern int opt_want_verbose;
 extern int opt_want_syslog;
 
 /* Accounting options. */
+extern unsigned int opt_batch;
 extern unsigned int opt_highest_port;
 extern int opt_want_local_only;
 
@@ -24,11 +36,13 @@ extern int opt_want_local_only;
  */
 extern unsigned int opt_hosts_max;
 extern unsigned int opt_hosts_keep;
+extern unsigned int opt_evict_halflife;
 extern unsigned int opt_ports_max;
 extern unsigned int opt_ports_keep;
 
 /* Hosts output options. */
 extern int opt_want_lastseen;
+extern unsigned int opt_sort_cache;
 
 /* Initialized in cap.c, added to <title> */
 extern char *title_interfaces;
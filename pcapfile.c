@@ -0,0 +1,356 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * pcapfile.c: memory-mapped reader for pcap and pcapng capture files.
+ *
+ * We map the whole file and walk the records in place, handing the decoders
+ * pointers straight into the mapping, so there's no copy and no read()
+ * per packet like libpcap's offline reader does.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "cdefs.h"
+#include "conv.h"
+#include "err.h"
+#include "pcapfile.h"
+#include "str.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_FILE_HDR   24
+#define PCAP_REC_HDR    16
+
+#define PCAPNG_SHB      0x0a0d0d0a /* the same in either byte order */
+#define PCAPNG_IDB      1
+#define PCAPNG_PB       2 /* obsolete, but still around */
+#define PCAPNG_SPB      3
+#define PCAPNG_EPB      6
+#define PCAPNG_BOM      0x1a2b3c4d
+#define PCAPNG_BLK_HDR  12 /* type, length, and the length again at the end */
+
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_IF_TSRESOL   9
+#define PCAPNG_IF_TSOFFSET  14
+
+/* Files carry LINKTYPE_ values, which are the same as DLT_ values except
+ * for a few that differ between platforms.
+ */
+#define LINKTYPE_RAW    101
+#define LINKTYPE_LOOP   108
+
+struct pcapfile_if {
+   int linktype;
+   uint64_t units;  /* timestamp units per second */
+   int64_t offset;  /* seconds to add to timestamps */
+};
+
+struct pcapfile {
+   const char *name;
+   const uint8_t *map, *pos, *end;
+   size_t len;
+   int pcapng, swapped;
+
+   /* Classic pcap. */
+   int linktype, nsec;
+
+   /* pcapng: the interfaces described so far in this section. */
+   struct pcapfile_if *ifs;
+   unsigned int num_ifs;
+};
+
+static uint32_t swap32(const uint32_t x) {
+   return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+static uint16_t get16(const struct pcapfile *f, const uint8_t *p) {
+   uint16_t x;
+
+   memcpy(&x, p, sizeof(x));
+   return f->swapped ? (uint16_t)((x >> 8) | (x << 8)) : x;
+}
+
+static uint32_t get32(const struct pcapfile *f, const uint8_t *p) {
+   uint32_t x;
+
+   memcpy(&x, p, sizeof(x));
+   return f->swapped ? swap32(x) : x;
+}
+
+static uint64_t get64(const struct pcapfile *f, const uint8_t *p) {
+   uint64_t x;
+
+   memcpy(&x, p, sizeof(x));
+   if (f->swapped)
+      x = ((uint64_t)swap32((uint32_t)x) << 32) | swap32((uint32_t)(x >> 32));
+   return x;
+}
+
+static int linktype_to_dlt(const uint32_t linktype) {
+   switch (linktype & 0xffff) { /* the high bits are FCS info */
+   case LINKTYPE_RAW:  return DLT_RAW;
+   case LINKTYPE_LOOP: return DLT_LOOP;
+   default:            return (int)(linktype & 0xffff);
+   }
+}
+
+static void corrupt(const struct pcapfile *f, const uint8_t *p) _noreturn_;
+static void corrupt(const struct pcapfile *f, const uint8_t *p) {
+   errx(1, "\"%s\" is truncated or corrupt at offset %llu",
+        f->name, (llu)(p - f->map));
+}
+
+struct pcapfile *pcapfile_open(const char *name) {
+   struct pcapfile *f;
+   struct stat st;
+   uint32_t magic, bom;
+   void *map;
+   int fd;
+
+   fd = open(name, O_RDONLY);
+   if (fd == -1)
+      err(1, "can't open \"%s\"", name);
+   if (fstat(fd, &st) == -1)
+      err(1, "fstat(\"%s\")", name);
+   if (!S_ISREG(st.st_mode) || (st.st_size < PCAP_FILE_HDR) ||
+       ((uint64_t)st.st_size > SIZE_MAX)) {
+      close(fd);
+      return NULL;
+   }
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd); /* the mapping holds on to the file */
+   if (map == MAP_FAILED) {
+      verbosef("can't mmap \"%s\": %s", name, strerror(errno));
+      return NULL;
+   }
+#ifdef MADV_SEQUENTIAL
+   madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+   f = xcalloc(1, sizeof(*f));
+   f->name = name;
+   f->map = map;
+   f->len = (size_t)st.st_size;
+   f->end = f->map + f->len;
+
+   memcpy(&magic, f->map, sizeof(magic));
+   memcpy(&bom, f->map + 8, sizeof(bom));
+   if ((magic == PCAP_MAGIC) || (magic == PCAP_MAGIC_NSEC))
+      f->swapped = 0;
+   else if ((swap32(magic) == PCAP_MAGIC) || (swap32(magic) == PCAP_MAGIC_NSEC))
+      f->swapped = 1;
+   else if ((magic == PCAPNG_SHB) &&
+            ((bom == PCAPNG_BOM) || (swap32(bom) == PCAPNG_BOM))) {
+      f->pcapng = 1;
+      f->pos = f->map; /* pcapfile_next() reads the SHB */
+      return f;
+   } else {
+      pcapfile_close(f);
+      return NULL;
+   }
+   f->nsec = (get32(f, f->map) == PCAP_MAGIC_NSEC);
+   f->linktype = linktype_to_dlt(get32(f, f->map + 20));
+   f->pos = f->map + PCAP_FILE_HDR;
+   return f;
+}
+
+void pcapfile_close(struct pcapfile *f) {
+   munmap((void *)f->map, f->len);
+   free(f->ifs);
+   free(f);
+}
+
+static int next_pcap(struct pcapfile *f,
+                     struct pcap_pkthdr *pheader,
+                     const u_char **pdata,
+                     int *linktype) {
+   const uint8_t *p = f->pos;
+   uint32_t frac;
+
+   if (p == f->end)
+      return 0;
+   if (f->end - p < PCAP_REC_HDR)
+      corrupt(f, p);
+   pheader->ts.tv_sec = get32(f, p);
+   frac = get32(f, p + 4);
+   pheader->ts.tv_usec = f->nsec ? frac / 1000 : frac;
+   pheader->caplen = get32(f, p + 8);
+   pheader->len = get32(f, p + 12);
+   if (pheader->caplen > (size_t)(f->end - p - PCAP_REC_HDR))
+      corrupt(f, p);
+   *pdata = p + PCAP_REC_HDR;
+   *linktype = f->linktype;
+   f->pos = p + PCAP_REC_HDR + pheader->caplen;
+   return 1;
+}
+
+/* Interface Description Block. */
+static void add_if(struct pcapfile *f, const uint8_t *body, const uint8_t *end) {
+   struct pcapfile_if *i;
+   const uint8_t *opt;
+
+   if (end - body < 8)
+      corrupt(f, body);
+   f->ifs = xrealloc(f->ifs, (f->num_ifs + 1) * sizeof(*f->ifs));
+   i = &f->ifs[f->num_ifs++];
+   i->linktype = linktype_to_dlt(get16(f, body));
+   i->units = 1000000;
+   i->offset = 0;
+
+   for (opt = body + 8; end - opt >= 4; ) {
+      uint16_t code = get16(f, opt), len = get16(f, opt + 2);
+      const uint8_t *val = opt + 4;
+
+      if (code == PCAPNG_OPT_ENDOFOPT)
+         break;
+      if (len > end - val)
+         corrupt(f, opt);
+      if ((code == PCAPNG_IF_TSRESOL) && (len >= 1)) {
+         unsigned int exp = val[0] & 0x7f;
+
+         if (val[0] & 0x80) {
+            if (exp > 63)
+               corrupt(f, opt);
+            i->units = (uint64_t)1 << exp;
+         } else {
+            if (exp > 19)
+               corrupt(f, opt);
+            for (i->units = 1; exp > 0; exp--)
+               i->units *= 10;
+         }
+      } else if ((code == PCAPNG_IF_TSOFFSET) && (len >= 8))
+         i->offset = (int64_t)get64(f, val);
+      opt = val + ((len + 3) & ~3);
+   }
+}
+
+static void ng_packet(struct pcapfile *f,
+                      const uint8_t *block,
+                      const uint32_t ifid,
+                      const uint64_t ts,
+                      struct pcap_pkthdr *pheader,
+                      int *linktype) {
+   const struct pcapfile_if *i;
+   uint64_t frac;
+
+   if (ifid >= f->num_ifs)
+      corrupt(f, block); /* no IDB for it */
+   i = &f->ifs[ifid];
+   frac = ts % i->units;
+   pheader->ts.tv_sec = (time_t)((int64_t)(ts / i->units) + i->offset);
+   if (i->units >= 1000000)
+      pheader->ts.tv_usec = (suseconds_t)(frac / (i->units / 1000000));
+   else
+      pheader->ts.tv_usec = (suseconds_t)(frac * 1000000 / i->units);
+   *linktype = i->linktype;
+}
+
+static int next_pcapng(struct pcapfile *f,
+                       struct pcap_pkthdr *pheader,
+                       const u_char **pdata,
+                       int *linktype) {
+   for (;;) {
+      const uint8_t *p = f->pos, *body, *end;
+      uint32_t type, blen, ifid;
+      uint64_t ts;
+
+      if (p == f->end)
+         return 0;
+      if (f->end - p < PCAPNG_BLK_HDR + 4)
+         corrupt(f, p);
+      type = get32(f, p);
+      if (type == PCAPNG_SHB) {
+         /* A new section, maybe in the other byte order. */
+         uint32_t bom;
+
+         memcpy(&bom, p + 8, sizeof(bom));
+         if (bom == PCAPNG_BOM)
+            f->swapped = 0;
+         else if (swap32(bom) == PCAPNG_BOM)
+            f->swapped = 1;
+         else
+            corrupt(f, p);
+         f->num_ifs = 0;
+      }
+      blen = get32(f, p + 4);
+      if ((blen < PCAPNG_BLK_HDR) || (blen % 4 != 0) ||
+          (blen > (size_t)(f->end - p)))
+         corrupt(f, p);
+      f->pos = p + blen;
+      body = p + 8;
+      end = p + blen - 4;
+
+      switch (type) {
+      case PCAPNG_IDB:
+         add_if(f, body, end);
+         break;
+
+      case PCAPNG_EPB:
+      case PCAPNG_PB:
+         if (end - body < 20)
+            corrupt(f, p);
+         if (type == PCAPNG_EPB)
+            ifid = get32(f, body);
+         else
+            ifid = get16(f, body);
+         ts = ((uint64_t)get32(f, body + 4) << 32) | get32(f, body + 8);
+         pheader->caplen = get32(f, body + 12);
+         pheader->len = get32(f, body + 16);
+         if (pheader->caplen > (size_t)(end - body - 20))
+            corrupt(f, p);
+         ng_packet(f, p, ifid, ts, pheader, linktype);
+         *pdata = body + 20;
+         return 1;
+
+      case PCAPNG_SPB:
+         /* No timestamp, and the capture length is implied. */
+         if (end - body < 4)
+            corrupt(f, p);
+         pheader->len = get32(f, body);
+         pheader->caplen = MIN(pheader->len, (size_t)(end - body - 4));
+         ng_packet(f, p, 0, 0, pheader, linktype);
+         *pdata = body + 4;
+         return 1;
+
+      default:
+         break; /* skip statistics, name resolution, etc. */
+      }
+   }
+}
+
+int pcapfile_next(struct pcapfile *f,
+                  struct pcap_pkthdr *pheader,
+                  const u_char **pdata,
+                  int *linktype) {
+   if (f->pcapng)
+      return next_pcapng(f, pheader, pdata, linktype);
+   return next_pcap(f, pheader, pdata, linktype);
+}
+
+int pcapfile_splittable(const struct pcapfile *f) {
+   return !f->pcapng;
+}
+
+off_t pcapfile_tell(const struct pcapfile *f) {
+   return (off_t)(f->pos - f->map);
+}
+
+void pcapfile_seek(struct pcapfile *f, const off_t offset) {
+   assert(!f->pcapng);
+   assert((offset >= PCAP_FILE_HDR) && ((size_t)offset <= f->len));
+   f->pos = f->map + offset;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
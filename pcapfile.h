@@ -0,0 +1,40 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * pcapfile.h: memory-mapped reader for pcap and pcapng capture files.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_PCAPFILE_H
+#define __DARKSTAT_PCAPFILE_H
+
+#include <sys/types.h>
+
+struct pcap_pkthdr; /* from pcap.h */
+struct pcapfile;
+
+/* Map the file.  Returns NULL if it's not in a format we know or can't be
+ * mapped, so the caller can fall back to libpcap.
+ */
+struct pcapfile *pcapfile_open(const char *name);
+void pcapfile_close(struct pcapfile *f);
+
+/* Fills in the header and points *pdata into the mapping, and sets the
+ * packet's DLT_ linktype, which can change from packet to packet in pcapng.
+ * Returns 0 at the end of the file, dies if it's corrupt.
+ */
+int pcapfile_next(struct pcapfile *f,
+                  struct pcap_pkthdr *pheader,
+                  const u_char **pdata,
+                  int *linktype);
+
+/* Only classic pcap files can be split: records don't depend on the blocks
+ * before them.
+ */
+int pcapfile_splittable(const struct pcapfile *f);
+off_t pcapfile_tell(const struct pcapfile *f);
+void pcapfile_seek(struct pcapfile *f, const off_t offset);
+
+#endif /* __DARKSTAT_PCAPFILE_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,121 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * pktring.c: lock-free ring of packet summaries, from the capture thread
+ * to the accounting thread.
+ *
+ * A classic single-producer, single-consumer ring: the producer only writes
+ * head, the consumer only writes tail, and each publishes with a release
+ * store that the other side reads with an acquire load.  The counters are
+ * free-running and the size is a power of two, so (head - tail) is always
+ * the number of entries in use, even across wraparound.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "conv.h"
+#include "decode.h"
+#include "err.h"
+#include "pktring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+struct pktring_entry {
+   struct pktsummary sm;
+   const struct local_ips *local_ips;
+};
+
+struct pktring {
+   struct pktring_entry *entries;
+   uint32_t size, mask;
+
+   /* Written by the producer. */
+   char pad0[CACHE_LINE];
+   uint32_t head;
+   uint32_t high_water;
+   uint64_t overflows;
+
+   /* Written by the consumer. */
+   char pad1[CACHE_LINE];
+   uint32_t tail;
+   char pad2[CACHE_LINE];
+};
+
+struct pktring *pktring_make(const unsigned int size) {
+   struct pktring *r = xcalloc(1, sizeof(*r));
+
+   r->size = 1;
+   while (r->size < size) {
+      r->size <<= 1;
+      if (r->size == 0)
+         errx(1, "pktring size %u is too large", size);
+   }
+   r->mask = r->size - 1;
+   r->entries = xcalloc(r->size, sizeof(*r->entries));
+   return r;
+}
+
+void pktring_free(struct pktring *r) {
+   free(r->entries);
+   free(r);
+}
+
+int pktring_push(struct pktring *r,
+                 const struct pktsummary *sm,
+                 const struct local_ips *local_ips) {
+   uint32_t head = r->head; /* only we write it */
+   uint32_t used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   struct pktring_entry *e;
+
+   if (used == r->size) {
+      __atomic_store_n(&r->overflows, r->overflows + 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+   if (used + 1 > r->high_water)
+      __atomic_store_n(&r->high_water, used + 1, __ATOMIC_RELAXED);
+
+   e = &r->entries[head & r->mask];
+   memcpy(&e->sm, sm, sizeof(e->sm));
+   e->local_ips = local_ips;
+   __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+int pktring_pop(struct pktring *r,
+                struct pktsummary *sm,
+                const struct local_ips **local_ips) {
+   uint32_t tail = r->tail; /* only we write it */
+   const struct pktring_entry *e;
+
+   if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+      return 0;
+   e = &r->entries[tail & r->mask];
+   memcpy(sm, &e->sm, sizeof(*sm));
+   *local_ips = e->local_ips;
+   __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+unsigned int pktring_size(const struct pktring *r) {
+   return r->size;
+}
+
+unsigned int pktring_used(const struct pktring *r) {
+   /* Load tail first: head can only move further ahead of it. */
+   uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+unsigned int pktring_high_water(const struct pktring *r) {
+   return __atomic_load_n(&r->high_water, __ATOMIC_RELAXED);
+}
+
+uint64_t pktring_overflows(const struct pktring *r) {
+   return __atomic_load_n(&r->overflows, __ATOMIC_RELAXED);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,42 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * pktring.h: lock-free ring of packet summaries, from the capture thread
+ * to the accounting thread.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_PKTRING_H
+#define __DARKSTAT_PKTRING_H
+
+#include <stdint.h>
+
+struct pktsummary;
+struct local_ips;
+struct pktring;
+
+/* Size is rounded up to a power of two. */
+struct pktring *pktring_make(const unsigned int size);
+void pktring_free(struct pktring *r);
+
+/* Only ever called from one producer thread.  Returns 0 and counts an
+ * overflow if the ring is full.
+ */
+int pktring_push(struct pktring *r,
+                 const struct pktsummary *sm,
+                 const struct local_ips *local_ips);
+
+/* Only ever called from one consumer thread.  Returns 0 if empty. */
+int pktring_pop(struct pktring *r,
+                struct pktsummary *sm,
+                const struct local_ips **local_ips);
+
+/* Callable from either side. */
+unsigned int pktring_size(const struct pktring *r);
+unsigned int pktring_used(const struct pktring *r);
+unsigned int pktring_high_water(const struct pktring *r);
+uint64_t pktring_overflows(const struct pktring *r);
+
+#endif /* __DARKSTAT_PKTRING_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
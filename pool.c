@@ -0,0 +1,131 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * pool.c: slab allocator for fixed-size objects.
+ *
+ * Objects are carved out of big slabs, and ones that are given back go on a
+ * free list for the next pool_get().  Slabs are only returned to malloc by
+ * pool_free(), so a table that's constantly being filled and reduced reuses
+ * the same memory instead of churning the heap one object at a time.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "cdefs.h"
+#include "conv.h"
+#include "err.h"
+#include "pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_BYTES 65536
+#define SLAB_HDR 16 /* keeps objects as aligned as malloc() would */
+
+struct slab {
+   struct slab *next;
+   /* followed by objects, from SLAB_HDR bytes in */
+};
+
+struct pool {
+   const char *name;
+   size_t size, per_slab;
+   struct slab *slabs;  /* in the order they were made */
+   struct slab *cur;    /* carving objects out of this one */
+   size_t next;         /* index of the next never-used object in cur */
+   void *free_list;     /* linked through the first word of each object */
+   uint64_t in_use, num_slabs;
+};
+
+struct pool *
+pool_make(const char *name, const size_t size)
+{
+   struct pool *p = xcalloc(1, sizeof(*p));
+
+   assert(sizeof(struct slab) <= SLAB_HDR);
+   p->name = name;
+   /* Room for the free list link, and keep the next object aligned. */
+   p->size = MAX(size, sizeof(void *));
+   p->size = (p->size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+   p->per_slab = (SLAB_BYTES - SLAB_HDR) / p->size;
+   assert(p->per_slab > 0);
+   return p;
+}
+
+void
+pool_free(struct pool *p)
+{
+   while (p->slabs != NULL) {
+      struct slab *s = p->slabs;
+
+      p->slabs = s->next;
+      free(s);
+   }
+   free(p);
+}
+
+void *
+pool_get(struct pool *p)
+{
+   void *obj;
+
+   if (p->free_list != NULL) {
+      obj = p->free_list;
+      memcpy(&p->free_list, obj, sizeof(p->free_list));
+   } else {
+      if ((p->cur == NULL) || (p->next == p->per_slab)) {
+         /* After pool_empty(), there are slabs to go back through. */
+         struct slab *s = (p->cur == NULL) ? p->slabs : p->cur->next;
+
+         if (s == NULL) {
+            s = xmalloc(SLAB_BYTES);
+            s->next = NULL;
+            if (p->cur == NULL)
+               p->slabs = s;
+            else
+               p->cur->next = s;
+            p->num_slabs++;
+         }
+         p->cur = s;
+         p->next = 0;
+      }
+      obj = (char *)p->cur + SLAB_HDR + p->next * p->size;
+      p->next++;
+   }
+   p->in_use++;
+   memset(obj, 0, p->size);
+   return obj;
+}
+
+void
+pool_put(struct pool *p, void *obj)
+{
+   assert(p->in_use > 0);
+   memcpy(obj, &p->free_list, sizeof(p->free_list));
+   p->free_list = obj;
+   p->in_use--;
+}
+
+void
+pool_empty(struct pool *p)
+{
+   p->cur = NULL;
+   p->next = 0;
+   p->free_list = NULL;
+   p->in_use = 0;
+}
+
+void
+pool_stats(const struct pool *p, struct pool_stats *st)
+{
+   st->name = p->name;
+   st->size = p->size;
+   st->in_use = p->in_use;
+   st->capacity = p->num_slabs * p->per_slab;
+   st->slabs = p->num_slabs;
+   st->bytes = p->num_slabs * SLAB_BYTES;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
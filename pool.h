@@ -0,0 +1,37 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * pool.h: slab allocator for fixed-size objects.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_POOL_H
+#define __DARKSTAT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool;
+
+struct pool *pool_make(const char *name, const size_t size);
+void pool_free(struct pool *p);
+
+/* Returns a zeroed object. */
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+/* Take back every object at once, keeping the slabs for reuse. */
+void pool_empty(struct pool *p);
+
+struct pool_stats {
+   const char *name;
+   size_t size;         /* of each object */
+   uint64_t in_use;     /* objects handed out */
+   uint64_t capacity;   /* objects the slabs can hold */
+   uint64_t slabs, bytes;
+};
+void pool_stats(const struct pool *p, struct pool_stats *st);
+
+#endif /* __DARKSTAT_POOL_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
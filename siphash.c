@@ -0,0 +1,112 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * siphash.c: SipHash-1-3, a keyed hash for short inputs.
+ *
+ * This is SipHash by Jean-Philippe Aumasson and Daniel J. Bernstein, with
+ * one compression round per word and three finalization rounds.  With a
+ * secret key, someone who can only choose the input can't choose what it
+ * hashes to, so they can't make lots of keys land in the same place.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "config.h"
+#include "err.h"
+#include "siphash.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_RANDOM_H
+# include <sys/random.h>
+#endif
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+   v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+   v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+   v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+   v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
+
+uint64_t
+siphash13(const struct siphash_key *key, const void *data, const size_t len)
+{
+   const uint8_t *in = data;
+   uint64_t v0 = key->k0 ^ 0x736f6d6570736575ULL;
+   uint64_t v1 = key->k1 ^ 0x646f72616e646f6dULL;
+   uint64_t v2 = key->k0 ^ 0x6c7967656e657261ULL;
+   uint64_t v3 = key->k1 ^ 0x7465646279746573ULL;
+   uint64_t m;
+   size_t i, left;
+
+   for (i = 0; i + 8 <= len; i += 8) {
+      int j;
+
+      /* Words are little-endian, whatever the host is. */
+      for (m = 0, j = 7; j >= 0; j--)
+         m = (m << 8) | in[i + j];
+      v3 ^= m;
+      SIPROUND;
+      v0 ^= m;
+   }
+
+   /* The last word has the length in its top byte. */
+   m = (uint64_t)len << 56;
+   for (left = len - i; left > 0; left--)
+      m |= (uint64_t)in[i + left - 1] << (8 * (left - 1));
+   v3 ^= m;
+   SIPROUND;
+   v0 ^= m;
+
+   v2 ^= 0xff;
+   SIPROUND;
+   SIPROUND;
+   SIPROUND;
+   return (v0 ^ v1 ^ v2 ^ v3);
+}
+
+/* Try the kernel's random numbers.  Returns 0 if we can't get any. */
+static int
+get_random(void *buf, const size_t len)
+{
+#if defined(HAVE_ARC4RANDOM_BUF)
+   arc4random_buf(buf, len);
+   return (1);
+#else
+   int fd;
+   ssize_t got;
+
+# ifdef HAVE_GETENTROPY
+   if (getentropy(buf, len) == 0)
+      return (1);
+# endif
+   /* Not there if we're chrooted, but worth a try. */
+   fd = open("/dev/urandom", O_RDONLY);
+   if (fd == -1)
+      return (0);
+   got = read(fd, buf, len);
+   close(fd);
+   return (got == (ssize_t)len);
+#endif
+}
+
+void
+siphash_keygen(struct siphash_key *key)
+{
+   struct timeval tv;
+
+   if (get_random(key, sizeof(*key)))
+      return;
+   warnx("no random numbers to key the hash with, using the time instead");
+   gettimeofday(&tv, NULL);
+   key->k0 = ((uint64_t)tv.tv_sec << 20) ^ (uint64_t)tv.tv_usec;
+   key->k1 = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)key;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
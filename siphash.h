@@ -0,0 +1,26 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * siphash.h: SipHash-1-3, a keyed hash for short inputs.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_SIPHASH_H
+#define __DARKSTAT_SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct siphash_key {
+   uint64_t k0, k1;
+};
+
+/* Fill in a key that can't be guessed from outside the process. */
+void siphash_keygen(struct siphash_key *key);
+
+uint64_t siphash13(const struct siphash_key *key, const void *data,
+   const size_t len);
+
+#endif /* __DARKSTAT_SIPHASH_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -5,6 +5,7 @@ int
 main(int argc, char **argv)
 {
 	int c, eol;
+	unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
 	if (argc != 2) {
 		fprintf(stderr, "usage: %s name <infile >outfile.h\n",
 			argv[0]);
@@ -14,6 +15,7 @@ main(int argc, char **argv)
 	       "static char %s[] =", argv[1]);
 	eol = 1;
 	while ((c = getchar()) != EOF) {
+		hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
 		if (eol) {
 			printf("\n\"");
 			eol = 0;
@@ -22,11 +24,22 @@ main(int argc, char **argv)
 		case '\n': printf("\\n\""); eol = 1; break;
 		case '"': printf("\\\""); break;
 		case '\\': printf("\\\\"); break;
-		default: putchar(c);
+		case '?': printf("\\?"); break; /* no trigraphs */
+		default:
+			/* Octal is always three digits, so whatever comes next
+			 * can't run on into it.  This is for gzipped input.
+			 */
+			if (c < ' ' || c > '~')
+				printf("\\%03o", c);
+			else
+				putchar(c);
 		}
 	}
+	if (!eol)
+		printf("\"");
 	printf(";\n"
-	       "static const size_t %s_len = sizeof(%s) - 1;\n",
-	       argv[1], argv[1]);
+	       "static const size_t %s_len = sizeof(%s) - 1;\n"
+	       "static const char %s_etag[] = \"\\\"%016llx\\\"\";\n",
+	       argv[1], argv[1], argv[1], hash);
 	return (0);
 }
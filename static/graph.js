@@ -19,6 +19,8 @@
  *
  *  - graphs [ {id, name, title, bar_secs} ]
  *  - graphs_uri
+ *  - graphs_events_uri (optional: automatic reload uses it if the browser
+ *    has EventSource, instead of polling graphs_uri)
  *
  *  - window.onload = graphs_init
  */
@@ -84,7 +86,23 @@ function kbps(bps) {
 function min(a,b) { return (a<b)?a:b; }
 function max(a,b) { return (a>b)?a:b; }
 
-var xh, autoreload=false;
+// same as length_of_time() in str.c
+function lengthOfTime(t) {
+ var secs = t % 60,
+     mins = Math.floor(t / 60) % 60,
+     hours = Math.floor(t / 3600) % 24,
+     days = Math.floor(t / 86400);
+ var out = [];
+ if (days > 0) out.push(days + ((days == 1) ? " day" : " days"));
+ if (out.length > 0 || hours > 0)
+  out.push(hours + ((hours == 1) ? " hr" : " hrs"));
+ if (out.length > 0 || mins > 0)
+  out.push(mins + ((mins == 1) ? " min" : " mins"));
+ out.push(secs + ((secs == 1) ? " sec" : " secs"));
+ return out.join(", ");
+}
+
+var xh, autoreload=false, events=null, events_started=null;
 
 function graphs_init() {
  var gr = document.getElementById("graphs");
@@ -166,7 +184,83 @@ function graph_autoreload() {
  autoreload = !autoreload;
  document.getElementById("graph_autoreload").innerHTML =
   autoreload ? "on" : "off";
- if (autoreload) reload_loop();
+ if (autoreload) {
+  if (window.EventSource && typeof(graphs_events_uri) != "undefined")
+   events_start();
+  else
+   reload_loop();
+ } else if (events) {
+  events.close();
+  events = null;
+ }
+}
+
+/* The server sends everything once, then only the bars that changed, as
+ * often as the graphs move on.  EventSource reconnects by itself, and gets
+ * everything again when it does.
+ */
+function events_start() {
+ events_started = null;
+ events = new EventSource(graphs_events_uri);
+ events.addEventListener("graphs", function(e) {
+  events_all(JSON.parse(e.data));
+ }, false);
+ events.addEventListener("bars", function(e) {
+  events_bars(JSON.parse(e.data));
+ }, false);
+}
+
+function events_all(d) {
+ for (var i=0; i<graphs.length; i++) {
+  var g = graphs[i], bars = d[g.name].bars;
+  g.offset = bars[0].pos;
+  g.vals = [];
+  for (var j=0; j<bars.length; j++) {
+   g.offset = min(g.offset, bars[j].pos);
+   g.vals[bars[j].pos] = [bars[j]["in"], bars[j].out];
+  }
+  g.cur = bars[bars.length - 1].pos;
+  events_draw(g);
+ }
+ events_started = d.started;
+ events_totals(d);
+ killChildren(graphs.msg);
+}
+
+function events_bars(d) {
+ if (events_started == null) return; /* haven't had everything yet */
+ for (var i=0; i<graphs.length; i++) {
+  var g = graphs[i], bars = d[g.name];
+  if (!bars) continue;
+  for (var j=0; j<bars.length; j++) {
+   g.vals[bars[j][0]] = [bars[j][1], bars[j][2]];
+   g.cur = bars[j][0];
+  }
+  events_draw(g);
+ }
+ events_totals(d);
+}
+
+/* Oldest bar first, same as graphs_uri has them. */
+function events_draw(g) {
+ var n = g.vals.length - g.offset, data = [];
+ for (var k=1; k<=n; k++) {
+  var p = g.offset + (g.cur - g.offset + k) % n;
+  data.push( [p, g.vals[p][0], g.vals[p][1]] );
+ }
+ buildGraph(g.graph, g.title, g.bar_secs, data);
+}
+
+function events_totals(d) {
+ var names = {"tb":"bytes", "tp":"packets", "pc":"pcap_received",
+  "pd":"pcap_dropped", "ru":"ring_used", "rp":"ring_peak",
+  "ro":"ring_overflows"};
+ for (var n in names) {
+  var e = document.getElementById(n);
+  if (e && d[names[n]] != undefined) e.innerHTML = thousands(d[names[n]]);
+ }
+ document.getElementById("rf").innerHTML =
+  lengthOfTime(d.now - events_started);
 }
 
 function reload_loop() {
@@ -187,14 +281,22 @@ function poll() {
   for (var i=0; i<graphs.length; i++)
   {
    g = xh.responseXML.getElementsByTagName(graphs[i].name);
-   buildGraph(graphs[i].graph, graphs[i].title, graphs[i].bar_secs,
-    g[0].getElementsByTagName("e"));
+   var elems = g[0].getElementsByTagName("e"), data = [];
+   for (var j=0; j<elems.length; j++) {
+    var elem = elems.item(j);
+    data.push( [Number( elem.getAttribute("p") ),
+                Number( elem.getAttribute("i") ),
+                Number( elem.getAttribute("o") )] );
+   }
+   buildGraph(graphs[i].graph, graphs[i].title, graphs[i].bar_secs, data);
   }
   document.getElementById("graph_reload").innerHTML = "reload graphs";
   killChildren(graphs.msg);
   head = xh.responseXML.childNodes[0];
-  for (var n in {"tb":0, "tp":0, "pc":0, "pd":0})
-   document.getElementById(n).innerHTML = thousands(head.getAttribute(n));
+  for (var n in {"tb":0, "tp":0, "pc":0, "pd":0, "ru":0, "rp":0, "ro":0}) {
+   var e = document.getElementById(n);
+   if (e) e.innerHTML = thousands(head.getAttribute(n));
+  }
   document.getElementById("rf").innerHTML = head.getAttribute("rf");
  }
 }
@@ -212,19 +314,14 @@ function addBar(graph, title, barclass, width, height, left, bottom) {
  graph.appendChild(bar);
 }
 
-function buildGraph(graph, title, bar_secs, elems) {
+/* data is a list of [pos, in, out], oldest first */
+function buildGraph(graph, title, bar_secs, data) {
  var total_max = 0;
- var data = []; /* list of [in, out] */
- for (var i=0; i<elems.length; i++) {
-   var elem = elems.item(i);
-   var b_pos = Number( elem.getAttribute("p") );
-   var b_in = Number( elem.getAttribute("i") );
-   var b_out = Number( elem.getAttribute("o") );
-   var b_total = b_in + b_out;
+ for (var i=0; i<data.length; i++) {
+   var b_total = data[i][1] + data[i][2];
 /* FIXME: what happens when a bar's value is >4G? */
    if (b_total > total_max)
     total_max = b_total;
-   data.push( [b_pos, b_in, b_out] );
  }
 
  graph_width = getParameterByName('w',graph_width);
@@ -65,6 +65,8 @@ int main()
 {
    test("0.0.0.0", "0.0.0.0", 0);
    test("192.168.1.2", "192.168.1.2", 0);
+   test("10.0.100.255", "10.0.100.255", 0);
+   test("255.255.255.255", "255.255.255.255", 0);
 
    test("::", "::", 0);
    test("::0", "::", 0);
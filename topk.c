@@ -0,0 +1,207 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * topk.c: the biggest few hosts in each sort order, kept up to date as
+ * their counters go up.
+ *
+ * Each one is a min-heap of up to k hosts, so the smallest of them is on
+ * top, ready to be pushed out when another host gets bigger.  Counters only
+ * ever go up, so the heap always holds the top n hosts.  When a host in the
+ * heap goes away, the heap doesn't know who should take its place, so it
+ * shrinks: the floor remembers the biggest host that was left out, and only
+ * a host that climbs past it gets back in.  Make k bigger than you need, and
+ * rebuild from the whole table once it has shrunk too far.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "conv.h"
+#include "err.h"
+#include "topk.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct topk {
+   enum sort_dir dir;
+   unsigned int k, n;
+   int valid;
+   uint64_t floor; /* no host outside the heap is bigger than this */
+   struct bucket **heap;
+};
+
+static uint64_t
+value(const struct topk *t, const struct bucket *b)
+{
+   switch (t->dir) {
+   case IN:       return (b->in);
+   case OUT:      return (b->out);
+   case TOTAL:    return (b->total);
+   case LASTSEEN: return ((uint64_t)b->u.host.last_seen_mono);
+   default:
+      errx(1, "topk: unknown direction: %d", t->dir);
+   }
+}
+
+/* Each host remembers where it is in each heap, plus one, so that a zeroed
+ * host isn't in any of them.
+ */
+#define POS(t, b) ((b)->u.host.topk_pos[(t)->dir])
+
+static void
+put(struct topk *t, const unsigned int i, struct bucket *b)
+{
+   t->heap[i] = b;
+   POS(t, b) = (uint16_t)(i + 1);
+}
+
+static void
+sift_up(struct topk *t, unsigned int i)
+{
+   struct bucket *b = t->heap[i];
+   const uint64_t v = value(t, b);
+
+   while (i > 0) {
+      const unsigned int parent = (i - 1) / 2;
+
+      if (value(t, t->heap[parent]) <= v)
+         break;
+      put(t, i, t->heap[parent]);
+      i = parent;
+   }
+   put(t, i, b);
+}
+
+static void
+sift_down(struct topk *t, unsigned int i)
+{
+   struct bucket *b = t->heap[i];
+   const uint64_t v = value(t, b);
+
+   for (;;) {
+      unsigned int child = 2 * i + 1;
+
+      if (child >= t->n)
+         break;
+      if ((child + 1 < t->n) &&
+          (value(t, t->heap[child + 1]) < value(t, t->heap[child])))
+         child++;
+      if (v <= value(t, t->heap[child]))
+         break;
+      put(t, i, t->heap[child]);
+      i = child;
+   }
+   put(t, i, b);
+}
+
+struct topk *
+topk_make(const enum sort_dir dir, const unsigned int k)
+{
+   struct topk *t = xmalloc(sizeof(*t));
+
+   assert(k > 0);
+   assert(k < 65535); /* topk_pos */
+   t->dir = dir;
+   t->k = k;
+   t->n = 0;
+   t->valid = 1;
+   t->floor = 0;
+   t->heap = xcalloc(k, sizeof(*t->heap));
+   return (t);
+}
+
+void
+topk_free(struct topk *t)
+{
+   free(t->heap);
+   free(t);
+}
+
+void
+topk_clear(struct topk *t)
+{
+   unsigned int i;
+
+   for (i=0; i<t->n; i++)
+      POS(t, t->heap[i]) = 0;
+   t->n = 0;
+   t->valid = 1;
+   t->floor = 0;
+}
+
+void
+topk_invalidate(struct topk *t)
+{
+   t->valid = 0;
+}
+
+static void
+raise_floor(struct topk *t, const uint64_t v)
+{
+   if (t->floor < v)
+      t->floor = v;
+}
+
+void
+topk_update(struct topk *t, struct bucket *b)
+{
+   uint64_t v;
+
+   if (!t->valid)
+      return;
+   if (POS(t, b) != 0) {
+      sift_down(t, POS(t, b) - 1u); /* only got bigger */
+      return;
+   }
+   v = value(t, b);
+   if (t->n < t->k) {
+      if (v < t->floor)
+         return; /* someone left out might be bigger */
+      t->n++;
+      put(t, t->n - 1, b);
+      sift_up(t, t->n - 1);
+   } else if (v > value(t, t->heap[0])) {
+      raise_floor(t, value(t, t->heap[0]));
+      POS(t, t->heap[0]) = 0;
+      put(t, 0, b);
+      sift_down(t, 0);
+   } else
+      raise_floor(t, v);
+}
+
+void
+topk_remove(struct topk *t, struct bucket *b)
+{
+   unsigned int i;
+
+   if (POS(t, b) == 0)
+      return;
+   i = POS(t, b) - 1u;
+   POS(t, b) = 0;
+   t->n--;
+   if (i < t->n) {
+      struct bucket *last = t->heap[t->n];
+
+      put(t, i, last);
+      sift_down(t, i);
+      sift_up(t, POS(t, last) - 1u);
+   }
+}
+
+int
+topk_count(const struct topk *t)
+{
+   return (t->valid ? (int)t->n : -1);
+}
+
+unsigned int
+topk_sorted(const struct topk *t, const struct bucket **out)
+{
+   memcpy(out, t->heap, t->n * sizeof(*out));
+   qsort_buckets(out, t->n, 0, t->n, t->dir);
+   return (t->n);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,40 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * topk.h: the biggest few hosts in each sort order.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_TOPK_H
+#define __DARKSTAT_TOPK_H
+
+#include "hosts_db.h"
+
+struct topk;
+
+struct topk *topk_make(const enum sort_dir dir, const unsigned int k);
+void topk_free(struct topk *t);
+
+/* Forget every host, ready to be filled with topk_update(). */
+void topk_clear(struct topk *t);
+
+/* Stop keeping up, until the next topk_clear(). */
+void topk_invalidate(struct topk *t);
+
+/* Call when a host is added, or its counters go up. */
+void topk_update(struct topk *t, struct bucket *b);
+
+/* Call before a host goes away.  The heap gets one smaller. */
+void topk_remove(struct topk *t, struct bucket *b);
+
+/* Returns how many hosts it holds, or -1 if it's not keeping up. */
+int topk_count(const struct topk *t);
+
+/* Copy the hosts, biggest first, into out (room for k).  Returns how
+ * many.
+ */
+unsigned int topk_sorted(const struct topk *t, const struct bucket **out);
+
+#endif /* __DARKSTAT_TOPK_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,296 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * tpacket.c: native Linux capture using a TPACKET_V3 memory-mapped ring.
+ *
+ * The kernel fills fixed-size blocks of frames and hands a whole block to
+ * us once it is full or its retire timeout expires.  We walk the frames in
+ * place, passing pointers into the ring straight to the decoders, then give
+ * the block back.  No copies and no syscalls per packet.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "config.h"
+
+#ifdef HAVE_TPACKET_V3
+
+#include "conv.h"
+#include "err.h"
+#include "opt.h"
+#include "tpacket.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h> /* for htons() */
+#include <linux/filter.h> /* for struct sock_fprog */
+#include <linux/if_packet.h>
+#include <net/ethernet.h> /* for ETH_P_ALL */
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <pcap.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Frames never straddle blocks in V3; the frame size only matters to the
+ * kernel's sanity checks on the ring geometry.
+ */
+#define TPACKET_FRAME_SIZE 2048
+
+struct tpacket_ring {
+   int fd;
+   int linktype;
+   const char *ifname;
+   uint8_t *map;
+   size_t map_len;
+   unsigned int block_size, num_blocks, cur;
+   unsigned int pkts_recv, pkts_drop; /* accumulated from the kernel */
+};
+
+static void tpacket_set_prog(struct tpacket_ring *ring,
+                             const struct bpf_program *prog) {
+   struct sock_fprog fprog;
+
+   /* struct bpf_insn and struct sock_filter have the same layout. */
+   fprog.len = (unsigned short)prog->bf_len;
+   fprog.filter = (struct sock_filter *)prog->bf_insns;
+   if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                  &fprog, sizeof(fprog)) == -1)
+      err(1, "setsockopt(SO_ATTACH_FILTER) on '%s'", ring->ifname);
+}
+
+/* A program that accepts every packet, truncated to snaplen, or drops
+ * everything if snaplen is zero.
+ */
+static void attach_ret(struct tpacket_ring *ring, const unsigned int snaplen) {
+   struct bpf_insn insn[] = { BPF_STMT(BPF_RET+BPF_K, 0) };
+   struct bpf_program prog;
+
+   insn[0].k = snaplen;
+   prog.bf_len = 1;
+   prog.bf_insns = insn;
+   tpacket_set_prog(ring, &prog);
+}
+
+static int arphrd_to_dlt(const int arphrd) {
+   switch (arphrd) {
+   case ARPHRD_ETHER:
+   case ARPHRD_LOOPBACK: /* loopback frames carry a fake ethernet header */
+      return DLT_EN10MB;
+   default:
+      return -1;
+   }
+}
+
+struct tpacket_ring *tpacket_open(const char *ifname,
+                                  const int promisc,
+                                  int *linktype) {
+   struct tpacket_ring *ring;
+   struct tpacket_req3 req;
+   struct sockaddr_ll sll;
+   struct ifreq ifr;
+   long pagesize;
+   int ver = TPACKET_V3;
+
+   pagesize = sysconf(_SC_PAGESIZE);
+   if ((opt_tpacket_block_size == 0) ||
+       (opt_tpacket_block_size % pagesize != 0))
+      errx(1, "--tpacket-block-size must be a multiple of the page size "
+              "(%ld bytes)", pagesize);
+   if (opt_tpacket_block_size % TPACKET_FRAME_SIZE != 0)
+      errx(1, "--tpacket-block-size must be a multiple of the frame size "
+              "(%d bytes)", TPACKET_FRAME_SIZE);
+   if (opt_tpacket_blocks == 0)
+      errx(1, "--tpacket-blocks must be at least one");
+
+   ring = xmalloc(sizeof(*ring));
+   ring->ifname = ifname;
+   ring->block_size = opt_tpacket_block_size;
+   ring->num_blocks = opt_tpacket_blocks;
+   ring->cur = 0;
+   ring->pkts_recv = ring->pkts_drop = 0;
+
+   /* Protocol 0 receives nothing until bind() gives it ETH_P_ALL, by
+    * which time it's on the right interface and dropping everything.
+    */
+   ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+   if (ring->fd == -1)
+      err(1, "socket(AF_PACKET) for '%s'", ifname);
+
+   /* Work out the interface index and linktype. */
+   memset(&ifr, 0, sizeof(ifr));
+   if (strlen(ifname) >= sizeof(ifr.ifr_name))
+      errx(1, "interface name '%s' is too long", ifname);
+   strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+   if (ioctl(ring->fd, SIOCGIFINDEX, &ifr) == -1)
+      err(1, "ioctl(SIOCGIFINDEX) on '%s'", ifname);
+   memset(&sll, 0, sizeof(sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons(ETH_P_ALL);
+   sll.sll_ifindex = ifr.ifr_ifindex;
+
+   if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) == -1)
+      err(1, "ioctl(SIOCGIFHWADDR) on '%s'", ifname);
+   ring->linktype = arphrd_to_dlt(ifr.ifr_hwaddr.sa_family);
+   if (ring->linktype == -1)
+      errx(1, "can't use a TPACKET_V3 ring on '%s' (ARPHRD %d), "
+              "try without --tpacket", ifname, ifr.ifr_hwaddr.sa_family);
+   *linktype = ring->linktype;
+
+   /* Set up the ring. */
+   if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION,
+                  &ver, sizeof(ver)) == -1)
+      err(1, "setsockopt(PACKET_VERSION, TPACKET_V3) on '%s'", ifname);
+
+   memset(&req, 0, sizeof(req));
+   req.tp_block_size = ring->block_size;
+   req.tp_block_nr = ring->num_blocks;
+   req.tp_frame_size = TPACKET_FRAME_SIZE;
+   req.tp_frame_nr = (ring->block_size / TPACKET_FRAME_SIZE) *
+                     ring->num_blocks;
+   req.tp_retire_blk_tov = opt_tpacket_timeout;
+   if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING,
+                  &req, sizeof(req)) == -1)
+      err(1, "setsockopt(PACKET_RX_RING) on '%s'", ifname);
+
+   ring->map_len = (size_t)ring->block_size * ring->num_blocks;
+   ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_LOCKED, ring->fd, 0);
+   if (ring->map == MAP_FAILED) {
+      /* MAP_LOCKED can fail under RLIMIT_MEMLOCK, it's only an optimization */
+      ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ring->fd, 0);
+      if (ring->map == MAP_FAILED)
+         err(1, "mmap() of %zu byte ring for '%s'", ring->map_len, ifname);
+   }
+
+   /* Drop everything until the real filter goes in. */
+   attach_ret(ring, 0);
+
+   if (bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+      err(1, "bind() to '%s'", ifname);
+
+   if (promisc) {
+      struct packet_mreq mr;
+
+      memset(&mr, 0, sizeof(mr));
+      mr.mr_ifindex = sll.sll_ifindex;
+      mr.mr_type = PACKET_MR_PROMISC;
+      if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                     &mr, sizeof(mr)) == -1)
+         err(1, "setsockopt(PACKET_ADD_MEMBERSHIP) on '%s'", ifname);
+   }
+
+   verbosef("TPACKET_V3 ring on '%s': %u blocks of %u bytes, "
+            "retire timeout %u msec",
+            ifname, ring->num_blocks, ring->block_size, opt_tpacket_timeout);
+   return ring;
+}
+
+void tpacket_set_filter(struct tpacket_ring *ring,
+                        const char *filter,
+                        const int snaplen) {
+   struct bpf_program prog;
+   pcap_t *dead;
+   char *tmp_filter;
+
+   if (filter == NULL) {
+      attach_ret(ring, (unsigned int)snaplen);
+      return;
+   }
+
+   /* The compiled program returns snaplen for accepted packets, so it
+    * truncates for us too.
+    */
+   dead = pcap_open_dead(ring->linktype, snaplen);
+   if (dead == NULL)
+      errx(1, "pcap_open_dead() failed");
+   tmp_filter = xstrdup(filter);
+   if (pcap_compile(dead, &prog, tmp_filter, 1, 0) == -1)
+      errx(1, "pcap_compile(): %s", pcap_geterr(dead));
+   tpacket_set_prog(ring, &prog);
+   pcap_freecode(&prog);
+   pcap_close(dead);
+   free(tmp_filter);
+}
+
+void tpacket_join_fanout(struct tpacket_ring *ring, const uint16_t group) {
+   /* Hash on the flow, so both directions of a connection land on the
+    * same ring.  DEFRAG keeps fragments together with their first packet.
+    */
+   int arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+   if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT,
+                  &arg, sizeof(arg)) == -1)
+      err(1, "setsockopt(PACKET_FANOUT) on '%s'", ring->ifname);
+}
+
+int tpacket_fd(const struct tpacket_ring *ring) {
+   return ring->fd;
+}
+
+int tpacket_dispatch(struct tpacket_ring *ring,
+                     tpacket_handler *handler,
+                     u_char *user) {
+   int count = 0;
+
+   for (;;) {
+      struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+         (ring->map + (size_t)ring->cur * ring->block_size);
+      const struct tpacket3_hdr *ppd;
+      uint32_t i, num_pkts;
+
+      if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+         break; /* kernel still owns it */
+      __sync_synchronize(); /* read the block only after its status */
+
+      num_pkts = bd->hdr.bh1.num_pkts;
+      ppd = (const struct tpacket3_hdr *)
+         ((const uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+      for (i=0; i<num_pkts; i++) {
+         struct pcap_pkthdr pheader;
+
+         pheader.ts.tv_sec = ppd->tp_sec;
+         pheader.ts.tv_usec = ppd->tp_nsec / 1000;
+         pheader.caplen = ppd->tp_snaplen;
+         pheader.len = ppd->tp_len;
+         handler(user, &pheader, (const u_char *)ppd + ppd->tp_mac);
+         ppd = (const struct tpacket3_hdr *)
+            ((const uint8_t *)ppd + ppd->tp_next_offset);
+      }
+      count += num_pkts;
+
+      __sync_synchronize(); /* finish with the block before releasing it */
+      bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+      ring->cur = (ring->cur + 1) % ring->num_blocks;
+   }
+   return count;
+}
+
+void tpacket_stats(struct tpacket_ring *ring,
+                   unsigned int *recv, unsigned int *drop) {
+   struct tpacket_stats_v3 st;
+   socklen_t len = sizeof(st);
+
+   /* The kernel zeroes its counters every time we read them. */
+   if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1)
+      warn("getsockopt(PACKET_STATISTICS) on '%s'", ring->ifname);
+   else {
+      ring->pkts_recv += st.tp_packets;
+      ring->pkts_drop += st.tp_drops;
+   }
+   *recv = ring->pkts_recv;
+   *drop = ring->pkts_drop;
+}
+
+void tpacket_close(struct tpacket_ring *ring) {
+   munmap(ring->map, ring->map_len);
+   close(ring->fd);
+   free(ring);
+}
+
+#endif /* HAVE_TPACKET_V3 */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
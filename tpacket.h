@@ -0,0 +1,54 @@
+/* darkstat 3
+ * copyright (c) 2026 Emil Mikulic.
+ *
+ * tpacket.h: native Linux capture using a TPACKET_V3 memory-mapped ring.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_TPACKET_H
+#define __DARKSTAT_TPACKET_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+struct pcap_pkthdr; /* from pcap.h */
+struct tpacket_ring;
+
+/* Same shape as libpcap's pcap_handler, so cap.c can use one callback. */
+typedef void (tpacket_handler)(u_char *user,
+                               const struct pcap_pkthdr *pheader,
+                               const u_char *pdata);
+
+/* Open a ring on the named interface, returns the DLT_ linktype in
+ * *linktype.  Dies on failure.
+ */
+struct tpacket_ring *tpacket_open(const char *ifname,
+                                  const int promisc,
+                                  int *linktype);
+
+/* Attach a BPF filter (NULL for none) which also truncates frames to
+ * snaplen, so the kernel only copies the headers we decode.
+ */
+void tpacket_set_filter(struct tpacket_ring *ring,
+                        const char *filter,
+                        const int snaplen);
+
+/* Add the ring to a PACKET_FANOUT group, which spreads the interface's
+ * packets across every ring in the group by flow hash.
+ */
+void tpacket_join_fanout(struct tpacket_ring *ring, const uint16_t group);
+int tpacket_fd(const struct tpacket_ring *ring);
+
+/* Hand every frame in every ready block to the handler, in place.
+ * Returns the number of frames handled.
+ */
+int tpacket_dispatch(struct tpacket_ring *ring,
+                     tpacket_handler *handler,
+                     u_char *user);
+void tpacket_stats(struct tpacket_ring *ring,
+                   unsigned int *recv, unsigned int *drop);
+void tpacket_close(struct tpacket_ring *ring);
+
+#endif /* __DARKSTAT_TPACKET_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */